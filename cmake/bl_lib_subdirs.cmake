@@ -15,3 +15,9 @@ macro(bl_add_example_subdir)
         add_subdirectory(example)
     endif()
 endmacro()
+
+macro(bl_add_bench_subdir)
+    if(BLAMA_BUILD_BENCH)
+        add_subdirectory(bench)
+    endif()
+endmacro()
@@ -0,0 +1,170 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+// Micro-benchmark of LogitComparer against the previous implementation, which matched tokens with hash maps
+//
+#include <llama/LogitComparer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace bl::llama;
+
+namespace legacy {
+std::unordered_map<int32_t, float> softmax(const TokenDataVector& data) {
+    std::unordered_map<int32_t, float> result(data.size());
+    float maxLogit = data[0].logit;
+    float sumExp = 0.0f;
+    for (size_t i = 0; i < data.size(); ++i) {
+        float p = std::exp(data[i].logit - maxLogit);
+        result[data[i].token] = p;
+        sumExp += p;
+    }
+    for (auto& val : result) {
+        val.second /= sumExp;
+    }
+    return result;
+}
+
+float jsd(const std::unordered_map<Token, float>& probs1, const std::unordered_map<Token, float>& probs2) {
+    std::unordered_map<Token, float> avg_dist;
+    for (const auto& [token, p] : probs1) {
+        if (probs2.count(token)) {
+            avg_dist[token] = (p + probs2.at(token)) / 2.0f;
+        }
+    }
+
+    auto kl_divergence = [](const std::unordered_map<Token, float>& P, const std::unordered_map<Token, float>& Q) {
+        float kl = 0.0f;
+        for (const auto& [token, p] : P) {
+            if (p > 0.0f && Q.count(token) && Q.at(token) > 0.0f) {
+                kl += p * std::log(p / Q.at(token));
+            }
+        }
+        return kl;
+    };
+
+    return (kl_divergence(probs1, avg_dist) + kl_divergence(probs2, avg_dist)) / 2.0f;
+}
+
+float euclideanDistanceSq(const TokenData* tokens, size_t size) {
+    float distance = 0.0f;
+    for (size_t i = 0; i < size; ++i) {
+        distance += tokens[i].logit * tokens[i].logit;
+    }
+    return distance;
+}
+
+ComparisonMetrics compare(const TokenDataVector& data1, const TokenDataVector& data2) {
+    ComparisonMetrics metrics;
+    metrics.top1Match = data1[0].token == data2[0].token ? 1.0f : 0.0f;
+    const auto minSize = std::min(data1.size(), data2.size());
+    float distance1 = euclideanDistanceSq(data1.data(), minSize);
+    float distance2 = euclideanDistanceSq(data2.data(), minSize);
+    metrics.distance = std::fabs(distance1 - distance2) / std::max(distance1, distance2);
+    metrics.jsd = jsd(softmax(data1), softmax(data2));
+    return metrics;
+}
+} // namespace legacy
+
+// pairs of top-k vectors as produced by two slightly different inference runs
+std::vector<TokenPrediction> makePredictions(std::minstd_rand& rng, size_t numPositions, size_t k, float noise) {
+    std::uniform_int_distribution<Token> tokenDist(0, 150'000);
+    std::normal_distribution<float> noiseDist(0.f, noise);
+
+    std::vector<TokenPrediction> ret(numPositions);
+    for (auto& p : ret) {
+        // consecutive ids, so that they are unique
+        const auto firstToken = tokenDist(rng);
+        float logit = 20.f;
+        for (size_t i = 0; i < k; ++i) {
+            p.logits.push_back({firstToken + Token(i), logit + noiseDist(rng)});
+            logit -= 0.7f;
+        }
+        std::sort(p.logits.begin(), p.logits.end(), [](const TokenData& a, const TokenData& b) {
+            return a.logit > b.logit;
+        });
+        p.token = p.logits[0].token;
+    }
+    return ret;
+}
+
+std::vector<TokenPrediction> perturb(std::minstd_rand& rng, std::vector<TokenPrediction> preds) {
+    std::normal_distribution<float> noiseDist(0.f, 0.05f);
+    for (auto& p : preds) {
+        for (auto& l : p.logits) {
+            l.logit += noiseDist(rng);
+        }
+        // one token drops out of the top-k and another one takes its place
+        p.logits.back().token = -p.logits.back().token - 1;
+        std::sort(p.logits.begin(), p.logits.end(), [](const TokenData& a, const TokenData& b) {
+            return a.logit > b.logit;
+        });
+    }
+    return preds;
+}
+
+template <typename F>
+double nsPerPosition(size_t numPositions, int iterations, F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        f();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / double(numPositions * iterations);
+}
+
+int main(int argc, char* argv[]) {
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 20;
+    constexpr size_t numPositions = 10'000;
+
+    std::minstd_rand rng(42);
+
+    for (size_t k : {10, 40}) {
+        auto preds1 = makePredictions(rng, numPositions, k, 0.2f);
+        auto preds2 = perturb(rng, preds1);
+
+        // results must match the legacy implementation
+        float maxDiff = 0;
+        auto metrics = LogitComparer::compare(preds1, preds2);
+        for (size_t i = 0; i < numPositions; ++i) {
+            auto ref = legacy::compare(preds1[i].logits, preds2[i].logits);
+            maxDiff = std::max({
+                maxDiff,
+                std::fabs(ref.top1Match - metrics[i].top1Match),
+                std::fabs(ref.distance - metrics[i].distance),
+                std::fabs(ref.jsd - metrics[i].jsd)
+            });
+        }
+
+        volatile float sink = 0;
+
+        const auto legacyNs = nsPerPosition(numPositions, iterations, [&] {
+            for (size_t i = 0; i < numPositions; ++i) {
+                sink = sink + legacy::compare(preds1[i].logits, preds2[i].logits).jsd;
+            }
+        });
+
+        const auto singleNs = nsPerPosition(numPositions, iterations, [&] {
+            for (size_t i = 0; i < numPositions; ++i) {
+                sink = sink + LogitComparer::compare(preds1[i].logits, preds2[i].logits).jsd;
+            }
+        });
+
+        const auto batchNs = nsPerPosition(numPositions, iterations, [&] {
+            auto m = LogitComparer::compare(preds1, preds2);
+            sink = sink + m.back().jsd;
+        });
+
+        printf("top-%zu: legacy %.1f ns, single %.1f ns, batch %.1f ns per position (max diff from legacy: %g)\n",
+            k, legacyNs, singleNs, batchNs, maxDiff);
+    }
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "Batch.hpp"
+#include <cassert>
+
+namespace bl::llama {
+
+Batch::Batch(int32_t capacity)
+    : m_batch(llama_batch_init(capacity, 0, 1))
+    , m_capacity(capacity)
+{}
+
+Batch::~Batch() {
+    llama_batch_free(m_batch);
+}
+
+int32_t Batch::add(Token token, llama_pos pos, llama_seq_id seqId, bool logits) noexcept {
+    assert(m_batch.n_tokens < m_capacity);
+    const auto i = m_batch.n_tokens++;
+    m_batch.token[i] = token;
+    m_batch.pos[i] = pos;
+    m_batch.n_seq_id[i] = 1;
+    m_batch.seq_id[i][0] = seqId;
+    m_batch.logits[i] = logits;
+    return i;
+}
+
+} // namespace bl::llama
@@ -0,0 +1,36 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "Token.hpp"
+#include <llama.h>
+
+namespace bl::llama {
+
+// owning wrapper of llama_batch
+// tokens carry explicit positions and sequence ids, so a single batch can hold input for multiple sessions
+class Batch {
+public:
+    explicit Batch(int32_t capacity);
+    ~Batch();
+
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    void clear() noexcept { m_batch.n_tokens = 0; }
+
+    // add a token to the batch and return its index (which is also the index of its logits if requested)
+    int32_t add(Token token, llama_pos pos, llama_seq_id seqId, bool logits) noexcept;
+
+    int32_t size() const noexcept { return m_batch.n_tokens; }
+    int32_t capacity() const noexcept { return m_capacity; }
+    int32_t room() const noexcept { return m_capacity - m_batch.n_tokens; }
+    bool empty() const noexcept { return m_batch.n_tokens == 0; }
+
+    const llama_batch& lbatch() const noexcept { return m_batch; }
+private:
+    llama_batch m_batch;
+    int32_t m_capacity;
+};
+
+} // namespace bl::llama
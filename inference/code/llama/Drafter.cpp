@@ -0,0 +1,192 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "Drafter.hpp"
+#include "Model.hpp"
+#include "Batch.hpp"
+
+#include <llama.h>
+
+#include <bstl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace bl::llama {
+
+Drafter::~Drafter() = default;
+
+void Drafter::checkTarget(const Model&) const {}
+
+ModelDrafter::ModelDrafter(Model& model, Params params)
+    : m_params(params)
+    , m_instance(model, {
+        .ctxSize = params.ctxSize,
+        .batchSize = params.batchSize,
+        .ubatchSize = params.batchSize,
+    })
+{
+    if (model.hasEncoder()) {
+        throw_ex{} << "Models with an encoder can't be used for drafting";
+    }
+}
+
+ModelDrafter::~ModelDrafter() = default;
+
+void ModelDrafter::checkTarget(const Model& target) const {
+    auto& draftVocab = m_instance.model().vocab();
+    auto& targetVocab = target.vocab();
+    if (draftVocab.nTokens() != targetVocab.nTokens()
+        || llama_vocab_bos(draftVocab.lvocab()) != llama_vocab_bos(targetVocab.lvocab())
+        || llama_vocab_eos(draftVocab.lvocab()) != llama_vocab_eos(targetVocab.lvocab())
+    ) {
+        throw_ex{} << "Draft model vocabulary does not match the target model";
+    }
+}
+
+std::vector<Token> ModelDrafter::draft(std::span<const Token> tokens, uint32_t maxTokens) {
+    std::vector<Token> result;
+
+    auto lctx = m_instance.m_lctx.get();
+    const auto ctxLen = llama_n_ctx(lctx);
+    maxTokens = std::min(maxTokens, ctxLen / 2 - 1);
+    if (tokens.empty() || maxTokens == 0) {
+        return result;
+    }
+
+    // if the target tokens don't fit, draft from the most recent ones
+    // the window is moved by half of our context at a time, so that our decoded tokens are reused by the next drafts
+    if (m_windowStart >= tokens.size()) {
+        m_windowStart = 0;
+    }
+    if (tokens.size() - m_windowStart + maxTokens > ctxLen) {
+        m_windowStart = tokens.size() - std::min(tokens.size(), size_t(ctxLen / 2));
+    }
+    const auto window = tokens.subspan(m_windowStart);
+
+    // keep the common prefix with what we have decoded before
+    // the last token is always decoded again, as we need its logits
+    auto common = size_t(std::mismatch(m_tokens.begin(), m_tokens.end(), window.begin(), window.end()).first - m_tokens.begin());
+    common = std::min(common, window.size() - 1);
+    llama_kv_self_seq_rm(lctx, 0, llama_pos(common), -1);
+    m_tokens.resize(common);
+
+    auto& batch = *m_instance.m_batch;
+    int32_t logitsIndex = -1;
+    for (auto rest = window.subspan(common); !rest.empty(); ) {
+        const auto n = std::min(rest.size(), size_t(batch.capacity()));
+        batch.clear();
+        for (size_t i = 0; i < n; ++i) {
+            logitsIndex = batch.add(rest[i], llama_pos(m_tokens.size() + i), 0, i == n - 1);
+        }
+        if (m_instance.decode(batch) != 0) {
+            throw_ex{} << "Failed to decode draft tokens";
+        }
+        m_tokens.insert(m_tokens.end(), rest.begin(), rest.begin() + n);
+        rest = rest.subspan(n);
+    }
+
+    // greedy drafting, but only as long as the draft model is confident
+    auto& vocab = m_instance.model().vocab();
+    const auto numVocab = size_t(vocab.nTokens());
+    while (true) {
+        const std::span logits(llama_get_logits_ith(lctx, logitsIndex), numVocab);
+        const auto best = std::max_element(logits.begin(), logits.end());
+
+        // probability of the best token: softmax of its logit
+        float sum = 0;
+        for (auto l : logits) {
+            sum += std::exp(l - *best);
+        }
+        if (1 / sum < m_params.minProbability) {
+            break;
+        }
+
+        const auto token = Token(best - logits.begin());
+        result.push_back(token);
+        if (result.size() == maxTokens || vocab.isEog(token)) {
+            break;
+        }
+
+        batch.clear();
+        logitsIndex = batch.add(token, llama_pos(m_tokens.size()), 0, true);
+        if (m_instance.decode(batch) != 0) {
+            throw_ex{} << "Failed to decode draft tokens";
+        }
+        m_tokens.push_back(token);
+    }
+
+    return result;
+}
+
+namespace {
+uint64_t hashNgram(std::span<const Token> ngram) {
+    // FNV-1a over the tokens, the length is included so that n-grams of different lengths don't collide
+    uint64_t h = 0xcbf29ce484222325ull ^ ngram.size();
+    for (auto t : ngram) {
+        h ^= uint32_t(t);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+} // namespace
+
+NgramDrafter::NgramDrafter(Params params)
+    : m_params(params)
+{
+    if (m_params.minNgram == 0 || m_params.minNgram > m_params.maxNgram) {
+        throw_ex{} << "Invalid n-gram lengths: " << m_params.minNgram << " - " << m_params.maxNgram;
+    }
+}
+
+NgramDrafter::~NgramDrafter() = default;
+
+void NgramDrafter::index(size_t end) {
+    // only n-grams which are followed by a token are indexed, the latest occurrence wins
+    for (size_t i = m_numIndexed; i < end; ++i) {
+        for (uint32_t n = m_params.minNgram; n <= m_params.maxNgram && n <= i; ++n) {
+            m_index[hashNgram(std::span(m_tokens).subspan(i - n, n))] = uint32_t(i);
+        }
+    }
+    m_numIndexed = end;
+}
+
+std::vector<Token> NgramDrafter::draft(std::span<const Token> tokens, uint32_t maxTokens) {
+    std::vector<Token> result;
+
+    // typically the tokens are the previous ones plus a few generated ones
+    // otherwise (for example after a context shift) the index is rebuilt
+    if (tokens.size() < m_tokens.size() || !std::equal(m_tokens.begin(), m_tokens.end(), tokens.begin())) {
+        m_tokens.clear();
+        m_index.clear();
+        m_numIndexed = 0;
+    }
+    m_tokens.insert(m_tokens.end(), tokens.begin() + m_tokens.size(), tokens.end());
+    index(m_tokens.size());
+
+    if (maxTokens == 0) {
+        return result;
+    }
+
+    for (uint32_t n = std::min(m_params.maxNgram, uint32_t(m_tokens.size())); n >= m_params.minNgram; --n) {
+        const auto tail = std::span(m_tokens).last(n);
+        auto it = m_index.find(hashNgram(tail));
+        if (it == m_index.end()) {
+            continue;
+        }
+
+        const size_t next = it->second;
+        if (!std::equal(tail.begin(), tail.end(), m_tokens.begin() + (next - n))) {
+            continue; // collision
+        }
+
+        // propose what followed the previous occurrence
+        const auto end = std::min(m_tokens.size(), next + maxTokens);
+        result.assign(m_tokens.begin() + next, m_tokens.begin() + end);
+        break;
+    }
+
+    return result;
+}
+
+} // namespace bl::llama
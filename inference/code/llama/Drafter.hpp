@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include "Token.hpp"
+#include "Instance.hpp"
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace bl::llama {
+class Model;
+
+// proposes tokens for speculative decoding (see Session::InitParams::drafter)
+// the session decodes the proposal together with its last token and keeps the longest prefix which matches
+// what it samples itself, so a bad proposal only costs the wasted batch positions
+class BL_LLAMA_API Drafter {
+public:
+    virtual ~Drafter();
+
+    // throw if the drafts can't be used by sessions of the target model
+    virtual void checkTarget(const Model& target) const;
+
+    // propose up to maxTokens tokens which are likely to follow tokens
+    // tokens are the ones in the context of the session (the last one being its last sampled token)
+    virtual std::vector<Token> draft(std::span<const Token> tokens, uint32_t maxTokens) = 0;
+};
+
+// drafts with a smaller model which has the same vocabulary as the target
+// (for example a lower-quantized version of the same model)
+// the draft model keeps its own context and only decodes the tokens which were not drafted by it before
+// a model drafter tracks a single sequence, so use one per concurrently generating session
+class BL_LLAMA_API ModelDrafter final : public Drafter {
+public:
+    struct Params {
+        uint32_t ctxSize = 0; // context size of the draft model (0 = maximum allowed by model)
+        uint32_t batchSize = 512; // batch size for catching up with the target tokens
+
+        // stop drafting when the draft model is less confident than this in its next token
+        float minProbability = 0.75f;
+    };
+
+    ModelDrafter(Model& model, Params params);
+    ~ModelDrafter();
+
+    virtual void checkTarget(const Model& target) const override;
+    virtual std::vector<Token> draft(std::span<const Token> tokens, uint32_t maxTokens) override;
+
+private:
+    Params m_params;
+    Instance m_instance;
+
+    size_t m_windowStart = 0; // index of the first target token in our context
+    std::vector<Token> m_tokens; // tokens in our context
+};
+
+// prompt lookup: drafts by finding the last tokens earlier in the context and proposing what followed them
+// no model is needed and it's very effective when the output repeats parts of the input
+// (summaries, code edits, extraction)
+// the index is updated incrementally as long as the tokens are a continuation of the previous ones,
+// so use one per concurrently generating session
+class BL_LLAMA_API NgramDrafter final : public Drafter {
+public:
+    struct Params {
+        uint32_t minNgram = 2; // length of the shortest n-gram to look up
+        uint32_t maxNgram = 4; // length of the longest n-gram to look up (longer matches are tried first)
+    };
+
+    explicit NgramDrafter(Params params);
+    ~NgramDrafter();
+
+    virtual std::vector<Token> draft(std::span<const Token> tokens, uint32_t maxTokens) override;
+
+private:
+    void index(size_t end);
+
+    Params m_params;
+    std::vector<Token> m_tokens; // indexed tokens
+
+    // hash of an n-gram -> index of the token which followed its latest occurrence
+    // hashes may collide, so the n-grams are compared on lookup
+    std::unordered_map<uint64_t, uint32_t> m_index;
+    size_t m_numIndexed = 0; // n-grams followed by tokens up to this index are in the index
+};
+
+} // namespace bl::llama
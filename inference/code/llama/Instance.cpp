@@ -7,6 +7,7 @@
 #include "Logging.hpp"
 #include "Session.hpp"
 #include "ControlVector.hpp"
+#include "Batch.hpp"
 
 #include <llama.h>
 
@@ -14,6 +15,7 @@
 #include <bstl/iile.h>
 #include <bstl/move.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <span>
 #include <fstream>
@@ -27,6 +29,7 @@ llama_context_params llamaFromInstanceInitParams(const Instance::InitParams& par
     llamaParams.n_batch = params.batchSize;
     llamaParams.n_ubatch = params.ubatchSize;
     llamaParams.flash_attn = params.flashAttn;
+    llamaParams.n_seq_max = std::max(params.maxSessions, 1u);
     return llamaParams;
 }
 } // namespace
@@ -45,6 +48,14 @@ Instance::Instance(Model& model, InitParams params)
     if (ctxLen > ctxTrain) {
         LLAMA_LOG(Warning, "Instance requested context length ", ctxLen, " is greater than the model's training context length ", ctxTrain);
     }
+
+    m_batch = std::make_unique<Batch>(int32_t(llama_n_batch(m_lctx.get())));
+    m_sessions = std::vector<std::optional<Session>>(llama_n_seq_max(m_lctx.get()));
+
+    if (m_sessions.size() > 1 && model.hasEncoder()) {
+        // the encoder output is per context and not per sequence
+        throw_ex{} << "Models with an encoder support only one session per instance";
+    }
 }
 
 Instance::~Instance() = default;
@@ -113,22 +124,100 @@ void Instance::warmup() {
         tmp.push_back(decoder_start_token_id);
     }
     llama_decode(lctx, makeInputBatch(tmp));
+    ++m_decodeCount;
     llama_kv_self_clear(lctx);
     llama_synchronize(lctx);
     llama_perf_context_reset(lctx);
 }
 
-Session& Instance::startSession(const Session::InitParams params) {
-    if (m_session.has_value()) {
-        throw_ex{} << "Session is already started. Stop it to start a new one.";
+std::optional<Session>& Instance::freeSessionSlot() {
+    auto free = std::find_if(m_sessions.begin(), m_sessions.end(), [](const std::optional<Session>& s) {
+        return !s.has_value();
+    });
+
+    if (free == m_sessions.end()) {
+        if (m_sessions.size() == 1) {
+            throw_ex{} << "Session is already started. Stop it to start a new one.";
+        }
+        throw_ex{} << "All " << m_sessions.size() << " sessions are already started. Stop one to start a new one.";
     }
 
-    m_session.emplace(*this, m_lctx.get(), params);
-    return *m_session;
+    return *free;
+}
+
+Session& Instance::startSession(const Session::InitParams params) {
+    auto& slot = freeSessionSlot();
+    const auto seqId = int32_t(&slot - m_sessions.data());
+    slot.emplace(*this, m_lctx.get(), params, seqId);
+    return *slot;
 }
 
 void Instance::stopSession() noexcept {
-    m_session.reset();
+    for (auto& s : m_sessions) {
+        s.reset();
+    }
+}
+
+void Instance::stopSession(Session& session) noexcept {
+    auto& slot = m_sessions[session.seqId()];
+    assert(slot.has_value() && &*slot == &session);
+    slot.reset();
+}
+
+uint32_t Instance::numActiveSessions() const noexcept {
+    return uint32_t(std::count_if(m_sessions.begin(), m_sessions.end(), [](const std::optional<Session>& s) {
+        return s.has_value();
+    }));
+}
+
+Instance::BatchInfo Instance::decodeBatch(std::span<Session* const> sessions, uint32_t maxPromptTokens) {
+    auto& batch = *m_batch;
+    batch.clear();
+
+    BatchInfo info;
+    for (auto s : sessions) {
+        if (&s->m_instance != this) {
+            throw_ex{} << "Session does not belong to this instance";
+        }
+        if (s->m_state.m_currToken != Token_Invalid && batch.room() > 0) {
+            info.generatedTokens += s->fillBatch(batch, 1);
+        }
+    }
+
+    auto promptRoom = uint32_t(batch.room());
+    if (maxPromptTokens) {
+        promptRoom = std::min(promptRoom, maxPromptTokens);
+    }
+    for (auto s : sessions) {
+        if (info.promptTokens == promptRoom) break;
+        if (s->m_state.m_currToken == Token_Invalid) {
+            info.promptTokens += s->fillBatch(batch, promptRoom - info.promptTokens);
+        }
+    }
+
+    if (batch.empty()) return info;
+
+    if (decode(batch) != 0) {
+        for (auto s : sessions) {
+            s->m_state.promptToCache.clear();
+        }
+        throw_ex{} << "Failed to decode batch";
+    }
+
+    for (auto s : sessions) {
+        s->cachePromptState();
+    }
+
+    return info;
+}
+
+uint32_t Instance::ubatchSize() const noexcept {
+    return llama_n_ubatch(m_lctx.get());
+}
+
+int Instance::decode(const Batch& batch) {
+    ++m_decodeCount;
+    return llama_decode(m_lctx.get(), batch.lbatch());
 }
 
 } // namespace bl::llama
@@ -6,6 +6,9 @@
 #include "Session.hpp"
 #include <bstl/mem_ext.hpp>
 #include <optional>
+#include <memory>
+#include <span>
+#include <vector>
 
 struct llama_context;
 
@@ -15,6 +18,8 @@ class Session;
 class StringSession;
 class LoraAdapter;
 class ControlVector;
+class Batch;
+class PrefixCache;
 
 class BL_LLAMA_API Instance {
 public:
@@ -23,6 +28,10 @@ public:
         uint32_t batchSize = 2048; // logical batch size for prompt processing (may be silently truncated to ctxSize)
         uint32_t ubatchSize = 512; // physical batch size for prompt processing (0 = batchSize)
         bool flashAttn = false; // enable flash attention
+
+        // max number of concurrently active sessions
+        // each session is a separate sequence in the shared KV cache and gets ctxSize / maxSessions of it
+        uint32_t maxSessions = 1;
     };
 
     explicit Instance(Model& model, InitParams params);
@@ -38,16 +47,61 @@ public:
     // do an empty model run to load model data in cache
     void warmup();
 
-    // only one session per instance can be active at a time
+    // up to InitParams::maxSessions sessions can be active at a time
+    // each session is a separate sequence in the KV cache with its own state and sampler
+    // sessions of an instance can be used interleaved, but only from one thread at a time
+    // more sessions can be started with Session::fork
     Session& startSession(const Session::InitParams params);
+
+    // stop all active sessions
     void stopSession() noexcept;
 
+    void stopSession(Session& session) noexcept;
+
+    struct BatchInfo {
+        uint32_t generatedTokens = 0; // number of generated tokens in the batch
+        uint32_t promptTokens = 0; // number of prompt tokens in the batch
+    };
+
+    // decode the pending input of multiple sessions of this instance with a single llama_decode call
+    // each session contributes its last generated token and/or a chunk of its queued prompt (see Session::queueInitialPrompt)
+    // generated tokens are added first, so prompt processing never starves generation
+    // maxPromptTokens limits the prompt tokens in the batch (0 = as many as fit), so that long prompts are
+    // processed in chunks which don't hold back the generation of the other sessions for too long
+    // prompts which don't fit in the batch are continued by subsequent calls
+    BatchInfo decodeBatch(std::span<Session* const> sessions, uint32_t maxPromptTokens = 0);
+
+    // sessions started after this call reuse the KV state of cached prompt prefixes and add their prompts to the cache
+    // the cache can be shared by instances of the same model with the same context params
+    // pass null to disable
+    void setPrefixCache(std::shared_ptr<PrefixCache> cache) noexcept { m_prefixCache = std::move(cache); }
+    PrefixCache* prefixCache() const noexcept { return m_prefixCache.get(); }
+
+    uint32_t maxSessions() const noexcept { return uint32_t(m_sessions.size()); }
+    uint32_t ubatchSize() const noexcept; // physical batch size
+    uint32_t numActiveSessions() const noexcept;
+
     Model& model() const noexcept { return m_model; }
 
 private:
+    friend class Session;
+    friend class ModelDrafter;
+
     Model& m_model;
     bstl::c_unique_ptr<llama_context> m_lctx;
-    std::optional<Session> m_session;
+    std::unique_ptr<Batch> m_batch; // reused for all decode calls
+
+    // every decode overwrites the logits of the context
+    // sessions compare this to the count of their last decode to know whether their logits are still there
+    uint64_t m_decodeCount = 0;
+    int decode(const Batch& batch);
+
+    // throws if all sessions are started
+    std::optional<Session>& freeSessionSlot();
+    std::shared_ptr<PrefixCache> m_prefixCache;
+
+    // index is the KV cache sequence id of the session
+    std::vector<std::optional<Session>> m_sessions;
 };
 
 } // namespace bl::llama
@@ -2,74 +2,154 @@
 // SPDX-License-Identifier: MIT
 //
 #include "LogitComparer.hpp"
+#include <itlib/small_vector.hpp>
 #include <cmath>
+#include <algorithm>
+
+namespace bl::llama {
 
 namespace {
-std::unordered_map<int32_t, float> softmax(const bl::llama::TokenDataVector& data) {
-    std::unordered_map<int32_t, float> result(data.size());
+// inline capacity of the temporary buffers, enough for typical top-k vectors without allocation
+constexpr size_t InlineTokens = 32;
+
+using TokenBuf = itlib::small_vector<TokenData, InlineTokens>;
+using FloatBuf = itlib::small_vector<float, InlineTokens>;
+
+bool tokenLess(const TokenData& a, const TokenData& b) {
+    return a.token < b.token;
+}
 
-    // Step 1: Find max logit to subtract for numerical stability
-    float maxLogit = data[0].logit;
+// temporary buffers for a comparison
+struct Scratch {
+    TokenBuf probs1, probs2; // softmax of the inputs, sorted by token
+    FloatBuf common1, common2; // probabilities of the tokens present in both, aligned
+};
+
+// data is expected to be sorted by logit in descending order, so the first logit is the max
+// (subtracting it is for numerical stability)
+// the result is sorted by token
+void softmaxByToken(std::span<const TokenData> data, TokenBuf& out) {
+    out.resize(data.size());
+
+    const float maxLogit = data[0].logit;
 
-    // Step 2: Compute exp(logit - maxLogit) for each element
     float sumExp = 0.0f;
     for (size_t i = 0; i < data.size(); ++i) {
-        float p = std::exp(data[i].logit - maxLogit);
-        result[data[i].token] = p;
+        const float p = std::exp(data[i].logit - maxLogit);
+        out[i] = {data[i].token, p};
         sumExp += p;
     }
 
-    // Step 3: Normalize to get probabilities
-    for (auto& val : result) {
-        val.second /= sumExp;
+    for (auto& o : out) {
+        o.logit /= sumExp;
     }
 
-    return result;
+    std::sort(out.begin(), out.end(), tokenLess);
 }
+
+// align the values of the tokens which are present in both (token-sorted) inputs
+void intersect(const TokenBuf& a, const TokenBuf& b, FloatBuf& outA, FloatBuf& outB) {
+    outA.clear();
+    outB.clear();
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a[i].token < b[j].token) {
+            ++i;
+        }
+        else if (b[j].token < a[i].token) {
+            ++j;
+        }
+        else {
+            outA.push_back(a[i++].logit);
+            outB.push_back(b[j++].logit);
+        }
+    }
 }
 
-namespace bl::llama {
+// Jensen-Shannon divergence over the common tokens
+// a single pass over contiguous arrays
+float jsd(const FloatBuf& p, const FloatBuf& q) {
+    float kl1 = 0.0f, kl2 = 0.0f;
+    for (size_t i = 0; i < p.size(); ++i) {
+        const float m = (p[i] + q[i]) / 2.0f;
+        if (m <= 0.0f) continue;
+        if (p[i] > 0.0f) kl1 += p[i] * std::log(p[i] / m);
+        if (q[i] > 0.0f) kl2 += q[i] * std::log(q[i] / m);
+    }
+    return (kl1 + kl2) / 2.0f;
+}
+
+float euclideanDistanceSq(std::span<const TokenData> tokens) {
+    float distance = 0.0f;
+    for (auto& t : tokens) {
+        distance += t.logit * t.logit;
+    }
+
+    // To achieve total result, we need to take the square root of the sum,
+    // but since we don't need it to be accurate, we can skip it
+    return distance;
+}
+
+ComparisonMetrics compareWith(Scratch& scratch, const TokenDataVector& data1, const TokenDataVector& data2) {
+    if (data1.empty() || data2.empty()) {
+        // nothing to compare: worst possible result
+        return {.top1Match = 0.0f, .distance = 1.0f, .jsd = 1.0f};
+    }
 
-// Generate 4 step comparison
-// 1. Compare the top1 token
-// 2. Compare the euclidean distance of the logits
-//  - If the distance is ≤ 2% of the max distance, we can consider them equal
-// 3. Compare the Jensen-Shannon divergence of the probabilities
-//  - If the divergence is ≤ 0.05, we can consider them equal
-ComparisonMetrics LogitComparer::compare(const TokenDataVector& data1, const TokenDataVector& data2) {
     ComparisonMetrics metrics;
     metrics.top1Match = data1[0].token == data2[0].token ? 1.0f : 0.0f;
 
     const auto minSize = std::min(data1.size(), data2.size());
-    float distance1 = euclidean_distance_sq({data1.data(), minSize});
-    float distance2 = euclidean_distance_sq({data2.data(), minSize});
+    float distance1 = euclideanDistanceSq({data1.data(), minSize});
+    float distance2 = euclideanDistanceSq({data2.data(), minSize});
 
     metrics.distance = std::fabs(distance1 - distance2) / std::max(distance1, distance2);
 
-    auto prob_map = softmax(data1);
-    auto prob_map2 = softmax(data2);
+    softmaxByToken(data1, scratch.probs1);
+    softmaxByToken(data2, scratch.probs2);
+    intersect(scratch.probs1, scratch.probs2, scratch.common1, scratch.common2);
 
-    metrics.jsd = jsd(prob_map, prob_map2);
+    metrics.jsd = jsd(scratch.common1, scratch.common2);
 
     return metrics;
 }
+} // namespace
 
-float LogitComparer::logitSimilarity(const TokenDataVector& data1, const TokenDataVector& data2) {
-    std::unordered_map<int32_t, float> l_map, l2_map;
+// Generate 4 step comparison
+// 1. Compare the top1 token
+// 2. Compare the euclidean distance of the logits
+//  - If the distance is ≤ 2% of the max distance, we can consider them equal
+// 3. Compare the Jensen-Shannon divergence of the probabilities
+//  - If the divergence is ≤ 0.05, we can consider them equal
+ComparisonMetrics LogitComparer::compare(const TokenDataVector& data1, const TokenDataVector& data2) {
+    Scratch scratch;
+    return compareWith(scratch, data1, data2);
+}
 
-    for (const auto& t : data1) l_map[t.token] = t.logit;
-    for (const auto& t : data2) l2_map[t.token] = t.logit;
+std::vector<ComparisonMetrics> LogitComparer::compare(std::span<const TokenPrediction> predictions1, std::span<const TokenPrediction> predictions2) {
+    const auto size = std::min(predictions1.size(), predictions2.size());
+
+    Scratch scratch;
+    std::vector<ComparisonMetrics> result;
+    result.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        result.push_back(compareWith(scratch, predictions1[i].logits, predictions2[i].logits));
+    }
+    return result;
+}
 
-    auto prob1 = softmax(data1);
-    auto prob2 = softmax(data2);
+float LogitComparer::logitSimilarity(const TokenDataVector& data1, const TokenDataVector& data2) {
+    TokenBuf sorted2(data2.begin(), data2.end());
+    std::sort(sorted2.begin(), sorted2.end(), tokenLess);
 
     float weightedSimSum = 0.0f;
     float totalWeight = 0.0f;
     for (auto& t : data1) {
         float weight = std::abs(t.logit);
         float sim = 0.0f;
-        if (l2_map.count(t.token)) {
-            sim = 1 - (std::abs(t.logit - l2_map[t.token]) / std::abs(std::max(t.logit, l2_map[t.token])));
+        auto it = std::lower_bound(sorted2.begin(), sorted2.end(), t, tokenLess);
+        if (it != sorted2.end() && it->token == t.token) {
+            sim = 1 - (std::abs(t.logit - it->logit) / std::abs(std::max(t.logit, it->logit)));
         }
 
         weightedSimSum += weight * sim;
@@ -79,52 +159,47 @@ float LogitComparer::logitSimilarity(const TokenDataVector& data1, const TokenDa
     return totalWeight > 0.0f ? (weightedSimSum / totalWeight) : 0.0f;
 }
 
-float LogitComparer::jsd(const std::unordered_map<Token, float>& probs1, const std::unordered_map<Token, float>& probs2) {
-    std::unordered_map<Token, float> avg_dist;
-    for (const auto& [token, p] : probs1) {
-        if (probs2.count(token)) {
-            avg_dist[token] = (p + probs2.at(token)) / 2.0f;
-        }
+void MetricsAggregator::push(std::span<const ComparisonMetrics> m) {
+    m_metrics.insert(m_metrics.end(), m.begin(), m.end());
+    for (auto& pm : m) {
+        m_scoreSums.push_back(m_scoreSums.back() + positionScore(pm));
     }
+}
 
-    auto kl_divergence = [](const std::unordered_map<Token, float>& P, const std::unordered_map<Token, float>& Q) {
-        float kl = 0.0f;
-        for (const auto& [token, p] : P) {
-            if (p > 0.0f && Q.count(token) && Q.at(token) > 0.0f) {
-                kl += p * std::log(p / Q.at(token));
-            }
-        }
-        return kl;
-    };
-
-    auto div1 = kl_divergence(probs1, avg_dist);
-    auto div2 = kl_divergence(probs2, avg_dist);
+float MetricsAggregator::pushAndVerify(std::span<const ComparisonMetrics> m) {
+    push(m);
+    return score();
+}
 
-    return (div1 + div2) / 2.0f;
+float MetricsAggregator::score() const noexcept {
+    return windowScore(0, size());
 }
 
-float LogitComparer::euclidean_distance_sq(std::span<const TokenData> tokens) {
-    float distance = 0.0f;
-    for (auto& t : tokens) {
-        distance += t.logit * t.logit;
-    }
+float MetricsAggregator::positionScore(const ComparisonMetrics& m) noexcept {
+    return float(
+        0.5 * (1.0f - m.distance) +
+        0.5 * (1.0f - m.jsd)
+    );
+}
 
-    // To achieve total result, we need to take the square root of the sum,
-    // but since we don't need it to be accurate, we can skip it
-    return distance;
+float MetricsAggregator::windowScore(size_t begin, size_t size) const noexcept {
+    const auto end = std::min(begin + size, this->size());
+    if (begin >= end) return 0;
+    return float((m_scoreSums[end] - m_scoreSums[begin]) / double(end - begin));
 }
 
-float MetricsAggregator::pushAndVerify(std::span<const ComparisonMetrics> m) {
-    metrics.insert(metrics.end(), m.begin(), m.end());
+MetricsAggregator::Window MetricsAggregator::worstWindow(size_t size) const noexcept {
+    size = std::min(size, this->size());
+    if (size == 0) return {};
 
-    double total = 0.0f;
-    for (auto& m : metrics) {
-        total +=
-            0.5 * (1.0f - m.distance) +
-            0.5 * (1.0f - m.jsd);
+    Window worst = {0, size, windowScore(0, size)};
+    for (size_t begin = 1; begin + size <= this->size(); ++begin) {
+        auto s = windowScore(begin, size);
+        if (s < worst.score) {
+            worst = {begin, size, s};
+        }
     }
-
-    return float(total / metrics.size());
+    return worst;
 }
 
 }
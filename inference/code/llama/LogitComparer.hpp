@@ -4,8 +4,8 @@
 #pragma once
 #include "api.h"
 #include "Token.hpp"
-#include <unordered_map>
 #include <span>
+#include <vector>
 
 namespace bl::llama {
 
@@ -14,22 +14,55 @@ struct ComparisonMetrics {
     float distance;
     float jsd;
 };
+
+// the compared vectors are expected to be sorted by logit in descending order (as produced by Session)
+// internally they are matched by token with a merge over token-sorted copies, so there is no hashing
 class BL_LLAMA_API LogitComparer {
 public:
 
     static ComparisonMetrics compare(const TokenDataVector& data1, const TokenDataVector& data2);
     static float logitSimilarity(const TokenDataVector& data1, const TokenDataVector& data2);
 
-private:
-    static float jsd(const std::unordered_map<Token, float>& logits1, const std::unordered_map<Token, float>& logits2);
-    static float euclidean_distance_sq(std::span<const TokenData> tokens);
+    // compare consecutive positions (the first min(size1, size2) of them)
+    // cheaper than comparing each position separately as the temporary buffers are reused
+    static std::vector<ComparisonMetrics> compare(std::span<const TokenPrediction> predictions1, std::span<const TokenPrediction> predictions2);
 };
 
 
+// aggregates the comparison metrics of consecutive positions (tokens) of a response
+// the score of a position is in [0, 1], 1 meaning identical logits
+// running sums are kept, so all scores are O(1) to get, except for worstWindow which is O(N)
 struct BL_LLAMA_API MetricsAggregator {
+    // add the metrics of the next positions
+    void push(std::span<const ComparisonMetrics> m);
+
+    // push and return the score
     float pushAndVerify(std::span<const ComparisonMetrics> m);
 
+    // mean score of all positions (0 if there are none)
+    float score() const noexcept;
+
+    size_t size() const noexcept { return m_metrics.size(); }
+
+    static float positionScore(const ComparisonMetrics& m) noexcept;
+    float positionScore(size_t pos) const noexcept { return positionScore(m_metrics[pos]); }
+    const ComparisonMetrics& positionMetrics(size_t pos) const noexcept { return m_metrics[pos]; }
+
+    // mean score of the positions [begin, begin + size), clamped to the pushed ones
+    float windowScore(size_t begin, size_t size) const noexcept;
+
+    struct Window {
+        size_t begin = 0;
+        size_t size = 0;
+        float score = 0;
+    };
+
+    // the window of the given size with the lowest score
+    // if there are fewer positions, the window is all of them
+    Window worstWindow(size_t size) const noexcept;
+
 private:
-    std::vector<ComparisonMetrics> metrics;
+    std::vector<ComparisonMetrics> m_metrics;
+    std::vector<double> m_scoreSums = {0.0}; // m_scoreSums[i] is the sum of the scores of the first i positions
 };
 }
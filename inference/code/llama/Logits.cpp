@@ -0,0 +1,98 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "Logits.hpp"
+#include <algorithm>
+#include <cassert>
+
+namespace bl::llama {
+
+TokenDataVector topKLogits(std::span<const float> logits, uint32_t k) {
+    const size_t size = logits.size();
+    const size_t numTop = std::min(size_t(k), size);
+
+    TokenDataVector top;
+    top.reserve(numTop);
+    if (numTop == 0) {
+        return top;
+    }
+
+    for (size_t i = 0; i < numTop; ++i) {
+        top.push_back({Token(i), logits[i]});
+    }
+    std::sort(top.begin(), top.end(), [](const TokenData& a, const TokenData& b) {
+        return a.logit > b.logit;
+    });
+
+    float threshold = top.back().logit;
+
+    auto push = [&](size_t i) {
+        const float logit = logits[i];
+        if (!(logit > threshold)) return; // also skips NaN
+
+        auto pos = std::upper_bound(top.begin(), top.end(), logit, [](float l, const TokenData& t) {
+            return l > t.logit;
+        }) - top.begin();
+        top.pop_back();
+        top.insert(top.begin() + pos, {Token(i), logit});
+        threshold = top.back().logit;
+    };
+
+    // with a small k the threshold quickly gets high enough for almost all blocks to be skipped
+    // the block check has no branches, so it gets vectorized
+    constexpr size_t Block = 16;
+    size_t i = numTop;
+    for (; i + Block <= size; i += Block) {
+        const float* block = logits.data() + i;
+        int numAbove = 0;
+        for (size_t j = 0; j < Block; ++j) {
+            numAbove += block[j] > threshold;
+        }
+        if (numAbove == 0) continue;
+
+        for (size_t j = 0; j < Block; ++j) {
+            push(i + j);
+        }
+    }
+    for (; i < size; ++i) {
+        push(i);
+    }
+
+    return top;
+}
+
+TokenDataVector gatherLogits(std::span<const float> logits, std::span<const TokenData> tokens) {
+    TokenDataVector res;
+    res.reserve(tokens.size());
+    for (auto& t : tokens) {
+        if (t.token < 0 || size_t(t.token) >= logits.size()) continue;
+        res.push_back({t.token, logits[t.token]});
+    }
+
+    // the token is a tie-breaker, so that duplicates are adjacent
+    std::sort(res.begin(), res.end(), [](const TokenData& a, const TokenData& b) {
+        if (a.logit != b.logit) return a.logit > b.logit;
+        return a.token < b.token;
+    });
+    res.erase(std::unique(res.begin(), res.end(), [](const TokenData& a, const TokenData& b) {
+        return a.token == b.token;
+    }), res.end());
+
+    return res;
+}
+
+std::vector<TokenPrediction> gatherLogits(std::span<const float> rows, size_t vocabSize, std::span<const TokenPrediction> predictions) {
+    assert(rows.size() >= predictions.size() * vocabSize);
+
+    std::vector<TokenPrediction> res;
+    res.reserve(predictions.size());
+    for (size_t i = 0; i < predictions.size(); ++i) {
+        res.push_back({
+            .token = predictions[i].token,
+            .logits = gatherLogits(rows.subspan(i * vocabSize, vocabSize), predictions[i].logits)
+        });
+    }
+    return res;
+}
+
+} // namespace bl::llama
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include "Token.hpp"
+#include <span>
+
+namespace bl::llama {
+
+// kernels over raw logits (one float per vocabulary entry, the index being the token)
+
+// the k largest logits (or all if there are fewer), sorted in descending order
+// the logits are scanned in blocks against the current k-th largest value, so only the rare blocks
+// which contain a candidate are inspected one by one
+// the only allocation is the result
+BL_LLAMA_API TokenDataVector topKLogits(std::span<const float> logits, uint32_t k);
+
+// the logits of the given tokens (their logit values are ignored), sorted in descending order
+// tokens outside of the vocabulary and duplicates are skipped
+BL_LLAMA_API TokenDataVector gatherLogits(std::span<const float> logits, std::span<const TokenData> tokens);
+
+// gather for consecutive positions
+// rows holds the logits of each position one after the other, vocabSize per position
+// the result has the token of each prediction and the logits of its position gathered for the tokens in its logits
+BL_LLAMA_API std::vector<TokenPrediction> gatherLogits(std::span<const float> rows, size_t vocabSize, std::span<const TokenPrediction> predictions);
+
+} // namespace bl::llama
@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "MappedFile.hpp"
+
+#include <bstl/throw_stdex.hpp>
+
+#if defined(_WIN32)
+#   define WIN32_LEAN_AND_MEAN
+#   define NOMINMAX
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+namespace bl::llama {
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string& path, Mode mode, size_t size) {
+    const bool write = mode == Mode::Write;
+    auto file = CreateFileA(path.c_str(),
+        write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        write ? 0 : FILE_SHARE_READ,
+        nullptr,
+        write ? CREATE_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw_ex{} << "Failed to open " << path;
+    }
+
+    if (!write) {
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            CloseHandle(file);
+            throw_ex{} << "Failed to get the size of " << path;
+        }
+        size = size_t(fileSize.QuadPart);
+    }
+    if (size == 0) {
+        CloseHandle(file);
+        throw_ex{} << "Can't map empty file " << path;
+    }
+
+    // for writing, the mapping extends the file to its size
+    const auto size64 = uint64_t(size);
+    auto mapping = CreateFileMappingA(file, nullptr, write ? PAGE_READWRITE : PAGE_READONLY,
+        DWORD(size64 >> 32), DWORD(size64 & 0xffffffff), nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        throw_ex{} << "Failed to map " << path;
+    }
+
+    auto view = MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping);
+    if (!view) {
+        throw_ex{} << "Failed to map " << path;
+    }
+
+    m_data = static_cast<uint8_t*>(view);
+    m_size = size;
+}
+
+MappedFile::~MappedFile() {
+    UnmapViewOfFile(m_data);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path, Mode mode, size_t size) {
+    const bool write = mode == Mode::Write;
+    const int fd = write ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw_ex{} << "Failed to open " << path;
+    }
+
+    if (write) {
+        if (ftruncate(fd, off_t(size)) != 0) {
+            close(fd);
+            throw_ex{} << "Failed to resize " << path;
+        }
+    }
+    else {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw_ex{} << "Failed to get the size of " << path;
+        }
+        size = size_t(st.st_size);
+    }
+    if (size == 0) {
+        close(fd);
+        throw_ex{} << "Can't map empty file " << path;
+    }
+
+    // the mapping keeps the file open
+    auto addr = mmap(nullptr, size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw_ex{} << "Failed to map " << path;
+    }
+
+    m_data = static_cast<uint8_t*>(addr);
+    m_size = size;
+}
+
+MappedFile::~MappedFile() {
+    munmap(m_data, m_size);
+}
+
+#endif
+
+} // namespace bl::llama
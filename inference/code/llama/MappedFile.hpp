@@ -0,0 +1,33 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace bl::llama {
+
+// a whole file mapped in memory
+// for writing the file is created (or truncated) with the given size and the writes go straight to it
+class MappedFile {
+public:
+    enum class Mode {
+        Read,
+        Write,
+    };
+
+    MappedFile(const std::string& path, Mode mode, size_t size = 0);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::span<uint8_t> data() const noexcept { return {m_data, m_size}; }
+
+private:
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+} // namespace bl::llama
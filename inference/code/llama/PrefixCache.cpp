@@ -0,0 +1,160 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "PrefixCache.hpp"
+
+namespace bl::llama {
+
+PrefixCache::PrefixCache(Params params)
+    : m_params(params)
+{}
+
+PrefixCache::~PrefixCache() {
+    clear();
+}
+
+PrefixCache::Match PrefixCache::find(std::span<const Token> tokens) {
+    std::lock_guard lock(m_mutex);
+
+    // follow the tokens as far as possible
+    // nodes only exist as long as there are entries in their subtree, so any node we reach leads to a state
+    Node* node = &m_root;
+    for (auto t : tokens) {
+        auto it = node->children.find(t);
+        if (it == node->children.end()) break;
+        node = it->second.get();
+    }
+
+    if (node->depth == 0 || node->depth < m_params.minTokens) {
+        ++m_stats.misses;
+        return {};
+    }
+
+    // any state in the subtree shares the prefix, take the first one we find
+    Node* entryNode = node;
+    while (!entryNode->entry) {
+        entryNode = entryNode->children.begin()->second.get();
+    }
+
+    auto entry = *entryNode->entry;
+    m_entries.splice(m_entries.begin(), m_entries, entry); // mark as most recently used
+
+    ++m_stats.hits;
+    m_stats.hitTokens += node->depth;
+
+    return {
+        .length = node->depth,
+        .stateLength = entryNode->depth,
+        .state = entry->state
+    };
+}
+
+void PrefixCache::insert(std::span<const Token> tokens, std::vector<uint8_t> state) {
+    if (tokens.empty() || tokens.size() < m_params.minTokens || state.size() > m_params.maxBytes) {
+        return;
+    }
+
+    std::lock_guard lock(m_mutex);
+
+    Node* node = &m_root;
+    for (auto t : tokens) {
+        auto it = node->children.find(t);
+        if (it == node->children.end()) {
+            auto child = std::make_unique<Node>();
+            child->parent = node;
+            child->token = t;
+            child->depth = node->depth + 1;
+            it = node->children.emplace(t, std::move(child)).first;
+        }
+        node = it->second.get();
+    }
+
+    // states of shorter prefixes of tokens are superseded by this one
+    for (auto p = node->parent; p; p = p->parent) {
+        if (p->entry) {
+            removeEntry(p);
+        }
+    }
+
+    const auto size = state.size();
+    auto ptr = std::make_shared<const std::vector<uint8_t>>(std::move(state));
+
+    if (node->entry) {
+        auto entry = *node->entry;
+        m_stats.bytes -= entry->state->size();
+        entry->state = std::move(ptr);
+        m_entries.splice(m_entries.begin(), m_entries, entry);
+    }
+    else {
+        m_entries.push_front({node, std::move(ptr)});
+        node->entry = m_entries.begin();
+        for (auto p = node; p; p = p->parent) {
+            ++p->numEntries;
+        }
+        ++m_stats.entries;
+    }
+    m_stats.bytes += size;
+
+    evict();
+}
+
+void PrefixCache::clear() {
+    std::lock_guard lock(m_mutex);
+
+    // tries of long prompts are deep, so destroy the nodes iteratively instead of recursively
+    std::vector<std::unique_ptr<Node>> nodes;
+    for (auto& [t, child] : m_root.children) {
+        nodes.push_back(std::move(child));
+    }
+    m_root.children.clear();
+    m_root.numEntries = 0;
+    m_root.entry.reset();
+
+    while (!nodes.empty()) {
+        auto node = std::move(nodes.back());
+        nodes.pop_back();
+        for (auto& [t, child] : node->children) {
+            nodes.push_back(std::move(child));
+        }
+    }
+
+    m_entries.clear();
+    m_stats.entries = 0;
+    m_stats.bytes = 0;
+}
+
+PrefixCache::Stats PrefixCache::stats() const {
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
+
+void PrefixCache::removeEntry(Node* node) {
+    auto entry = *node->entry;
+    m_stats.bytes -= entry->state->size();
+    --m_stats.entries;
+    m_entries.erase(entry);
+    node->entry.reset();
+    for (auto p = node; p; p = p->parent) {
+        --p->numEntries;
+    }
+}
+
+void PrefixCache::prune(Node* node) {
+    // remove the nodes which no longer lead to a state
+    while (node != &m_root && node->numEntries == 0) {
+        auto parent = node->parent;
+        parent->children.erase(node->token); // destroys node
+        node = parent;
+    }
+}
+
+void PrefixCache::evict() {
+    while (m_stats.bytes > m_params.maxBytes) {
+        auto node = m_entries.back().node;
+        removeEntry(node);
+        prune(node);
+        ++m_stats.evictions;
+    }
+}
+
+} // namespace bl::llama
@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include "Token.hpp"
+#include <itlib/flat_map.hpp>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace bl::llama {
+
+// cache of KV cache sequence states, keyed by the tokens which produced them
+// sessions which start with a cached prefix (typically a long system prompt) restore the state
+// and only decode the tokens after the first divergent one
+// the cache is thread safe and can be shared by multiple instances of the same model (with the same context params)
+class BL_LLAMA_API PrefixCache {
+public:
+    struct Params {
+        size_t maxBytes = size_t(1) << 30; // max total size of the cached states, least recently used are evicted first
+        uint32_t minTokens = 32; // prefixes shorter than this are neither cached nor reused
+    };
+
+    explicit PrefixCache(Params params);
+    ~PrefixCache();
+
+    PrefixCache(const PrefixCache&) = delete;
+    PrefixCache& operator=(const PrefixCache&) = delete;
+
+    using StatePtr = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Match {
+        uint32_t length = 0; // number of leading tokens shared with the cached state
+        uint32_t stateLength = 0; // number of tokens in the cached state (>= length)
+        StatePtr state; // null if there is no match
+    };
+
+    // find the cached state which shares the longest prefix with tokens
+    Match find(std::span<const Token> tokens);
+
+    // add the state of a sequence which contains exactly the given tokens
+    // cached states which are prefixes of tokens are dropped as the new one supersedes them
+    void insert(std::span<const Token> tokens, std::vector<uint8_t> state);
+
+    void clear();
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t hitTokens = 0; // total number of tokens which didn't have to be decoded thanks to the cache
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+    Stats stats() const;
+
+    const Params& params() const noexcept { return m_params; }
+
+private:
+    struct Node;
+
+    struct Entry {
+        Node* node;
+        StatePtr state;
+    };
+    using EntryList = std::list<Entry>; // most recently used first
+
+    struct Node {
+        Node* parent = nullptr;
+        Token token = Token_Invalid;
+        uint32_t depth = 0;
+        uint32_t numEntries = 0; // number of entries in this subtree, including this node
+        std::optional<EntryList::iterator> entry; // empty if no state ends here
+        itlib::flat_map<Token, std::unique_ptr<Node>> children;
+    };
+
+    void removeEntry(Node* node);
+    void prune(Node* node);
+    void evict();
+
+    Params m_params;
+
+    mutable std::mutex m_mutex;
+    Node m_root;
+    EntryList m_entries;
+    Stats m_stats;
+};
+
+} // namespace bl::llama
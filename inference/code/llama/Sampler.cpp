@@ -7,13 +7,15 @@
 #include <bstl/move.hpp>
 #include <bstl/iile.h>
 #include <span>
+#include <string_view>
 #include <cmath>
 #include <cstddef>
 
 namespace bl::llama {
 
 Sampler::Sampler(Model& model, const Params& params)
-    : m_grammarSampler(llama_sampler_init_grammar(llama_model_get_vocab(model.lmodel()), params.grammar.c_str(), "root"), llama_sampler_free)
+    : m_params(params)
+    , m_grammarSampler(llama_sampler_init_grammar(llama_model_get_vocab(model.lmodel()), params.grammar.c_str(), "root"), llama_sampler_free)
     , m_samplerChain(llama_sampler_chain_init({ .no_perf = false }), llama_sampler_free)
 {
     auto lmodel = model.lmodel();
@@ -96,14 +98,64 @@ Sampler::Sampler(Model& model, const Params& params)
     }
 }
 
+Sampler::Sampler(const Sampler& other, bstl::c_unique_ptr<llama_sampler> grammarSampler, bstl::c_unique_ptr<llama_sampler> samplerChain)
+    : m_params(other.m_params)
+    , m_grammarSampler(std::move(grammarSampler))
+    , m_samplerChain(std::move(samplerChain))
+    , m_history(other.m_history)
+{}
+
 Sampler::~Sampler() = default;
 
+std::unique_ptr<Sampler> Sampler::clone() const {
+    return std::unique_ptr<Sampler>(new Sampler(
+        *this,
+        {llama_sampler_clone(m_grammarSampler.get()), llama_sampler_free},
+        {llama_sampler_clone(m_samplerChain.get()), llama_sampler_free}
+    ));
+}
+
 void Sampler::accept(Token id, bool acceptGrammar) {
     if (acceptGrammar) {
         llama_sampler_accept(m_grammarSampler.get(), id);
     }
 
     llama_sampler_accept(m_samplerChain.get(), id);
+    m_history.accepted.push_back({id, acceptGrammar});
+}
+
+void Sampler::replay(const History& history) {
+    reset();
+    for (auto& a : history.accepted) {
+        accept(a.token, a.grammar);
+    }
+
+    if (history.numDraws == 0) {
+        return;
+    }
+
+    // advance the random number generator of the dist sampler by applying it alone
+    // the other samplers in the chain don't use it (mirostat and XTC have their own, which are not restored)
+    // a mirostat chain has no dist sampler, so it continues with a reset generator
+    auto chain = m_samplerChain.get();
+    llama_sampler* dist = nullptr;
+    for (int i = 0; i < llama_sampler_chain_n(chain); ++i) {
+        auto s = llama_sampler_chain_get(chain, i);
+        if (std::string_view(llama_sampler_name(s)) == "dist") {
+            dist = s;
+            break;
+        }
+    }
+    if (!dist) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < history.numDraws; ++i) {
+        llama_token_data single = {0, 0.0f, 1.0f};
+        llama_token_data_array singleAr = {&single, 1, -1, false};
+        llama_sampler_apply(dist, &singleAr);
+    }
+    m_history.numDraws = history.numDraws;
 }
 
 namespace {
@@ -134,6 +186,7 @@ Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
     }
 
     llama_sampler_apply(chain, &cur);
+    ++m_history.numDraws;
 
     if (cur.selected == -1) {
         throw std::runtime_error("no selected token during sampling - check your sampling configuration");
@@ -164,6 +217,7 @@ Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
 
     llama_sampler_apply(grammar, &cur);
     llama_sampler_apply(chain, &cur);
+    ++m_history.numDraws;
 
     if (cur.selected == -1) {
         throw std::runtime_error("no selected token during re-sampling - check your sampling configuration");
@@ -175,6 +229,7 @@ Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
 void Sampler::reset() {
     llama_sampler_reset(m_grammarSampler.get());
     llama_sampler_reset(m_samplerChain.get());
+    m_history = {};
 }
 
 void Sampler::perfReset() {
@@ -6,6 +6,7 @@
 #include "Token.hpp"
 #include <itlib/flat_map.hpp>
 #include <bstl/mem_ext.hpp>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -85,6 +86,9 @@ public:
     // reset the sampler state
     void reset();
 
+    // a sampler in the same state as this one: same accepted tokens, grammar state, and random number generator
+    std::unique_ptr<Sampler> clone() const;
+
     // reset the performance counters
     void perfReset();
 
@@ -105,9 +109,31 @@ public:
     // if acceptGrammar is true, the token is accepted both by the sampling chain and the grammar
     void accept(Token id, bool acceptGrammar);
 
+    const Params& params() const noexcept { return m_params; }
+
+    // what happened to the sampler since its last reset
+    // llama.cpp samplers can't be serialized, but a new sampler with the same params is brought to the same state
+    // by replaying the history (mirostat and XTC state is not restored, so Session snapshots reject both)
+    struct History {
+        struct Accepted {
+            Token token;
+            bool grammar; // accepted by the grammar too
+        };
+        std::vector<Accepted> accepted;
+        uint64_t numDraws = 0; // number of times the random number generator was used
+    };
+    const History& history() const noexcept { return m_history; }
+
+    // reset and replay the history of a sampler with the same params
+    void replay(const History& history);
+
 private:
+    Sampler(const Sampler& other, bstl::c_unique_ptr<llama_sampler> grammarSampler, bstl::c_unique_ptr<llama_sampler> samplerChain);
+
+    Params m_params;
     bstl::c_unique_ptr<llama_sampler> m_grammarSampler;
     bstl::c_unique_ptr<llama_sampler> m_samplerChain;
+    History m_history;
 
     // current tokens for sampling (one for each vocabulary entry)
     // kept as member so as to avoid reallocation on every sample call
@@ -5,11 +5,20 @@
 #include "Model.hpp"
 #include "Instance.hpp"
 #include "Logging.hpp"
+#include "Batch.hpp"
+#include "PrefixCache.hpp"
+#include "Logits.hpp"
+#include "Drafter.hpp"
 
 #include <llama.h>
 
 #include <bstl/throw_stdex.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
 namespace bl::llama {
 namespace {
 llama_batch makeInputBatch(std::span<const Token> tokens) {
@@ -20,56 +29,89 @@ llama_batch makeInputBatch(std::span<const Token> tokens) {
     return llama_batch_get_one(nonConstTokens, int32_t(tokens.size()));
 }
 
-TokenDataVector fillLogits(llama_context* lctx, std::function<bool(llama_token)> pred = nullptr) {
-    const auto* logits = llama_get_logits_ith(lctx, -1);
+void checkTopLogits(uint32_t topLogits) {
+    if (topLogits > Session::MaxTopLogits) {
+        throw_ex{} << "Too many top logits: " << topLogits << ", max: " << Session::MaxTopLogits;
+    }
+}
 
-    const auto* lmodel = llama_get_model(lctx);
-    const int vocabSize = llama_vocab_n_tokens(llama_model_get_vocab(lmodel));
+int32_t vocabSize(llama_context* lctx) {
+    return llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(lctx)));
+}
 
-    TokenDataVector result;
-    result.reserve(pred ? vocabSize : 0);
-    for (llama_token id = 0; id < vocabSize; id++) {
-        if (pred && !pred(id)) {
-            continue;
-        }
-        result.push_back({id, logits[id]});
+Sampler::Params samplerParams(const Session::InitParams& params) {
+    return {
+        .rngSeed = params.seed,
+        .topP = params.topP,
+        .temp = params.temperature,
+        .grammar = params.grammar,
+    };
+}
+
+float logSumExp(std::span<const float> logits) {
+    const auto max = *std::max_element(logits.begin(), logits.end());
+    double sum = 0;
+    for (auto l : logits) {
+        sum += std::exp(l - max);
     }
+    return max + float(std::log(sum));
+}
 
-    return result;
+// logits of the idx-th output of the last decode
+std::span<const float> logitsAt(llama_context* lctx, int32_t idx) {
+    return {llama_get_logits_ith(lctx, idx), size_t(vocabSize(lctx))};
 }
 }
 
-Session::Session(Instance& instance, llama_context* ctx, InitParams params)
+Session::Session(Instance& instance, llama_context* ctx, InitParams params, int32_t seqId)
     : m_instance(instance)
     , m_ctx(ctx)
-    , m_sampler(new Sampler(instance.model(), {
-        .rngSeed = params.seed,
-        .topP = params.topP,
-        .temp = params.temperature,
-        .grammar = params.grammar,
-    }))
+    , m_seqId(seqId)
+    , m_sampler(new Sampler(instance.model(), samplerParams(params)))
     , m_params(std::move(params))
 {
-    llama_kv_self_clear(m_ctx);
+    if (m_params.drafter) {
+        m_params.drafter->checkTarget(instance.model());
+    }
+
+    // other sessions of the instance may be using other sequences, so only clear ours
+    llama_kv_self_seq_rm(m_ctx, m_seqId, -1, -1);
     llama_synchronize(m_ctx);
     llama_perf_context_reset(m_ctx);
 
-    const auto ctxLen = llama_n_ctx(m_ctx);
+    const auto ctxLen = ctxLength();
     m_state.maxTokens = ctxLen - 4; // (#16)
 }
 
 Session::~Session() {
-    flushPendingState();
+    // free the cells of our sequence for other sessions
+    // there is no point in decoding a pending token here as the sequence is discarded anyway
+    llama_kv_self_seq_rm(m_ctx, m_seqId, -1, -1);
+}
+
+uint32_t Session::ctxLength() const noexcept {
+    // sessions share the context equally
+    return llama_n_ctx(m_ctx) / llama_n_seq_max(m_ctx);
+}
+
+bool Session::hasPendingInput() const noexcept {
+    return m_state.m_currToken != Token_Invalid
+        || m_state.queuedPromptOffset < m_state.queuedPrompt.size();
 }
 
 void Session::setInitialPrompt(std::span<const Token> initialPrompt) {
+    queueInitialPrompt(initialPrompt);
+    flushPendingState();
+}
+
+void Session::queueInitialPrompt(std::span<const Token> initialPrompt) {
     if (m_state.m_phase != State::Phase::Initial) {
         throw_ex{} << "Session already started";
     }
 
     Token initialToken; // used to reset the initial prompt to a single token
 
-    const auto ctxLen = llama_n_ctx(m_ctx);
+    const auto ctxLen = ctxLength();
     const auto tokenBos = llama_vocab_bos(m_instance.model().vocab().lvocab());
     m_state.numKeep = std::min(uint32_t(initialPrompt.size()), m_state.maxTokens); // number of tokens to keep in the context in case we overflow
 
@@ -92,6 +134,7 @@ void Session::setInitialPrompt(std::span<const Token> initialPrompt) {
     }
 
     if (m_instance.model().hasEncoder()) {
+        // encoding is not batched, only the decoder start token is queued
         auto batch = makeInputBatch(initialPrompt);
         auto res = llama_encode(m_ctx, batch);
         if (res != 0) {
@@ -102,11 +145,142 @@ void Session::setInitialPrompt(std::span<const Token> initialPrompt) {
         initialPrompt = {&initialToken, 1};
     }
 
-    doDecode(initialPrompt, Source::InitialPrompt);
+    m_state.queuedPrompt.assign(initialPrompt.begin(), initialPrompt.end());
+    m_state.queuedPromptOffset = 0;
+
+    // positions are shifted by self-extend, so the cached states are not compatible with it
+    auto cache = m_instance.prefixCache();
+    if (cache && !m_instance.model().hasEncoder() && m_params.gaFactor == 1) {
+        reuseCachedPrefix(*cache);
+    }
+
     m_state.m_phase = State::Phase::Generating;
 }
 
+void Session::reuseCachedPrefix(PrefixCache& cache) {
+    auto& prompt = m_state.queuedPrompt;
+    m_state.cachePrompt = prompt.size() >= cache.params().minTokens;
+
+    auto match = cache.find(prompt);
+    if (!match.state) {
+        return;
+    }
+
+    if (match.length == prompt.size()) {
+        // the prompt is already in the cache (or is a prefix of a cached one)
+        m_state.cachePrompt = false;
+    }
+
+    if (llama_state_seq_set_data(m_ctx, match.state->data(), match.state->size(), m_seqId) == 0) {
+        LLAMA_LOG(Warning, "Failed to restore cached prefix state of ", match.stateLength, " tokens");
+        llama_kv_self_seq_rm(m_ctx, m_seqId, -1, -1);
+        return;
+    }
+
+    // drop whatever comes after the common prefix
+    // the last token of the prompt is always decoded, so that we have logits to sample from
+    const auto numReused = std::min(match.length, uint32_t(prompt.size() - 1));
+    llama_kv_self_seq_rm(m_ctx, m_seqId, numReused, -1);
+
+    acceptTokens(std::span(prompt).first(numReused), Source::InitialPrompt);
+    m_state.tokens.assign(prompt.begin(), prompt.begin() + numReused);
+    m_state.numPast = numReused;
+    m_state.queuedPromptOffset = numReused;
+
+    LLAMA_LOG(Debug, "Reusing ", numReused, " cached tokens of a ", prompt.size(), " token prompt");
+}
+
+void Session::cachePromptState() {
+    if (m_state.promptToCache.empty()) {
+        return;
+    }
+
+    auto tokens = std::move(m_state.promptToCache);
+    m_state.promptToCache.clear();
+
+    auto cache = m_instance.prefixCache();
+    if (!cache) {
+        return;
+    }
+
+    const auto size = llama_state_seq_get_size(m_ctx, m_seqId);
+    std::vector<uint8_t> state(size);
+    if (llama_state_seq_get_data(m_ctx, state.data(), size, m_seqId) != size) {
+        LLAMA_LOG(Warning, "Failed to get the prompt state for the prefix cache");
+        return;
+    }
+
+    cache->insert(tokens, std::move(state));
+}
+
 void Session::pushPrompt(std::span<const Token> prompt, std::span<const Token> postfix) {
+    auto tokens = preparePrompt(prompt, postfix);
+    doDecode(tokens, Source::InteractivePrompt);
+}
+
+void Session::queuePrompt(std::span<const Token> prompt) {
+    auto tokens = preparePrompt(prompt, {});
+    m_state.queuedPrompt = std::move(tokens);
+    m_state.queuedPromptOffset = 0;
+}
+
+void Session::queueLastToken() {
+    if (m_state.m_phase != State::Phase::Generating) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+    if (hasPendingInput()) {
+        throw_ex{} << "Session has pending input";
+    }
+    if (m_state.lastToken == Token_Invalid || m_state.numPast == 0) {
+        throw_ex{} << "Session has no last token";
+    }
+
+    --m_state.numPast;
+    llama_kv_self_seq_rm(m_ctx, m_seqId, llama_pos(m_state.numPast), -1);
+    if (m_state.tokens.size() > m_state.numPast) {
+        m_state.tokens.pop_back();
+    }
+
+    m_state.queuedPrompt = {m_state.lastToken};
+    m_state.queuedPromptOffset = 0;
+    m_state.queuedPromptSource = Source::Restored;
+}
+
+void Session::rewind(uint32_t numTokens) {
+    if (m_state.m_phase != State::Phase::Generating) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+
+    flushPendingState();
+
+    if (m_params.gaFactor != 1) {
+        throw_ex{} << "Sessions with group attention can't be rewound";
+    }
+    if (m_state.tokens.size() != m_state.numPast) {
+        throw_ex{} << "The tokens in the context are unknown";
+    }
+    if (numTokens > m_state.numPast) {
+        throw_ex{} << "Can't rewind to " << numTokens << " tokens, the context has " << m_state.numPast;
+    }
+
+    m_sampler->reset();
+
+    if (numTokens == m_state.numPast) {
+        return;
+    }
+
+    llama_kv_self_seq_rm(m_ctx, m_seqId, llama_pos(numTokens), -1);
+    m_state.tokens.resize(numTokens);
+    m_state.numPast = numTokens;
+    m_state.numKeep = std::min(m_state.numKeep, numTokens);
+    m_state.lastToken = numTokens ? m_state.tokens.back() : Token_Invalid;
+
+    // our logits are of the dropped tokens (decode counts only grow, so this marks them as overwritten)
+    m_state.logitsIndex = -1;
+    m_state.logitsDecode = m_instance.m_decodeCount - 1;
+}
+
+std::vector<Token> Session::preparePrompt(std::span<const Token> prompt, std::span<const Token> postfix) {
     if (m_state.m_phase != State::Phase::Generating) {
         throw_ex{} << "Session hasn't started yet";
     }
@@ -159,40 +333,172 @@ void Session::pushPrompt(std::span<const Token> prompt, std::span<const Token> p
     }
 
     if (tokens.size() > m_state.maxTokens) {
-        const auto ctxLen = llama_n_ctx(m_ctx);
+        const auto ctxLen = ctxLength();
         throw_ex{} << "Prompt too long. Got " << tokens.size() << " tokens, max: " << ctxLen - 4;
     }
 
-    doDecode(tokens, Source::InteractivePrompt);
+    return tokens;
 }
 
-TokenPrediction Session::getToken() {
+TokenPrediction Session::getToken(uint32_t topLogits, uint32_t maxDraft) {
     if (m_state.m_phase != State::Phase::Generating
         && m_state.m_phase != State::Phase::Streaming) {
         throw_ex{} << "Session hasn't started yet";
     }
 
+    auto& speculated = m_state.speculated;
+    if (m_state.speculatedOffset < speculated.size()) {
+        auto p = std::move(speculated[m_state.speculatedOffset++]);
+        if (m_state.speculatedOffset == speculated.size()) {
+            speculated.clear();
+            m_state.speculatedOffset = 0;
+        }
+        return p;
+    }
+
+    if (m_params.drafter && maxDraft > 0
+        && m_state.m_currToken != Token_Invalid
+        && m_state.queuedPromptOffset == m_state.queuedPrompt.size()
+    ) {
+        return speculate(topLogits, std::min(maxDraft, m_params.maxDraftTokens));
+    }
+
     flushPendingState();
+    restoreLogits();
 
     auto& vocab = m_instance.model().vocab();
 
-    m_state.m_currToken = m_sampler->sample(m_ctx);
+    const auto token = m_sampler->sample(m_ctx, m_state.logitsIndex);
 
-    if (vocab.isEog(m_state.m_currToken)) {
-        // don't decode eog tokens in case the the interaction is continued
-        m_state.m_currToken = Token_Invalid;
-    }
+    // the logits the token is sampled from
+    // they must be taken before the token is decoded, which happens lazily with the next call that needs the context
+    // (or with the next Instance::decodeBatch)
+    auto top = topKLogits(logitsAt(m_ctx, m_state.logitsIndex), topLogits);
+
+    // don't decode eog tokens in case the the interaction is continued
+    m_state.m_currToken = vocab.isEog(token) ? Token_Invalid : token;
 
     return {
         .token = m_state.m_currToken,
-        .logits = getLogitsFromCtx(10)
+        .logits = std::move(top)
     };
 }
 
+TokenPrediction Session::speculate(uint32_t topLogits, uint32_t maxDraft) {
+    // the pending token is decoded together with the draft and every position is an output:
+    // the logits of position i are the ones to sample the token after it from
+    // so as long as the sampled tokens match the draft, we get one more token from the same decode
+    auto& batch = *m_instance.m_batch;
+    maxDraft = std::min(maxDraft, std::min(uint32_t(batch.capacity() - 1), m_state.maxTokens / 2));
+
+    const auto token = m_state.m_currToken;
+    m_state.m_currToken = Token_Invalid;
+
+    mitigateFullContext(maxDraft + 1);
+
+    m_state.tokens.push_back(token);
+    auto draft = m_params.drafter->draft(m_state.tokens, maxDraft);
+    if (draft.size() > maxDraft) {
+        draft.resize(maxDraft);
+    }
+
+    acceptTokens({&token, 1}, Source::Generated);
+
+    batch.clear();
+    batch.add(token, llama_pos(m_state.numPast), m_seqId, true);
+    for (size_t i = 0; i < draft.size(); ++i) {
+        batch.add(draft[i], llama_pos(m_state.numPast + 1 + i), m_seqId, true);
+    }
+    if (m_instance.decode(batch) != 0) {
+        throw_ex{} << "Failed to decode tokens";
+    }
+
+    auto& vocab = m_instance.model().vocab();
+    auto& speculated = m_state.speculated;
+    speculated.clear();
+    m_state.speculatedOffset = 0;
+
+    uint32_t numAccepted = 0;
+    for (int32_t i = 0; ; ++i) {
+        const auto sampled = m_sampler->sample(m_ctx, i);
+        const bool eog = vocab.isEog(sampled);
+        speculated.push_back({
+            .token = eog ? Token_Invalid : sampled,
+            .logits = topKLogits(logitsAt(m_ctx, i), topLogits)
+        });
+
+        if (eog || size_t(i) == draft.size() || sampled != draft[i]) {
+            // the last sampled token is not decoded yet, same as with regular generation
+            m_state.m_currToken = eog ? Token_Invalid : sampled;
+            break;
+        }
+
+        // the sampled token is the drafted one, which is already in the context
+        acceptTokens({&sampled, 1}, Source::Generated);
+        ++numAccepted;
+    }
+
+    // drop the rejected part of the draft
+    const auto numDecoded = 1 + numAccepted;
+    llama_kv_self_seq_rm(m_ctx, m_seqId, llama_pos(m_state.numPast + numDecoded), -1);
+    m_state.tokens.insert(m_state.tokens.end(), draft.begin(), draft.begin() + numAccepted);
+    m_state.numPast += numDecoded;
+    m_state.lastToken = numAccepted ? draft[numAccepted - 1] : token;
+    m_state.logitsIndex = int32_t(numAccepted);
+    m_state.logitsDecode = m_instance.m_decodeCount;
+
+    ++m_speculativeStats.steps;
+    m_speculativeStats.drafted += draft.size();
+    m_speculativeStats.accepted += numAccepted;
+
+    auto p = std::move(speculated.front());
+    m_state.speculatedOffset = 1;
+    if (speculated.size() == 1) {
+        speculated.clear();
+        m_state.speculatedOffset = 0;
+    }
+    return p;
+}
+
+void Session::dropSpeculated() {
+    auto& speculated = m_state.speculated;
+    if (m_state.speculatedOffset == speculated.size()) {
+        return;
+    }
+
+    // the undelivered predictions are the last tokens in the context, except for the last one,
+    // which is pending (unless it's eog or a batch has decoded it already)
+    auto numDecoded = uint32_t(speculated.size() - m_state.speculatedOffset);
+    if (speculated.back().token == Token_Invalid || m_state.m_currToken != Token_Invalid) {
+        --numDecoded;
+    }
+    m_state.m_currToken = Token_Invalid;
+
+    if (numDecoded) {
+        m_state.numPast -= numDecoded;
+        llama_kv_self_seq_rm(m_ctx, m_seqId, llama_pos(m_state.numPast), -1);
+        m_state.tokens.resize(m_state.tokens.size() - std::min(size_t(numDecoded), m_state.tokens.size()));
+
+        // the last delivered prediction is already decoded
+        m_state.lastToken = speculated[m_state.speculatedOffset - 1].token;
+        m_state.logitsIndex = -1;
+        m_state.logitsDecode = m_instance.m_decodeCount - 1;
+
+        // the sampler has accepted the dropped tokens too
+        auto history = m_sampler->history();
+        history.accepted.resize(history.accepted.size() - numDecoded);
+        m_sampler->replay(history);
+    }
+
+    speculated.clear();
+    m_state.speculatedOffset = 0;
+}
+
 std::vector<TokenPrediction> Session::complete(Session::CompleteParams params) {
     if (m_state.m_phase != State::Phase::Generating) {
         throw_ex{} << "Session hasn't started yet";
     }
+    checkTopLogits(params.topLogits);
 
     flushPendingState();
 
@@ -202,13 +508,22 @@ std::vector<TokenPrediction> Session::complete(Session::CompleteParams params) {
 
     std::vector<TokenPrediction> predictions;
     for (int32_t i = 0; i < params.maxTokens; i++) {
-        auto p = getToken();
+        if (params.cancel && params.cancel->load(std::memory_order_relaxed)) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= params.deadline) {
+            break;
+        }
+        auto p = getToken(params.topLogits, uint32_t(params.maxTokens - i - 1));
         if (p.token == Token_Invalid) {
             break;
         }
         predictions.push_back(p);
     }
 
+    // if cancelled or timed out
+    dropSpeculated();
+
     return predictions;
 }
 
@@ -216,6 +531,7 @@ Session::StreamGenerator Session::completeStream(CompleteParams params) {
     if (m_state.m_phase != State::Phase::Generating) {
         throw_ex{} << "Session hasn't started yet";
     }
+    checkTopLogits(params.topLogits);
 
     flushPendingState();
 
@@ -228,57 +544,270 @@ Session::StreamGenerator Session::completeStream(CompleteParams params) {
     return Session::StreamGenerator(*this, params);
 }
 
-std::vector<TokenPrediction> Session::fillCtx(std::span<TokenPrediction> tokens) {
+std::vector<TokenPrediction> Session::completeBeam(BeamParams params) {
+    if (m_state.m_phase != State::Phase::Generating) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+    if (params.beamWidth == 0) {
+        throw_ex{} << "Beam width must be at least 1";
+    }
+    checkTopLogits(params.topLogits);
+    if (m_params.gaFactor != 1) {
+        throw_ex{} << "Beam search is not supported with group attention";
+    }
+
+    flushPendingState();
+
+    if (params.prompt.size() || params.suffix.size()) {
+        pushPrompt(params.prompt, params.suffix);
+    }
+
     std::vector<TokenPrediction> result;
-    result.reserve(tokens.size());
+    if (params.maxTokens <= 0) {
+        return result;
+    }
 
-    for (const auto& token : tokens) {
-        pushPrompt({&token.token, 1}, {});
-        result.push_back({
-            .token = token.token,
-            .logits = getLogitsFromCtx(token.logits)
+    restoreLogits();
+
+    const auto basePast = m_state.numPast;
+    if (basePast + uint32_t(params.maxTokens) >= ctxLength()) {
+        throw_ex{} << "Beam search of " << params.maxTokens << " tokens does not fit in the context";
+    }
+
+    auto& batch = *m_instance.m_batch;
+    const auto width = std::min(params.beamWidth, uint32_t(batch.capacity()));
+
+    // sequences of the free session slots
+    std::vector<int32_t> freeSeqs;
+    for (size_t i = 0; i < m_instance.m_sessions.size() && freeSeqs.size() + 1 < width; ++i) {
+        if (!m_instance.m_sessions[i]) {
+            freeSeqs.push_back(int32_t(i));
+        }
+    }
+    if (freeSeqs.size() + 1 < width) {
+        throw_ex{} << "Beam search with width " << width << " needs " << width - 1 << " free sessions in the instance";
+    }
+    const auto borrowedSeqs = freeSeqs;
+
+    // the KV sequence of a beam has all of its tokens but the last, which is decoded with the next step
+    struct Beam {
+        int32_t seqId = -1;
+        int32_t logitsIndex = -1; // logits for the token after the beam
+        uint32_t parent = 0; // index of the beam this one extends in the previous step
+        float score = 0; // sum of the log-probabilities of the tokens
+        std::vector<TokenPrediction> predictions;
+    };
+    std::vector<Beam> beams = {{.seqId = m_seqId, .logitsIndex = m_state.logitsIndex}};
+    std::vector<Beam> next;
+
+    // the best hypothesis which ended with an eog token (which is not part of it)
+    std::optional<Beam> finished;
+    bool finishedNow = false; // finished in the last step, so its parent is still in beams
+
+    struct Candidate {
+        uint32_t beam;
+        Token token;
+        float score;
+    };
+    std::vector<Candidate> candidates;
+    std::vector<TokenDataVector> beamLogits;
+
+    auto& vocab = m_instance.model().vocab();
+
+    for (int32_t step = 0; ; ++step) {
+        candidates.clear();
+        beamLogits.clear();
+        for (uint32_t b = 0; b < beams.size(); ++b) {
+            const auto row = logitsAt(m_ctx, beams[b].logitsIndex);
+            const auto lse = logSumExp(row);
+            for (auto& td : topKLogits(row, width)) {
+                candidates.push_back({b, td.token, beams[b].score + td.logit - lse});
+            }
+            beamLogits.push_back(topKLogits(row, params.topLogits));
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+            if (a.score != b.score) return a.score > b.score;
+            return a.token < b.token;
         });
+
+        // the best candidates which don't end the text are the next beams
+        next.clear();
+        finishedNow = false;
+        for (auto& c : candidates) {
+            if (next.size() == width) break;
+            auto& parent = beams[c.beam];
+            if (vocab.isEog(c.token)) {
+                if (!finished || c.score > finished->score) {
+                    finished = Beam{.parent = c.beam, .score = c.score, .predictions = parent.predictions};
+                    finishedNow = true;
+                }
+                continue;
+            }
+            auto& beam = next.emplace_back(Beam{.parent = c.beam, .score = c.score, .predictions = parent.predictions});
+            beam.predictions.push_back({.token = c.token, .logits = beamLogits[c.beam]});
+        }
+
+        // scores only decrease, so no beam can beat a better finished hypothesis
+        if (next.empty()
+            || step + 1 == params.maxTokens
+            || (finished && finished->score >= next.front().score)
+        ) {
+            break;
+        }
+
+        // dead beams are pruned and their sequences are reused
+        std::vector<uint32_t> numChildren(beams.size(), 0);
+        for (auto& n : next) {
+            ++numChildren[n.parent];
+        }
+        for (uint32_t b = 0; b < beams.size(); ++b) {
+            if (!numChildren[b]) {
+                llama_kv_self_seq_rm(m_ctx, beams[b].seqId, -1, -1);
+                freeSeqs.push_back(beams[b].seqId);
+            }
+        }
+
+        // the first child of a beam continues its sequence, the others get copies of it
+        std::vector<bool> parentTaken(beams.size(), false);
+        batch.clear();
+        for (auto& n : next) {
+            auto& parent = beams[n.parent];
+            if (!parentTaken[n.parent]) {
+                n.seqId = parent.seqId;
+                parentTaken[n.parent] = true;
+            }
+            else {
+                n.seqId = freeSeqs.back();
+                freeSeqs.pop_back();
+                llama_kv_self_seq_cp(m_ctx, parent.seqId, n.seqId, -1, -1);
+            }
+            n.logitsIndex = batch.add(n.predictions.back().token, llama_pos(basePast + n.predictions.size() - 1), n.seqId, true);
+        }
+
+        if (m_instance.decode(batch) != 0) {
+            throw_ex{} << "Failed to decode beams";
+        }
+
+        std::swap(beams, next);
     }
 
-    return result;
-}
+    // make the best hypothesis the content of our sequence
+    const bool live = !next.empty() && (!finished || next.front().score > finished->score);
+    auto& best = live ? next.front() : *finished;
 
-TokenDataVector Session::getLogitsFromCtx(int32_t topK) {
-    if (m_state.m_phase != State::Phase::Generating
-        && m_state.m_phase != State::Phase::Streaming) {
-        throw_ex{} << "Session hasn't started yet";
+    // a hypothesis from the last step extends a beam whose sequence has all of its tokens (but the pending one)
+    // an older finished one is decoded again
+    const bool fromLastStep = live || finishedNow;
+    const auto& source = fromLastStep ? beams[best.parent] : beams.front();
+    const auto numInKv = fromLastStep ? source.predictions.size() : 0;
+
+    if (source.seqId != m_seqId) {
+        llama_kv_self_seq_rm(m_ctx, m_seqId, -1, -1);
+        llama_kv_self_seq_cp(m_ctx, source.seqId, m_seqId, -1, -1);
     }
+    llama_kv_self_seq_rm(m_ctx, m_seqId, llama_pos(basePast + numInKv), -1);
 
-    flushPendingState();
+    for (auto seqId : borrowedSeqs) {
+        llama_kv_self_seq_rm(m_ctx, seqId, -1, -1);
+    }
 
-    TokenDataVector tempData = fillLogits(m_ctx);
+    std::vector<Token> tokens;
+    tokens.reserve(best.predictions.size());
+    for (auto& p : best.predictions) {
+        tokens.push_back(p.token);
+    }
 
-    std::sort(tempData.begin(), tempData.end(), [](const TokenData & a, const TokenData & b) {
-        return a.logit > b.logit;
-    });
+    const auto inKv = std::span(tokens).first(numInKv);
+    acceptTokens(inKv, Source::Generated);
+    m_state.tokens.insert(m_state.tokens.end(), inKv.begin(), inKv.end());
+    m_state.numPast = basePast + uint32_t(numInKv);
+    if (!inKv.empty()) {
+        m_state.lastToken = inKv.back();
+    }
+    if (fromLastStep) {
+        m_state.logitsIndex = source.logitsIndex;
+        m_state.logitsDecode = m_instance.m_decodeCount;
+    }
+    // otherwise the logits are restored when needed (or produced by the decode below)
+
+    if (live) {
+        // the last token is pending, as after complete
+        m_state.m_currToken = tokens.back();
+    }
+    else if (numInKv < tokens.size()) {
+        doDecode(std::span(tokens).subspan(numInKv), Source::Generated);
+    }
 
-    return TokenDataVector(tempData.begin(), tempData.begin() + topK);
+    result = std::move(best.predictions);
+    return result;
 }
 
-TokenDataVector Session::getLogitsFromCtx(TokenDataVector tokens) {
-    if (m_state.m_phase != State::Phase::Generating
-        && m_state.m_phase != State::Phase::Streaming) {
+std::vector<TokenPrediction> Session::fillCtx(std::span<TokenPrediction> tokens) {
+    if (m_state.m_phase != State::Phase::Generating) {
         throw_ex{} << "Session hasn't started yet";
     }
 
     flushPendingState();
 
-    TokenDataVector res = fillLogits(m_ctx, [&](llama_token token) {
-        return std::any_of(tokens.begin(), tokens.end(), [&](const TokenData& t) {
-            return t.token == token;
-        });
-    });
+    // same as for a new prompt: previous inputs don't affect the sampling afterwards
+    m_sampler->reset();
+
+    std::vector<TokenPrediction> result;
+    if (tokens.empty()) {
+        return result;
+    }
+    result.reserve(tokens.size());
+
+    restoreLogits();
 
-    std::sort(res.begin(), res.end(), [](const TokenData & a, const TokenData & b) {
-        return a.logit > b.logit;
+    // as in generation, the logits of a token are the ones it's predicted from: the ones of the previous position
+    // for the first token these are already in the context
+    result.push_back({
+        .token = tokens[0].token,
+        .logits = gatherLogits(logitsAt(m_ctx, m_state.logitsIndex), tokens[0].logits)
     });
 
-    return res;
+    // instead of decoding token by token, decode the tokens in chunks as we would a prompt,
+    // but request the logits of every position
+    // chunks are limited to half the context, so that a context shift can always make room for them
+    auto& batch = *m_instance.m_batch;
+    const auto maxChunk = std::max(std::min(size_t(batch.capacity()), size_t(m_state.maxTokens / 2)), size_t(1));
+
+    for (size_t start = 0; start < tokens.size(); ) {
+        const auto chunk = tokens.subspan(start, std::min(tokens.size() - start, maxChunk));
+
+        mitigateFullContext(uint32_t(chunk.size()));
+
+        batch.clear();
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            m_sampler->accept(chunk[i].token, false);
+            batch.add(chunk[i].token, llama_pos(m_state.numPast + i), m_seqId, true);
+        }
+
+        if (m_instance.decode(batch) != 0) {
+            throw_ex{} << "Failed to decode tokens";
+        }
+        m_state.numPast += uint32_t(chunk.size());
+        m_state.lastToken = chunk.back().token;
+        for (auto& t : chunk) {
+            m_state.tokens.push_back(t.token);
+        }
+
+        // all positions of the chunk are outputs, so their logits are consecutive rows
+        // the last position only provides the logits for whatever comes after the filled tokens
+        const auto next = tokens.subspan(start + 1, std::min(chunk.size(), tokens.size() - start - 1));
+        const auto numVocab = size_t(vocabSize(m_ctx));
+        auto gathered = gatherLogits({llama_get_logits(m_ctx), chunk.size() * numVocab}, numVocab, next);
+        result.insert(result.end(), std::make_move_iterator(gathered.begin()), std::make_move_iterator(gathered.end()));
+
+        start += chunk.size();
+    }
+
+    m_state.logitsIndex = -1;
+    m_state.logitsDecode = m_instance.m_decodeCount;
+
+    return result;
 }
 
 std::vector<uint8_t> Session::getState() {
@@ -288,22 +817,80 @@ std::vector<uint8_t> Session::getState() {
 
     flushPendingState();
 
-    const auto size = llama_state_get_size(m_ctx);
-    std::vector<uint8_t> state(size);
-    if (llama_state_get_data(m_ctx, state.data(), size) != size) {
+    // the state of our sequence only, followed by our last token
+    // it has no logits, so they are restored by decoding the token again
+    const auto size = llama_state_seq_get_size(m_ctx, m_seqId);
+    std::vector<uint8_t> state(size + sizeof(Token));
+    if (llama_state_seq_get_data(m_ctx, state.data(), size, m_seqId) != size) {
         throw_ex{} << "Failed to get state";
     }
+    std::memcpy(state.data() + size, &m_state.lastToken, sizeof(Token));
     return state;
 }
 
+Session& Session::fork(std::optional<uint32_t> seed) {
+    if (m_state.m_phase != State::Phase::Generating) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+
+    // decode the pending input first, so that it's shared
+    flushPendingState();
+
+    auto params = m_params;
+    if (seed) {
+        params.seed = *seed;
+    }
+
+    auto& slot = m_instance.freeSessionSlot();
+    const auto seqId = int32_t(&slot - m_instance.m_sessions.data());
+    auto& fork = slot.emplace(m_instance, m_ctx, std::move(params), seqId);
+
+    llama_kv_self_seq_cp(m_ctx, m_seqId, seqId, -1, -1);
+    if (seed) {
+        // the sampler is already created by the constructor
+        for (auto t : m_state.tokens) {
+            fork.m_sampler->accept(t, false);
+        }
+    }
+    else {
+        fork.m_sampler = m_sampler->clone();
+    }
+
+    // the logits of our last decode are valid for the fork too
+    fork.m_state = m_state;
+
+    return fork;
+}
+
 bool Session::setState(std::span<uint8_t> state) {
     if (m_state.m_phase != State::Phase::Initial) {
         throw_ex{} << "Session already started";
     }
 
-    if (llama_state_set_data(m_ctx, state.data(), state.size()) != state.size()) {
+    if (state.size() < sizeof(Token)) {
         throw_ex{} << "Failed to set state";
     }
+    const auto size = state.size() - sizeof(Token);
+
+    // the state is restored into our sequence, whichever sequence it was taken from
+    if (llama_state_seq_set_data(m_ctx, state.data(), size, m_seqId) != size) {
+        throw_ex{} << "Failed to set state";
+    }
+
+    // tokens are decoded with explicit positions, so continue after the restored ones
+    const auto numPast = uint32_t(llama_kv_self_seq_pos_max(m_ctx, m_seqId) + 1);
+    if (numPast > m_state.maxTokens) {
+        llama_kv_self_seq_rm(m_ctx, m_seqId, -1, -1);
+        throw_ex{} << "State of " << numPast << " tokens doesn't fit the session context";
+    }
+    m_state.numPast = numPast;
+    m_state.tokens.clear();
+    std::memcpy(&m_state.lastToken, state.data() + size, sizeof(Token));
+
+    // the state has no logits, so mark ours as overwritten (decode counts only grow)
+    // and they will be restored by decoding the last token again when needed
+    m_state.logitsIndex = -1;
+    m_state.logitsDecode = m_instance.m_decodeCount - 1;
 
     m_state.m_phase = State::Phase::Generating;
     return true;
@@ -317,16 +904,42 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
         LLAMA_LOG(Warning, "Input too long. Skipping ", skipped, " tokens");
     }
 
+    mitigateFullContext(uint32_t(tokens.size()));
+    acceptTokens(tokens, src);
+    m_state.tokens.insert(m_state.tokens.end(), tokens.begin(), tokens.end());
+
+    // decode with batches of batchSize
+    auto& batch = *m_instance.m_batch;
+    while (!tokens.empty()) {
+        const auto batchTokens = std::min(tokens.size(), size_t(batch.capacity()));
+        batch.clear();
+        for (size_t i = 0; i < batchTokens; ++i) {
+            // we only need the logits of the last token
+            batch.add(tokens[i], llama_pos(m_state.numPast + i), m_seqId, i == batchTokens - 1);
+        }
+        m_state.lastToken = tokens[batchTokens - 1];
+        tokens = tokens.subspan(batchTokens);
+        if (m_instance.decode(batch) != 0) {
+            throw_ex{} << "Failed to decode tokens";
+        }
+        m_state.numPast += uint32_t(batchTokens);
+    }
+
+    m_state.logitsIndex = -1;
+    m_state.logitsDecode = m_instance.m_decodeCount;
+}
+
+void Session::mitigateFullContext(uint32_t numNewTokens) {
     bool haveFullContextMitigation = false;
     const auto gaFactor = m_params.gaFactor;
-    const auto ctxLen = llama_n_ctx(m_ctx);
+    const auto ctxLen = ctxLength();
 
     if (gaFactor == 1) {
         // infinite text generation via context shifting
         // if we run out of context:
         // - take the n_keep first tokens from the original prompt (via numPast)
         // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
-        const auto num = m_state.numPast + tokens.size();
+        const auto num = m_state.numPast + numNewTokens;
         if (num >= ctxLen) {
             if (!m_params.infiniteContext) {
                 throw_ex{} << "context limit of " << ctxLen << " reached";
@@ -338,8 +951,13 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
             LLAMA_LOG(Debug, "Context is full. Swapping: past = ", m_state.numPast, ", numLeft: ", numLeft,
                 ", ctxLen: ", ctxLen, ", numKeep: ", m_state.numKeep, ", numDiscard: ", numDiscard);
 
-            llama_kv_self_seq_rm(m_ctx, 0, m_state.numKeep, m_state.numKeep + numDiscard);
-            llama_kv_self_seq_add(m_ctx, 0, m_state.numKeep + numDiscard, m_state.numPast, -numDiscard);
+            llama_kv_self_seq_rm(m_ctx, m_seqId, m_state.numKeep, m_state.numKeep + numDiscard);
+            llama_kv_self_seq_add(m_ctx, m_seqId, m_state.numKeep + numDiscard, m_state.numPast, -numDiscard);
+
+            auto& tokens = m_state.tokens;
+            if (tokens.size() >= m_state.numKeep + numDiscard) {
+                tokens.erase(tokens.begin() + m_state.numKeep, tokens.begin() + m_state.numKeep + numDiscard);
+            }
 
             m_state.numPast -= numDiscard;
             haveFullContextMitigation = true;
@@ -356,9 +974,9 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
 
             LLAMA_LOG(Debug, "Group attention shift: ib = ", ib, ", bd = ", bd, ", dd = ", dd);
 
-            llama_kv_self_seq_add(m_ctx, 0, m_state.gaIndex, m_state.numPast, ib * bd);
-            llama_kv_self_seq_div(m_ctx, 0, m_state.gaIndex + ib * bd, m_state.gaIndex + ib * bd + gaWidth, gaFactor);
-            llama_kv_self_seq_add(m_ctx, 0, m_state.gaIndex + ib * bd + gaWidth, m_state.numPast + ib * bd, dd);
+            llama_kv_self_seq_add(m_ctx, m_seqId, m_state.gaIndex, m_state.numPast, ib * bd);
+            llama_kv_self_seq_div(m_ctx, m_seqId, m_state.gaIndex + ib * bd, m_state.gaIndex + ib * bd + gaWidth, gaFactor);
+            llama_kv_self_seq_add(m_ctx, m_seqId, m_state.gaIndex + ib * bd + gaWidth, m_state.numPast + ib * bd, dd);
 
             m_state.numPast -= bd;
 
@@ -368,7 +986,13 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
     }
 
     if (haveFullContextMitigation) {
-        LLAMA_LOG(Info, "Context full mitigation performed: past = ", m_state.numPast, ", tokens = ", tokens.size());
+        LLAMA_LOG(Info, "Context full mitigation performed: past = ", m_state.numPast, ", tokens = ", numNewTokens);
+    }
+}
+
+void Session::acceptTokens(std::span<const Token> tokens, Source src) {
+    if (src == Source::Restored) {
+        return;
     }
 
     // add to sampler
@@ -376,28 +1000,107 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
         // only apply grammar for generated content
         m_sampler->accept(t, src == Source::Generated);
     }
+}
 
-    // decode
-    const auto batchSize = llama_n_batch(m_ctx);
+uint32_t Session::fillBatch(Batch& batch, uint32_t maxTokens) {
+    std::span<const Token> tokens;
+    Source src;
+    if (m_state.m_currToken != Token_Invalid) {
+        tokens = {&m_state.m_currToken, 1};
+        src = Source::Generated;
+    }
+    else {
+        tokens = std::span(m_state.queuedPrompt).subspan(m_state.queuedPromptOffset);
+        src = m_state.queuedPromptSource;
+    }
 
-    // decode with batches of batchSize
-    while (!tokens.empty()) {
-        auto batchTokens = tokens.size() > batchSize ? tokens.first(batchSize) : tokens;
-        tokens = tokens.subspan(batchTokens.size());
-        auto batch = makeInputBatch(batchTokens);
-        if (llama_decode(m_ctx, batch) != 0) {
-            throw_ex{} << "Failed to decode tokens";
+    tokens = tokens.first(std::min(tokens.size(), size_t(maxTokens)));
+    if (tokens.empty()) {
+        return 0;
+    }
+
+    mitigateFullContext(uint32_t(tokens.size()));
+    acceptTokens(tokens, src);
+    m_state.tokens.insert(m_state.tokens.end(), tokens.begin(), tokens.end());
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const bool last = i == tokens.size() - 1;
+        const auto idx = batch.add(tokens[i], llama_pos(m_state.numPast + i), m_seqId, last);
+        if (last) {
+            m_state.logitsIndex = idx;
         }
-        m_state.numPast += uint32_t(batchTokens.size());
     }
+    m_state.numPast += uint32_t(tokens.size());
+    m_state.lastToken = tokens.back();
+    m_state.logitsDecode = m_instance.m_decodeCount + 1; // the batch is decoded next by Instance::decodeBatch
+
+    if (src == Source::Generated) {
+        m_state.m_currToken = Token_Invalid;
+    }
+    else {
+        m_state.queuedPromptOffset += tokens.size();
+        if (m_state.queuedPromptOffset == m_state.queuedPrompt.size()) {
+            // the state is cached by Instance::decodeBatch after the batch is decoded
+            if (m_state.cachePrompt) {
+                m_state.promptToCache = std::move(m_state.queuedPrompt);
+                m_state.cachePrompt = false;
+            }
+            m_state.queuedPrompt.clear();
+            m_state.queuedPromptOffset = 0;
+            m_state.queuedPromptSource = Source::InitialPrompt;
+        }
+    }
+
+    return uint32_t(tokens.size());
 }
 
 void Session::flushPendingState() {
+    // whatever comes next (a new prompt, a rewind, a snapshot...) doesn't continue from undelivered predictions
+    dropSpeculated();
+
     if (m_state.m_currToken != Token_Invalid) {
         // first yield, then decode, thus we don't decode if the session is aborted
         doDecode({&m_state.m_currToken, 1}, Source::Generated);
         m_state.m_currToken = Token_Invalid;
     }
+
+    if (m_state.queuedPromptOffset < m_state.queuedPrompt.size()) {
+        // decode whatever is left of a queued prompt
+        auto rest = std::span(m_state.queuedPrompt).subspan(m_state.queuedPromptOffset);
+        doDecode(rest, m_state.queuedPromptSource);
+        if (m_state.cachePrompt) {
+            m_state.promptToCache = std::move(m_state.queuedPrompt);
+            m_state.cachePrompt = false;
+        }
+        m_state.queuedPrompt.clear();
+        m_state.queuedPromptOffset = 0;
+        m_state.queuedPromptSource = Source::InitialPrompt;
+    }
+
+    cachePromptState();
+}
+
+void Session::restoreLogits() {
+    if (m_state.logitsDecode == m_instance.m_decodeCount) {
+        return;
+    }
+
+    // another session of the instance decoded since our last decode, so our logits were overwritten
+    // decode our last token again to get them back
+    if (m_state.lastToken == Token_Invalid || m_state.numPast == 0) {
+        throw_ex{} << "Session logits were overwritten and can't be restored";
+    }
+
+    const auto pos = llama_pos(m_state.numPast - 1);
+    llama_kv_self_seq_rm(m_ctx, m_seqId, pos, -1);
+
+    auto& batch = *m_instance.m_batch;
+    batch.clear();
+    m_state.logitsIndex = batch.add(m_state.lastToken, pos, m_seqId, true);
+    if (m_instance.decode(batch) != 0) {
+        throw_ex{} << "Failed to decode tokens";
+    }
+    m_state.logitsDecode = m_instance.m_decodeCount;
 }
 
 void Session::resetSampler(const Sampler::Params& params){
@@ -410,7 +1113,17 @@ TokenPrediction Session::StreamGenerator::complete() {
         return {.token = Token_Invalid};
     }
 
-    auto p = m_session.getToken();
+    if (m_params.cancel && m_params.cancel->load(std::memory_order_relaxed)) {
+        abort();
+        return {.token = Token_Invalid};
+    }
+    if (std::chrono::steady_clock::now() >= m_params.deadline) {
+        abort();
+        m_status = Status::TimedOut;
+        return {.token = Token_Invalid};
+    }
+
+    auto p = m_session.getToken(m_params.topLogits, uint32_t(std::max(m_params.maxTokens - m_genTokens - 1, 0)));
     if (p.token == Token_Invalid) {
         // return session in Generating phase
         m_session.m_state.m_phase = Session::State::Phase::Generating;
@@ -428,6 +1141,11 @@ TokenPrediction Session::StreamGenerator::complete() {
 }
 
 void Session::StreamGenerator::abort() {
+    if (m_status == Status::InProgress && m_session.m_state.m_phase == Session::State::Phase::Streaming) {
+        // return session in Generating phase
+        m_session.m_state.m_phase = Session::State::Phase::Generating;
+        m_session.dropSpeculated();
+    }
     m_status = Status::Aborted;
 }
 } // namespace bl::llama
@@ -5,10 +5,14 @@
 #include "api.h"
 #include "Token.hpp"
 #include "Sampler.hpp"
+#include <atomic>
+#include <chrono>
 #include <span>
 #include <utility>
 #include <exception>
 #include <coroutine>
+#include <memory>
+#include <optional>
 #include <vector>
 #include <cassert>
 
@@ -16,18 +20,17 @@ struct llama_context;
 
 namespace bl::llama {
 class Instance;
-
-struct TokenPrediction {
-    Token token;
-    TokenDataVector logits;
-
-    operator bool() const {
-        return token != Token_Invalid;
-    }
-};
+class Batch;
+class PrefixCache;
+class Drafter;
+class SnapshotWriter;
 
 class BL_LLAMA_API Session {
 public:
+    // the most top logits a completion can return with each token
+    // collecting them costs time in each step and the predictions take memory, so larger values are rejected
+    static constexpr uint32_t MaxTopLogits = 100;
+
     struct InitParams {
         uint32_t gaFactor = 1; // group-attention factor
         uint32_t gaWidth = 512; // group-attention width
@@ -40,19 +43,44 @@ public:
         std::string grammar; // BNF-styled grammar
         float temperature = 0.80f; // temperature for sampling
         float topP = 0.95f; // nucleus sampling
+
+        // speculative decoding
+        // if set, generation drafts up to maxDraftTokens tokens with the drafter and verifies them in a single decode
+        // the generated tokens and their logits are the same as without a drafter
+        std::shared_ptr<Drafter> drafter;
+        uint32_t maxDraftTokens = 8;
     };
-    Session(Instance& instance, llama_context* ctx, InitParams params);
+    Session(Instance& instance, llama_context* ctx, InitParams params, int32_t seqId = 0);
     Session(const Session&) = delete;
     Session& operator=(const Session&) = delete;
     ~Session();
 
     // initial functions to prepare the session
+    // if the instance has a prefix cache, only the tokens after the longest cached prefix of the prompt are decoded
     void setInitialPrompt(std::span<const Token> prompt);
+
+    // same as setInitialPrompt, but the prompt is not decoded right away
+    // instead it's decoded in chunks by Instance::decodeBatch, together with the input of other sessions
+    // any other call which needs the context will decode the rest of the prompt first
+    void queueInitialPrompt(std::span<const Token> prompt);
+
+    // restore a state from getState (of any session of an instance with the same model and context params)
+    // only our sequence of the KV cache is affected
     bool setState(std::span<uint8_t> state);
+
     struct CompleteParams{
         std::span<const Token> prompt;
         std::span<const Token> suffix;
         int32_t maxTokens = 0;
+        uint32_t topLogits = 10; // number of top logits returned with each token (up to MaxTopLogits)
+
+        // optional: the generation stops at the next token once this is set (it can be set from any thread)
+        // a stream which is stopped this way is aborted
+        const std::atomic_bool* cancel = nullptr;
+
+        // optional: the generation stops at the first token boundary after this time
+        // a stream which is stopped this way times out
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
     };
     std::vector<TokenPrediction> complete(CompleteParams params);
 
@@ -66,12 +94,15 @@ public:
         {}
 
         TokenPrediction complete();
+
+        // stop the stream, the session can be used for other completions afterwards
         void abort();
 
         enum class Status {
             InProgress,
             Completed,
-            Aborted
+            Aborted,
+            TimedOut
         };
         Status status() const { return m_status; }
     private:
@@ -84,27 +115,127 @@ public:
     };
     StreamGenerator completeStream(CompleteParams params);
 
+    struct BeamParams {
+        std::span<const Token> prompt;
+        std::span<const Token> suffix;
+        int32_t maxTokens = 0;
+        uint32_t beamWidth = 4; // number of hypotheses kept at each step
+        uint32_t topLogits = 10; // number of top logits returned with each token (up to MaxTopLogits)
+    };
+
+    // deterministic generation: the most probable continuation found by beam search
+    // each beam is a sequence in the KV cache and all of them are advanced with a single decode per step
+    // the beams besides the first use the sequences of free session slots, so beamWidth - 1 of them must be free
+    // the sampler (and thus the grammar) is not used, but the session continues after the result as after complete
+    std::vector<TokenPrediction> completeBeam(BeamParams params);
+
+    // feed already generated tokens (for example from another instance) to the context
+    // returns the logits each token is predicted from, limited to the tokens in the corresponding input logits
+    // the tokens are decoded in batches like a prompt, which is much faster than generating them
     std::vector<TokenPrediction> fillCtx(std::span<TokenPrediction> tokens);
+
+    // the KV cache of our sequence and our last token
+    // a lightweight alternative to snapshots: the sampler and the tokens are not included
     std::vector<uint8_t> getState();
 
+    // snapshots: a self-describing, versioned serialization of the session
+    // unlike getState (the raw llama.cpp sequence state) it has everything needed to continue exactly like this session would:
+    // the KV cache of our sequence, the positions and tokens in the context, the init params, the sampler params
+    // and history (including its random number generator) and a fingerprint of the model which is checked on restore
+    // pending input is decoded before taking the snapshot
+    // a session can also be snapshotted between the tokens of a stream, the restored one continues with a new stream
+    // sessions with a mirostat or an XTC sampler (see resetSampler) can't be snapshotted, as their state can't be restored
+
+    // number of bytes needed for the snapshot of the current state
+    size_t snapshotSize();
+
+    // write the snapshot into buf (at least snapshotSize() bytes) and return the number of bytes written
+    // the KV cache is written straight into buf
+    size_t writeSnapshot(std::span<uint8_t> buf);
+
+    // restore a snapshot in a session which hasn't started yet
+    // the snapshot is read in place, so restoring from a memory-mapped file doesn't copy it
+    // the session keeps its drafter, as it's not a part of the snapshot
+    void restoreSnapshot(std::span<const uint8_t> snapshot);
+
+    // the same for files, which are memory mapped
+    void saveSnapshot(const std::string& path);
+    void loadSnapshot(const std::string& path);
+
+    // start a new session of the same instance which continues from the current state of this one
+    // the KV cache of the sequence is copied (the cells are shared, nothing is decoded) and so is the sampler state
+    // including its random number generator, so the fork samples what this session would
+    // if seed is set, the fork gets a new sampler with this seed instead, which has seen the tokens in the context
+    // (but not the grammar state)
+    // the fork uses a free session slot of the instance and is stopped with Instance::stopSession like any other
+    Session& fork(std::optional<uint32_t> seed = std::nullopt);
+
     // Change sampler settings by resetting it
     // warning: this will clear any previous sampler state
     void resetSampler(const Sampler::Params& params);
+
+    // a restored session (see restoreSnapshot) gets its logits by decoding its last token again
+    // this queues the token as pending input, so that it's decoded with the next batch (see Instance::decodeBatch)
+    // instead of on its own when the next token is requested
+    void queueLastToken();
+
+    // same as completing with a prompt, but the prompt is not decoded right away
+    // instead it's decoded in chunks by Instance::decodeBatch, like a queued initial prompt
+    void queuePrompt(std::span<const Token> prompt);
+
+    // drop everything after the first numTokens tokens from the context, so that the session continues from there
+    // (for example when the rest of a conversation has changed)
+    // rewinding to 0 clears the context, so the next prompt is decoded from scratch
+    // the sampler is reset, as it is by a new prompt
+    // only possible if the tokens in the context are known (see tokens()) and group attention is not used
+    void rewind(uint32_t numTokens);
+
+    // tokens in the context, not including the last generated one if it's not decoded yet
+    // empty if they are unknown (after setState)
+    std::span<const Token> tokens() const noexcept { return m_state.tokens; }
+
+    // KV cache sequence of this session
+    int32_t seqId() const noexcept { return m_seqId; }
+
+    // true if there is input which is not decoded yet (a queued prompt or the last generated token)
+    bool hasPendingInput() const noexcept;
+
+    struct SpeculativeStats {
+        uint64_t steps = 0; // number of verification decodes
+        uint64_t drafted = 0; // number of drafted tokens
+        uint64_t accepted = 0; // number of drafted tokens which matched the sampled ones
+
+        float acceptanceRate() const noexcept { return drafted ? float(accepted) / float(drafted) : 0.f; }
+    };
+    const SpeculativeStats& speculativeStats() const noexcept { return m_speculativeStats; }
 private:
+    friend class Instance;
+
     enum class Source {
         InitialPrompt,
         InteractivePrompt,
-        Generated
+        Generated,
+        Restored, // decoded again, so the sampler has already accepted it
     };
 
     // main functions to interact with the model
     void pushPrompt(std::span<const Token> prompt, std::span<const Token> postfix = {});
-    TokenPrediction getToken();
+    std::vector<Token> preparePrompt(std::span<const Token> prompt, std::span<const Token> postfix);
+    // maxDraft limits the tokens verified ahead (it's the number of tokens the caller will request after this one)
+    TokenPrediction getToken(uint32_t topLogits, uint32_t maxDraft = 0);
+    TokenPrediction speculate(uint32_t topLogits, uint32_t maxDraft);
+    void dropSpeculated(); // forget the predictions which getToken hasn't returned, as if they were never verified
 
     void doDecode(std::span<const Token> tokens, Source src);
+    void mitigateFullContext(uint32_t numNewTokens);
+    void acceptTokens(std::span<const Token> tokens, Source src);
+    uint32_t fillBatch(Batch& batch, uint32_t maxTokens);
     void flushPendingState();
-    TokenDataVector getLogitsFromCtx(int32_t topK);
-    TokenDataVector getLogitsFromCtx(TokenDataVector tokens);
+    void restoreLogits();
+    void reuseCachedPrefix(PrefixCache& cache);
+    void cachePromptState();
+    void writeSnapshot(SnapshotWriter& w);
+    uint32_t ctxLength() const noexcept;
 
     struct State {
         enum class Phase {
@@ -120,13 +251,30 @@ private:
         unsigned numKeep = 0;
         uint32_t gaIndex = 0; // number of grouped KV tokens (only used if params.gaFactor > 1)
         uint32_t numPast = 0; // number of tokens in the context (that's prompts + generated)
+        std::vector<Token> tokens; // tokens in the context, used for drafting (unknown after setState)
+
+        std::vector<Token> queuedPrompt; // prompt tokens which are yet to be decoded
+        size_t queuedPromptOffset = 0; // number of tokens from queuedPrompt which are already decoded
+        Source queuedPromptSource = Source::InitialPrompt;
+
+        bool cachePrompt = false; // add the initial prompt to the prefix cache once it's decoded
+        std::vector<Token> promptToCache; // decoded initial prompt, the state of which is to be cached
+
+        int32_t logitsIndex = -1; // index of the logits to sample from (-1 = last logits in the context)
+        uint64_t logitsDecode = 0; // Instance::m_decodeCount of the decode which produced our logits
+        Token lastToken = Token_Invalid; // last decoded token, needed to restore the logits if they are overwritten
+
+        std::vector<TokenPrediction> speculated; // verified predictions which are yet to be returned by getToken
+        size_t speculatedOffset = 0; // number of predictions from speculated which are already returned
     };
 
     Instance& m_instance;
     llama_context* m_ctx;
+    int32_t m_seqId;
     std::unique_ptr<Sampler> m_sampler;
     InitParams m_params;
     State m_state;
+    SpeculativeStats m_speculativeStats;
 };
 
 } // namespace bl::llama
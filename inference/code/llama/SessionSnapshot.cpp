@@ -0,0 +1,463 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "Session.hpp"
+#include "Model.hpp"
+#include "Instance.hpp"
+#include "MappedFile.hpp"
+
+#include <llama.h>
+
+#include <bstl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+
+// snapshot format, all values are in the native byte order
+//
+// header:
+//   u32 magic, u32 version, u64 total size (including the header), u64 model fingerprint
+// followed by sections:
+//   u32 section id, u64 payload size, payload
+//
+// readers skip sections they don't know, so new ones can be added without changing the version
+
+namespace bl::llama {
+
+namespace {
+constexpr uint32_t Snapshot_Magic = 0x53534c42; // "BLSS"
+constexpr uint32_t Snapshot_Version = 1;
+
+enum class Section : uint32_t {
+    InitParams = 1,
+    State = 2,
+    Sampler = 3,
+    KvCache = 4,
+};
+
+uint64_t modelFingerprint(const Model& model) {
+    auto lmodel = model.lmodel();
+
+    char desc[256] = {};
+    llama_model_desc(lmodel, desc, sizeof(desc));
+
+    // FNV-1a over the description and the dimensions of the model
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto add = [&](const void* data, size_t size) {
+        auto bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            h ^= bytes[i];
+            h *= 0x100000001b3ull;
+        }
+    };
+    add(desc, std::strlen(desc));
+    const uint64_t dims[] = {
+        llama_model_n_params(lmodel),
+        llama_model_size(lmodel),
+        uint64_t(llama_vocab_n_tokens(llama_model_get_vocab(lmodel))),
+        uint64_t(llama_model_n_embd(lmodel)),
+        uint64_t(llama_model_n_layer(lmodel)),
+    };
+    add(dims, sizeof(dims));
+    return h;
+}
+} // namespace
+
+// writes into a buffer or, if there is none, only counts the bytes
+class SnapshotWriter {
+public:
+    SnapshotWriter() = default;
+    explicit SnapshotWriter(std::span<uint8_t> buf) : m_buf(buf.data()), m_capacity(buf.size()) {}
+
+    size_t size() const noexcept { return m_size; }
+
+    // room for n bytes, null if only counting
+    uint8_t* reserve(size_t n) {
+        if (!m_buf) {
+            m_size += n;
+            return nullptr;
+        }
+        if (m_capacity - m_size < n) {
+            throw_ex{} << "Snapshot buffer is too small";
+        }
+        auto p = m_buf + m_size;
+        m_size += n;
+        return p;
+    }
+
+    void bytes(const void* data, size_t n) {
+        if (auto p = reserve(n)) {
+            std::memcpy(p, data, n);
+        }
+    }
+
+    template <typename T>
+    void pod(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        bytes(&value, sizeof(T));
+    }
+
+    void str(std::string_view s) {
+        pod(uint32_t(s.size()));
+        bytes(s.data(), s.size());
+    }
+
+    // overwrite a u64 at a previous offset
+    void patch(size_t offset, uint64_t value) {
+        if (m_buf) {
+            std::memcpy(m_buf + offset, &value, sizeof(value));
+        }
+    }
+
+    // returns the offset of the size, which is patched by endSection
+    size_t beginSection(Section id) {
+        pod(uint32_t(id));
+        const auto offset = m_size;
+        pod(uint64_t(0));
+        return offset;
+    }
+
+    void endSection(size_t offset) {
+        patch(offset, m_size - offset - sizeof(uint64_t));
+    }
+
+private:
+    uint8_t* m_buf = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+};
+
+namespace {
+// reads in place
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::span<const uint8_t> data) : m_data(data) {}
+
+    bool atEnd() const noexcept { return m_data.empty(); }
+
+    std::span<const uint8_t> bytes(size_t n) {
+        if (m_data.size() < n) {
+            throw_ex{} << "Truncated snapshot";
+        }
+        auto ret = m_data.first(n);
+        m_data = m_data.subspan(n);
+        return ret;
+    }
+
+    template <typename T>
+    T pod() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, bytes(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    std::span<const uint8_t> rest() {
+        return bytes(m_data.size());
+    }
+
+    bool boolean() {
+        return pod<uint8_t>() != 0;
+    }
+
+    std::string str() {
+        const auto size = pod<uint32_t>();
+        auto data = bytes(size);
+        return std::string(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+private:
+    std::span<const uint8_t> m_data;
+};
+
+void writeSamplerParams(SnapshotWriter& w, const Sampler::Params& p) {
+    w.pod(p.rngSeed);
+    w.pod(p.minKeep);
+    w.pod(p.topK);
+    w.pod(p.topP);
+    w.pod(p.minP);
+    w.pod(p.tfsZ);
+    w.pod(p.typicalP);
+    w.pod(p.temp);
+    w.pod(p.tempRange);
+    w.pod(p.tempExp);
+    w.pod(p.repetitionPenalty.numTokens);
+    w.pod(p.repetitionPenalty.repeat);
+    w.pod(p.repetitionPenalty.freq);
+    w.pod(p.repetitionPenalty.present);
+    w.pod(p.mirostat.ver);
+    w.pod(p.mirostat.tau);
+    w.pod(p.mirostat.eta);
+    w.pod(p.xtc.probability);
+    w.pod(p.xtc.threshold);
+    w.pod(uint32_t(p.samplerSequence.size()));
+    for (auto t : p.samplerSequence) {
+        w.pod(uint32_t(t));
+    }
+    w.str(p.grammar);
+    w.pod(uint32_t(p.logitBias.size()));
+    for (auto& [token, bias] : p.logitBias) {
+        w.pod(token);
+        w.pod(bias);
+    }
+}
+
+Sampler::Params readSamplerParams(SnapshotReader& r) {
+    Sampler::Params p;
+    p.rngSeed = r.pod<uint32_t>();
+    p.minKeep = r.pod<int32_t>();
+    p.topK = r.pod<int32_t>();
+    p.topP = r.pod<float>();
+    p.minP = r.pod<float>();
+    p.tfsZ = r.pod<float>();
+    p.typicalP = r.pod<float>();
+    p.temp = r.pod<float>();
+    p.tempRange = r.pod<float>();
+    p.tempExp = r.pod<float>();
+    p.repetitionPenalty.numTokens = r.pod<int32_t>();
+    p.repetitionPenalty.repeat = r.pod<float>();
+    p.repetitionPenalty.freq = r.pod<float>();
+    p.repetitionPenalty.present = r.pod<float>();
+    p.mirostat.ver = r.pod<int32_t>();
+    p.mirostat.tau = r.pod<float>();
+    p.mirostat.eta = r.pod<float>();
+    p.xtc.probability = r.pod<float>();
+    p.xtc.threshold = r.pod<float>();
+    p.samplerSequence.resize(r.pod<uint32_t>());
+    for (auto& t : p.samplerSequence) {
+        const auto type = r.pod<uint32_t>();
+        if (type > uint32_t(Sampler::SamplingType::Infill)) {
+            throw_ex{} << "Unknown sampling type in snapshot: " << type;
+        }
+        t = Sampler::SamplingType(type);
+    }
+    p.grammar = r.str();
+    p.logitBias.clear();
+    for (auto n = r.pod<uint32_t>(); n > 0; --n) {
+        const auto token = r.pod<Token>();
+        p.logitBias[token] = r.pod<float>();
+    }
+    return p;
+}
+
+void checkSnapshotSampler(const Sampler::Params& params) {
+    // the mirostat samplers don't use the dist sampler, so their random number generator (and state) can't be replayed
+    if (params.mirostat.ver != 0) {
+        throw_ex{} << "Sessions with mirostat sampling can't be snapshotted";
+    }
+
+    // neither can the one of the XTC sampler
+    const auto& seq = params.samplerSequence;
+    if (params.xtc.probability > 0 && std::find(seq.begin(), seq.end(), Sampler::SamplingType::XTC) != seq.end()) {
+        throw_ex{} << "Sessions with XTC sampling can't be snapshotted";
+    }
+}
+} // namespace
+
+void Session::writeSnapshot(SnapshotWriter& w) {
+    w.pod(Snapshot_Magic);
+    w.pod(Snapshot_Version);
+    const auto sizeOffset = w.size();
+    w.pod(uint64_t(0));
+    w.pod(modelFingerprint(m_instance.model()));
+
+    {
+        // the drafter is not serializable, so the restoring session keeps its own
+        const auto s = w.beginSection(Section::InitParams);
+        w.pod(m_params.gaFactor);
+        w.pod(m_params.gaWidth);
+        w.pod(uint8_t(m_params.infiniteContext));
+        w.pod(m_params.seed);
+        w.str(m_params.grammar);
+        w.pod(m_params.temperature);
+        w.pod(m_params.topP);
+        w.endSection(s);
+    }
+
+    {
+        const auto s = w.beginSection(Section::State);
+        w.pod(uint32_t(m_state.numKeep));
+        w.pod(m_state.gaIndex);
+        w.pod(m_state.numPast);
+        w.pod(m_state.lastToken);
+        w.pod(uint32_t(m_state.tokens.size()));
+        w.bytes(m_state.tokens.data(), m_state.tokens.size() * sizeof(Token));
+        w.endSection(s);
+    }
+
+    {
+        // the params of the sampler may differ from the init params after resetSampler
+        const auto s = w.beginSection(Section::Sampler);
+        writeSamplerParams(w, m_sampler->params());
+        auto& history = m_sampler->history();
+        w.pod(history.numDraws);
+        w.pod(uint32_t(history.accepted.size()));
+        for (auto& a : history.accepted) {
+            w.pod(a.token);
+            w.pod(uint8_t(a.grammar));
+        }
+        w.endSection(s);
+    }
+
+    {
+        // the KV cache goes straight into the destination
+        const auto s = w.beginSection(Section::KvCache);
+        const auto size = llama_state_seq_get_size(m_ctx, m_seqId);
+        auto dst = w.reserve(size);
+        if (dst && llama_state_seq_get_data(m_ctx, dst, size, m_seqId) != size) {
+            throw_ex{} << "Failed to get state";
+        }
+        w.endSection(s);
+    }
+
+    w.patch(sizeOffset, w.size());
+}
+
+size_t Session::snapshotSize() {
+    if (m_state.m_phase == State::Phase::Initial) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+    checkSnapshotSampler(m_sampler->params());
+
+    flushPendingState();
+
+    SnapshotWriter w;
+    writeSnapshot(w);
+    return w.size();
+}
+
+size_t Session::writeSnapshot(std::span<uint8_t> buf) {
+    if (m_state.m_phase == State::Phase::Initial) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+    checkSnapshotSampler(m_sampler->params());
+
+    flushPendingState();
+
+    SnapshotWriter w(buf);
+    writeSnapshot(w);
+    return w.size();
+}
+
+void Session::restoreSnapshot(std::span<const uint8_t> snapshot) {
+    if (m_state.m_phase != State::Phase::Initial) {
+        throw_ex{} << "Session already started";
+    }
+
+    SnapshotReader header(snapshot);
+    if (header.pod<uint32_t>() != Snapshot_Magic) {
+        throw_ex{} << "Not a session snapshot";
+    }
+    if (const auto version = header.pod<uint32_t>(); version != Snapshot_Version) {
+        throw_ex{} << "Unsupported session snapshot version: " << version;
+    }
+    const auto size = header.pod<uint64_t>();
+    if (size > snapshot.size()) {
+        throw_ex{} << "Truncated snapshot";
+    }
+    if (header.pod<uint64_t>() != modelFingerprint(m_instance.model())) {
+        throw_ex{} << "Snapshot is of a different model";
+    }
+
+    // parse everything first, so that a bad snapshot leaves the session untouched
+    const auto headerSize = sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2;
+    SnapshotReader r(snapshot.subspan(headerSize, size_t(size) - headerSize));
+
+    std::optional<InitParams> params;
+    std::optional<State> state;
+    std::optional<Sampler::Params> samplerParams;
+    Sampler::History history;
+    std::optional<std::span<const uint8_t>> kvCache;
+
+    while (!r.atEnd()) {
+        const auto id = Section(r.pod<uint32_t>());
+        SnapshotReader s(r.bytes(size_t(r.pod<uint64_t>())));
+        switch (id) {
+        case Section::InitParams:
+            params.emplace();
+            params->gaFactor = s.pod<uint32_t>();
+            params->gaWidth = s.pod<uint32_t>();
+            params->infiniteContext = s.boolean();
+            params->seed = s.pod<uint32_t>();
+            params->grammar = s.str();
+            params->temperature = s.pod<float>();
+            params->topP = s.pod<float>();
+            break;
+        case Section::State: {
+            state.emplace();
+            state->numKeep = s.pod<uint32_t>();
+            state->gaIndex = s.pod<uint32_t>();
+            state->numPast = s.pod<uint32_t>();
+            state->lastToken = s.pod<Token>();
+            const auto numTokens = s.pod<uint32_t>();
+            auto tokens = s.bytes(size_t(numTokens) * sizeof(Token));
+            state->tokens.resize(numTokens);
+            std::memcpy(state->tokens.data(), tokens.data(), tokens.size());
+            break;
+        }
+        case Section::Sampler:
+            samplerParams = readSamplerParams(s);
+            history.numDraws = s.pod<uint64_t>();
+            history.accepted.resize(s.pod<uint32_t>());
+            for (auto& a : history.accepted) {
+                a.token = s.pod<Token>();
+                a.grammar = s.boolean();
+            }
+            break;
+        case Section::KvCache:
+            kvCache = s.rest();
+            break;
+        default:
+            break; // unknown sections are from a newer writer, skip them
+        }
+    }
+
+    if (!params || !state || !samplerParams || !kvCache) {
+        throw_ex{} << "Incomplete session snapshot";
+    }
+    checkSnapshotSampler(*samplerParams);
+    if (state->numPast > m_state.maxTokens) {
+        throw_ex{} << "Snapshot of " << state->numPast << " tokens doesn't fit the session context";
+    }
+
+    // llama.cpp reads the KV cache in place
+    if (llama_state_seq_set_data(m_ctx, kvCache->data(), kvCache->size(), m_seqId) != kvCache->size()) {
+        throw_ex{} << "Failed to set state";
+    }
+
+    params->drafter = std::move(m_params.drafter);
+    params->maxDraftTokens = m_params.maxDraftTokens;
+    m_params = std::move(*params);
+
+    m_sampler.reset(new Sampler(m_instance.model(), *samplerParams));
+    m_sampler->replay(history);
+
+    m_state.numKeep = state->numKeep;
+    m_state.gaIndex = state->gaIndex;
+    m_state.numPast = state->numPast;
+    m_state.lastToken = state->lastToken;
+    m_state.tokens = std::move(state->tokens);
+
+    // the sequence state has no logits, so mark ours as overwritten (decode counts only grow)
+    // and they will be restored by decoding the last token again when needed (or with a batch, see queueLastToken)
+    m_state.logitsIndex = -1;
+    m_state.logitsDecode = m_instance.m_decodeCount - 1;
+
+    m_state.m_phase = State::Phase::Generating;
+}
+
+void Session::saveSnapshot(const std::string& path) {
+    const auto size = snapshotSize();
+    MappedFile file(path, MappedFile::Mode::Write, size);
+    writeSnapshot(file.data());
+}
+
+void Session::loadSnapshot(const std::string& path) {
+    MappedFile file(path, MappedFile::Mode::Read);
+    restoreSnapshot(file.data());
+}
+
+} // namespace bl::llama
@@ -15,4 +15,13 @@ struct TokenData {
 };
 
 using TokenDataVector = std::vector<TokenData>;
+
+struct TokenPrediction {
+    Token token;
+    TokenDataVector logits;
+
+    operator bool() const {
+        return token != Token_Invalid;
+    }
+};
 } // namespace bl::llama
@@ -0,0 +1,46 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+#include <vector>
+
+#include "llama/Drafter.hpp"
+
+using Tokens = std::vector<bl::llama::Token>;
+
+TEST_CASE("ngram drafter") {
+    bl::llama::NgramDrafter drafter({.minNgram = 2, .maxNgram = 3});
+
+    // no repetition
+    CHECK(drafter.draft(Tokens{1, 2, 3, 4}, 5).empty());
+
+    // the last 2 tokens appeared before
+    CHECK(drafter.draft(Tokens{1, 2, 3, 4, 5, 2, 3}, 2) == Tokens{4, 5});
+
+    // incremental: the continuation is also indexed
+    CHECK(drafter.draft(Tokens{1, 2, 3, 4, 5, 2, 3, 4, 5, 6, 4, 5}, 10) == Tokens{6, 4, 5});
+
+    // a single token is not enough
+    CHECK(drafter.draft(Tokens{1, 2, 3, 4, 5, 2, 3, 4, 5, 6, 4, 5, 9, 1}, 10).empty());
+
+    // no tokens requested
+    CHECK(drafter.draft(Tokens{7, 8, 7, 8}, 0).empty());
+
+    // different tokens rebuild the index
+    CHECK(drafter.draft(Tokens{7, 8, 9, 7, 8}, 10) == Tokens{9, 7, 8});
+}
+
+TEST_CASE("ngram drafter - longest match") {
+    bl::llama::NgramDrafter drafter({.minNgram = 1, .maxNgram = 3});
+
+    // 5 is followed by 6 most recently, but 4 5 is followed by 7
+    CHECK(drafter.draft(Tokens{4, 5, 7, 8, 5, 6, 0, 4, 5}, 2) == Tokens{7, 8});
+
+    // the latest occurrence wins
+    CHECK(drafter.draft(Tokens{4, 5, 7, 8, 5, 6, 0, 4, 5, 1, 5}, 1) == Tokens{1});
+}
+
+TEST_CASE("ngram drafter - invalid") {
+    CHECK_THROWS_WITH(bl::llama::NgramDrafter({.minNgram = 0}), "Invalid n-gram lengths: 0 - 4");
+    CHECK_THROWS_WITH(bl::llama::NgramDrafter({.minNgram = 3, .maxNgram = 2}), "Invalid n-gram lengths: 3 - 2");
+}
@@ -3,6 +3,8 @@
 //
 #include <doctest/doctest.h>
 
+#include <vector>
+
 #include <llama/LogitComparer.hpp>
 #include <llama/Model.hpp>
 #include <llama/Instance.hpp>
@@ -38,6 +40,87 @@ TEST_CASE("compare - no model") {
     CHECK(score == 1.0f);
 }
 
+TEST_CASE("compare - partial overlap") {
+    bl::llama::TokenDataVector tdv1 = {{5, 10.f}, {3, 9.f}, {8, 7.f}, {1, 6.f}};
+    bl::llama::TokenDataVector tdv2 = {{3, 10.f}, {5, 9.5f}, {2, 7.f}, {1, 5.f}};
+
+    auto metrics = bl::llama::LogitComparer::compare(tdv1, tdv2);
+    CHECK(metrics.top1Match == 0.0f);
+    CHECK(metrics.distance > 0.0f);
+    CHECK(metrics.jsd > 0.0f);
+    CHECK(metrics.jsd < 0.1f);
+
+    // the order of the tokens doesn't matter for the divergence, only their logits
+    auto swapped = bl::llama::LogitComparer::compare(tdv2, tdv1);
+    CHECK(swapped.jsd == doctest::Approx(metrics.jsd));
+
+    // token 8 is missing in tdv2
+    auto sim = bl::llama::LogitComparer::logitSimilarity(tdv1, tdv2);
+    CHECK(sim > 0.5f);
+    CHECK(sim < 1.0f);
+
+    // batch
+    std::vector<bl::llama::TokenPrediction> p1 = {{5, tdv1}, {3, tdv1}, {1, tdv1}};
+    std::vector<bl::llama::TokenPrediction> p2 = {{5, tdv2}, {3, tdv1}};
+    auto batch = bl::llama::LogitComparer::compare(p1, p2);
+    REQUIRE(batch.size() == 2);
+    CHECK(batch[0].jsd == metrics.jsd);
+    CHECK(batch[0].distance == metrics.distance);
+    CHECK(batch[1].top1Match == 1.0f);
+    CHECK(batch[1].jsd == 0.0f);
+    CHECK(batch[1].distance == 0.0f);
+
+    // empty
+    auto empty = bl::llama::LogitComparer::compare(tdv1, {});
+    CHECK(empty.top1Match == 0.0f);
+    CHECK(empty.jsd == 1.0f);
+}
+
+TEST_CASE("metrics aggregator") {
+    bl::llama::MetricsAggregator agg;
+    CHECK(agg.size() == 0);
+    CHECK(agg.score() == 0.0f);
+    CHECK(agg.worstWindow(4).size == 0);
+
+    bl::llama::ComparisonMetrics good = {.top1Match = 1.f, .distance = 0.f, .jsd = 0.f};
+    bl::llama::ComparisonMetrics bad = {.top1Match = 0.f, .distance = 1.f, .jsd = 1.f};
+    bl::llama::ComparisonMetrics half = {.top1Match = 1.f, .distance = 0.5f, .jsd = 0.5f};
+
+    CHECK(bl::llama::MetricsAggregator::positionScore(good) == 1.f);
+    CHECK(bl::llama::MetricsAggregator::positionScore(bad) == 0.f);
+    CHECK(bl::llama::MetricsAggregator::positionScore(half) == 0.5f);
+
+    // 1 1 1 1 0 0.5 1 1
+    std::vector<bl::llama::ComparisonMetrics> metrics = {good, good, good, good, bad, half, good, good};
+    agg.push(metrics);
+    CHECK(agg.size() == 8);
+    CHECK(agg.score() == doctest::Approx(6.5 / 8));
+    CHECK(agg.positionScore(4) == 0.f);
+    CHECK(agg.positionMetrics(5).distance == 0.5f);
+
+    CHECK(agg.windowScore(0, 4) == 1.f);
+    CHECK(agg.windowScore(4, 2) == doctest::Approx(0.25));
+    CHECK(agg.windowScore(6, 100) == 1.f); // clamped
+    CHECK(agg.windowScore(8, 1) == 0.f); // empty
+
+    auto w = agg.worstWindow(2);
+    CHECK(w.begin == 4);
+    CHECK(w.size == 2);
+    CHECK(w.score == doctest::Approx(0.25));
+
+    w = agg.worstWindow(3);
+    CHECK(w.begin == 3);
+    CHECK(w.score == doctest::Approx(0.5));
+
+    w = agg.worstWindow(32);
+    CHECK(w.begin == 0);
+    CHECK(w.size == 8);
+    CHECK(w.score == agg.score());
+
+    // incremental
+    CHECK(agg.pushAndVerify({&bad, 1}) == doctest::Approx(6.5 / 9));
+}
+
 TEST_CASE("compare - with model") {
     const char* Model_117m_q6_k = AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
     bl::llama::Model model(Model_117m_q6_k, {});
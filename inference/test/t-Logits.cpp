@@ -0,0 +1,126 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "llama/Logits.hpp"
+
+namespace {
+bl::llama::TokenDataVector sortedTopK(const std::vector<float>& logits, uint32_t k) {
+    bl::llama::TokenDataVector all;
+    for (size_t i = 0; i < logits.size(); ++i) {
+        all.push_back({bl::llama::Token(i), logits[i]});
+    }
+    std::stable_sort(all.begin(), all.end(), [](const bl::llama::TokenData& a, const bl::llama::TokenData& b) {
+        return a.logit > b.logit;
+    });
+    all.resize(std::min(size_t(k), all.size()));
+    return all;
+}
+}
+
+TEST_CASE("top k - small") {
+    std::vector<float> logits = {1.f, 5.f, 3.f, -2.f, 4.f};
+
+    CHECK(bl::llama::topKLogits(logits, 0).empty());
+    CHECK(bl::llama::topKLogits({}, 3).empty());
+
+    auto top = bl::llama::topKLogits(logits, 3);
+    REQUIRE(top.size() == 3);
+    CHECK(top[0].token == 1);
+    CHECK(top[0].logit == 5.f);
+    CHECK(top[1].token == 4);
+    CHECK(top[2].token == 2);
+
+    // more than available
+    top = bl::llama::topKLogits(logits, 10);
+    REQUIRE(top.size() == 5);
+    CHECK(top.back().token == 3);
+
+    // NaN is never selected
+    logits.push_back(NAN);
+    top = bl::llama::topKLogits(logits, 5);
+    CHECK(std::none_of(top.begin(), top.end(), [](auto& t) { return std::isnan(t.logit); }));
+}
+
+TEST_CASE("top k - vocab") {
+    std::minstd_rand rng(42);
+    std::normal_distribution<float> dist(0.f, 3.f);
+
+    std::vector<float> logits(151'936);
+    for (auto& l : logits) {
+        l = dist(rng);
+    }
+    // make sure that blocks at the edges are handled
+    logits.front() = 100.f;
+    logits.back() = 99.f;
+
+    for (uint32_t k : {1u, 10u, 40u, 100u}) {
+        auto top = bl::llama::topKLogits(logits, k);
+        auto ref = sortedTopK(logits, k);
+        REQUIRE(top.size() == ref.size());
+        for (size_t i = 0; i < top.size(); ++i) {
+            CHECK(top[i].token == ref[i].token);
+            CHECK(top[i].logit == ref[i].logit);
+        }
+    }
+
+    auto top = bl::llama::topKLogits(logits, 2);
+    CHECK(top[0].token == 0);
+    CHECK(top[1].token == bl::llama::Token(logits.size() - 1));
+}
+
+TEST_CASE("gather") {
+    std::vector<float> logits = {1.f, 5.f, 3.f, -2.f, 4.f};
+
+    CHECK(bl::llama::gatherLogits(logits, {}).empty());
+
+    bl::llama::TokenDataVector tokens = {{3, 0.f}, {1, 0.f}, {2, 0.f}};
+    auto res = bl::llama::gatherLogits(logits, tokens);
+    REQUIRE(res.size() == 3);
+    CHECK(res[0].token == 1);
+    CHECK(res[0].logit == 5.f);
+    CHECK(res[1].token == 2);
+    CHECK(res[1].logit == 3.f);
+    CHECK(res[2].token == 3);
+    CHECK(res[2].logit == -2.f);
+
+    // out of vocab and duplicates
+    tokens = {{4, 0.f}, {-1, 0.f}, {5, 0.f}, {4, 1.f}, {0, 0.f}};
+    res = bl::llama::gatherLogits(logits, tokens);
+    REQUIRE(res.size() == 2);
+    CHECK(res[0].token == 4);
+    CHECK(res[1].token == 0);
+}
+
+TEST_CASE("gather - positions") {
+    // 3 positions with a vocab of 4
+    std::vector<float> rows = {
+        0.f, 1.f, 2.f, 3.f,
+        3.f, 2.f, 1.f, 0.f,
+        5.f, 5.f, 6.f, 4.f,
+    };
+
+    std::vector<bl::llama::TokenPrediction> predictions = {
+        {.token = 1, .logits = {{0, 0.f}, {3, 0.f}}},
+        {.token = 2, .logits = {{0, 0.f}, {3, 0.f}}},
+    };
+
+    auto res = bl::llama::gatherLogits(rows, 4, predictions);
+    REQUIRE(res.size() == 2);
+
+    CHECK(res[0].token == 1);
+    REQUIRE(res[0].logits.size() == 2);
+    CHECK(res[0].logits[0].token == 3);
+    CHECK(res[0].logits[0].logit == 3.f);
+
+    CHECK(res[1].token == 2);
+    REQUIRE(res[1].logits.size() == 2);
+    CHECK(res[1].logits[0].token == 0);
+    CHECK(res[1].logits[0].logit == 3.f);
+    CHECK(res[1].logits[1].logit == 0.f);
+}
@@ -0,0 +1,138 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+#include <vector>
+
+#include "llama/PrefixCache.hpp"
+
+using Tokens = std::vector<bl::llama::Token>;
+
+std::vector<uint8_t> makeState(size_t size, uint8_t value) {
+    return std::vector<uint8_t>(size, value);
+}
+
+TEST_CASE("prefix cache - find") {
+    bl::llama::PrefixCache cache({
+        .maxBytes = 1000,
+        .minTokens = 2
+    });
+
+    auto m = cache.find(Tokens{1, 2, 3});
+    CHECK_FALSE(m.state);
+    CHECK(m.length == 0);
+
+    cache.insert(Tokens{1, 2, 3, 4}, makeState(10, 1));
+
+    // exact
+    m = cache.find(Tokens{1, 2, 3, 4});
+    REQUIRE(m.state);
+    CHECK(m.length == 4);
+    CHECK(m.stateLength == 4);
+    CHECK(m.state->front() == 1);
+
+    // longer
+    m = cache.find(Tokens{1, 2, 3, 4, 5, 6});
+    REQUIRE(m.state);
+    CHECK(m.length == 4);
+
+    // diverging
+    m = cache.find(Tokens{1, 2, 7});
+    REQUIRE(m.state);
+    CHECK(m.length == 2);
+    CHECK(m.stateLength == 4);
+
+    // too short
+    m = cache.find(Tokens{1, 5});
+    CHECK_FALSE(m.state);
+
+    m = cache.find(Tokens{2, 3, 4});
+    CHECK_FALSE(m.state);
+
+    auto stats = cache.stats();
+    CHECK(stats.hits == 3);
+    CHECK(stats.misses == 3);
+    CHECK(stats.hitTokens == 10);
+    CHECK(stats.entries == 1);
+    CHECK(stats.bytes == 10);
+}
+
+TEST_CASE("prefix cache - insert") {
+    bl::llama::PrefixCache cache({
+        .maxBytes = 1000,
+        .minTokens = 3
+    });
+
+    // too short
+    cache.insert(Tokens{1, 2}, makeState(10, 1));
+    CHECK(cache.stats().entries == 0);
+
+    // too big
+    cache.insert(Tokens{1, 2, 3}, makeState(1001, 1));
+    CHECK(cache.stats().entries == 0);
+
+    cache.insert(Tokens{1, 2, 3}, makeState(10, 1));
+    cache.insert(Tokens{1, 2, 5, 6}, makeState(20, 2));
+    CHECK(cache.stats().entries == 2);
+    CHECK(cache.stats().bytes == 30);
+
+    // supersedes 1, 2, 3
+    cache.insert(Tokens{1, 2, 3, 4}, makeState(30, 3));
+    CHECK(cache.stats().entries == 2);
+    CHECK(cache.stats().bytes == 50);
+
+    auto m = cache.find(Tokens{1, 2, 3});
+    REQUIRE(m.state);
+    CHECK(m.length == 3);
+    CHECK(m.stateLength == 4);
+    CHECK(m.state->front() == 3);
+
+    // replace
+    cache.insert(Tokens{1, 2, 5, 6}, makeState(40, 4));
+    CHECK(cache.stats().entries == 2);
+    CHECK(cache.stats().bytes == 70);
+    m = cache.find(Tokens{1, 2, 5, 6, 7});
+    REQUIRE(m.state);
+    CHECK(m.length == 4);
+    CHECK(m.state->front() == 4);
+
+    cache.clear();
+    CHECK(cache.stats().entries == 0);
+    CHECK(cache.stats().bytes == 0);
+    CHECK_FALSE(cache.find(Tokens{1, 2, 3}).state);
+}
+
+TEST_CASE("prefix cache - eviction") {
+    bl::llama::PrefixCache cache({
+        .maxBytes = 100,
+        .minTokens = 1
+    });
+
+    cache.insert(Tokens{1, 2}, makeState(40, 1));
+    cache.insert(Tokens{3, 4}, makeState(40, 2));
+
+    // touch 1, 2, so that 3, 4 is the least recently used
+    CHECK(cache.find(Tokens{1, 2}).state);
+
+    cache.insert(Tokens{5, 6}, makeState(40, 3));
+
+    auto stats = cache.stats();
+    CHECK(stats.entries == 2);
+    CHECK(stats.bytes == 80);
+    CHECK(stats.evictions == 1);
+
+    CHECK(cache.find(Tokens{1, 2}).state);
+    CHECK_FALSE(cache.find(Tokens{3}).state);
+    CHECK(cache.find(Tokens{5, 6}).state);
+
+    // a long prefix, to check that deep tries are handled
+    Tokens longPrompt(100000);
+    for (size_t i = 0; i < longPrompt.size(); ++i) {
+        longPrompt[i] = bl::llama::Token(i);
+    }
+    cache.insert(longPrompt, makeState(100, 4));
+    stats = cache.stats();
+    CHECK(stats.entries == 1);
+    CHECK(stats.evictions == 3);
+    CHECK(cache.find(longPrompt).length == longPrompt.size());
+}
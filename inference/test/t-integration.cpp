@@ -7,9 +7,14 @@
 #include <llama/InstanceEmbedding.hpp>
 #include <llama/Session.hpp>
 #include <llama/ControlVector.hpp>
+#include <llama/PrefixCache.hpp>
+#include <llama/Drafter.hpp>
 
 #include <doctest/doctest.h>
 
+#include <algorithm>
+#include <filesystem>
+
 #include "ac-test-data-llama-dir.h"
 
 struct GlobalFixture {
@@ -157,6 +162,17 @@ TEST_CASE("session") {
         CHECK_THROWS_WITH(s.setState({}), "Session already started");
     }
 
+    SUBCASE("too many top logits") {
+        auto& s = inst.startSession({});
+        auto tokens = model.vocab().tokenize("President George W.", true, true);
+        s.setInitialPrompt(tokens);
+        CHECK_THROWS_WITH(s.complete({.maxTokens = 1, .topLogits = 101}), "Too many top logits: 101, max: 100");
+        CHECK_THROWS_WITH(s.completeStream({.maxTokens = 1, .topLogits = 101}), "Too many top logits: 101, max: 100");
+        auto p = s.complete({.maxTokens = 1, .topLogits = 100});
+        REQUIRE(p.size() == 1);
+        CHECK(p[0].logits.size() == 100);
+    }
+
     SUBCASE("generating phase") {
         auto& s = inst.startSession({});
         {
@@ -237,15 +253,607 @@ TEST_CASE("session") {
 
         CHECK(p.size() == p2.size());
 
+        // fillCtx decodes in batches, so the logits are not bit-exact with the ones from generation
         for (size_t i = 0; i < p.size(); i++) {
-            for (size_t j = 0; j < p[i].logits.size(); j++) {
-                auto& l = p[i].logits[j];
-                auto& l2 = p2[i].logits[j];
-                CHECK(l.token == l2.token);
-                CHECK(l.logit == l2.logit);
+            CHECK(p[i].token == p2[i].token);
+            CHECK(p[i].logits.size() == p2[i].logits.size());
+            for (auto& l : p[i].logits) {
+                auto l2 = std::find_if(p2[i].logits.begin(), p2[i].logits.end(), [&](auto& t) {
+                    return t.token == l.token;
+                });
+                REQUIRE(l2 != p2[i].logits.end());
+                CHECK(l2->logit == doctest::Approx(l.logit).epsilon(0.01));
             }
         }
     }
+
+    SUBCASE("filling ctx in chunks") {
+        // small batch, so that fillCtx needs multiple decode calls
+        bl::llama::Instance inst2(model, {
+            .batchSize = 4,
+            .ubatchSize = 4
+        });
+        inst2.warmup();
+
+        auto& s = inst.startSession({});
+        auto& s2 = inst2.startSession({});
+
+        auto tokens = model.vocab().tokenize("President George W.", true, true);
+        s.setInitialPrompt(tokens);
+        s2.setInitialPrompt(tokens);
+
+        auto p = s.complete({
+            .maxTokens = 10
+        });
+
+        auto p2 = s2.fillCtx(p);
+        CHECK(p2.size() == p.size());
+
+        // the session can continue after the filled tokens
+        auto next = s2.complete({
+            .maxTokens = 1
+        });
+        CHECK(next.size() == 1);
+
+        for (size_t i = 0; i < p.size(); i++) {
+            REQUIRE(p2[i].logits.size() == p[i].logits.size());
+            CHECK(p2[i].logits[0].token == p[i].logits[0].token);
+        }
+    }
+}
+
+TEST_CASE("batched sessions") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {
+        .maxSessions = 2
+    });
+    inst.warmup();
+    CHECK(inst.maxSessions() == 2);
+
+    auto& s1 = inst.startSession({});
+    auto& s2 = inst.startSession({});
+    CHECK(s1.seqId() != s2.seqId());
+    CHECK(inst.numActiveSessions() == 2);
+    CHECK_THROWS_WITH(inst.startSession({}), "All 2 sessions are already started. Stop one to start a new one.");
+
+    s1.queueInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+    s2.queueInitialPrompt(model.vocab().tokenize("The capital of France is", true, true));
+    CHECK(s1.hasPendingInput());
+    CHECK(s2.hasPendingInput());
+
+    bl::llama::Session* sessions[] = {&s1, &s2};
+    inst.decodeBatch(sessions);
+    CHECK_FALSE(s1.hasPendingInput());
+    CHECK_FALSE(s2.hasPendingInput());
+
+    auto g1 = s1.completeStream({.maxTokens = 5});
+    auto g2 = s2.completeStream({.maxTokens = 5});
+
+    auto p1 = g1.complete();
+    auto p2 = g2.complete();
+    CHECK(model.vocab().tokenToString(p1.token) == " Bush");
+    CHECK(model.vocab().tokenToString(p2.token) == " Paris");
+
+    // the generated tokens are decoded together in the next batch
+    CHECK(s1.hasPendingInput());
+    CHECK(s2.hasPendingInput());
+    inst.decodeBatch(sessions);
+    CHECK_FALSE(s1.hasPendingInput());
+    CHECK_FALSE(s2.hasPendingInput());
+
+    // a stopped session frees its slot
+    inst.stopSession(s2);
+    CHECK(inst.numActiveSessions() == 1);
+    auto& s3 = inst.startSession({});
+    CHECK(inst.numActiveSessions() == 2);
+
+    // compare with a non-batched session in a separate instance
+    bl::llama::Instance inst2(model, {});
+    auto& ref = inst2.startSession({});
+    ref.setInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+    auto refp = ref.complete({.maxTokens = 2});
+    REQUIRE(refp.size() == 2);
+    CHECK(refp[0].token == p1.token);
+
+    bl::llama::Session* sessions1[] = {&s1, &s3};
+    s3.queueInitialPrompt(model.vocab().tokenize("Hello", true, true));
+    inst.decodeBatch(sessions1);
+    auto p1b = g1.complete();
+    REQUIRE(!p1b.logits.empty());
+    CHECK(p1b.logits[0].token == refp[1].logits[0].token);
+}
+
+TEST_CASE("chunked prefill") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {
+        .maxSessions = 2
+    });
+    inst.warmup();
+
+    auto& s1 = inst.startSession({});
+    auto& s2 = inst.startSession({});
+
+    s1.queueInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+    const auto prompt2 = model.vocab().tokenize("The capital of France is a city which has a long history of", true, true);
+    s2.queueInitialPrompt(prompt2);
+
+    bl::llama::Session* sessions[] = {&s1, &s2};
+
+    // the first batch has s1's prompt and the start of s2's
+    auto info = inst.decodeBatch(sessions, 8);
+    CHECK(info.generatedTokens == 0);
+    CHECK(info.promptTokens == 8);
+    CHECK_FALSE(s1.hasPendingInput());
+    CHECK(s2.hasPendingInput());
+
+    // s1 generates while s2's prompt is decoded in chunks
+    auto g1 = s1.completeStream({.maxTokens = 20});
+    size_t decodedPrompt = info.promptTokens;
+    while (s2.hasPendingInput()) {
+        auto p = g1.complete();
+        REQUIRE(p.token != bl::llama::Token_Invalid);
+        info = inst.decodeBatch(sessions, 8);
+        CHECK(info.generatedTokens == 1);
+        CHECK(info.promptTokens <= 8);
+        decodedPrompt += info.promptTokens;
+    }
+    CHECK(decodedPrompt == model.vocab().tokenize("President George W.", true, true).size() + prompt2.size());
+
+    // same as decoded at once
+    bl::llama::Instance inst2(model, {});
+    auto& ref = inst2.startSession({});
+    ref.setInitialPrompt(prompt2);
+    auto refp = ref.complete({.maxTokens = 1});
+    auto p2 = s2.complete({.maxTokens = 1});
+    REQUIRE(p2.size() == 1);
+    CHECK(p2[0].token == refp[0].token);
+}
+
+TEST_CASE("interleaved sessions") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {
+        .maxSessions = 2
+    });
+    inst.warmup();
+
+    auto& s1 = inst.startSession({});
+    auto& s2 = inst.startSession({});
+
+    // each call decodes only its own session, overwriting the logits of the other
+    s1.setInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+    s2.setInitialPrompt(model.vocab().tokenize("The capital of France is", true, true));
+
+    auto p1 = s1.complete({.maxTokens = 1});
+    REQUIRE(p1.size() == 1);
+    CHECK(model.vocab().tokenToString(p1[0].token) == " Bush");
+
+    auto p2 = s2.complete({.maxTokens = 1});
+    REQUIRE(p2.size() == 1);
+    CHECK(model.vocab().tokenToString(p2[0].token) == " Paris");
+
+    // reference from a single-session instance
+    bl::llama::Instance inst2(model, {});
+    auto& ref = inst2.startSession({});
+    ref.setInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+    auto refp = ref.complete({.maxTokens = 3});
+    REQUIRE(refp.size() == 3);
+
+    auto s2Prompt = model.vocab().tokenize(" It is", false, false);
+    s2.complete({.prompt = s2Prompt, .maxTokens = 1});
+    auto p1b = s1.complete({.maxTokens = 2});
+    REQUIRE(p1b.size() == 2);
+    CHECK(p1b[0].token == refp[1].token);
+    CHECK(p1b[1].token == refp[2].token);
+    REQUIRE(!p1b[0].logits.empty());
+    CHECK(p1b[0].logits[0].token == refp[1].logits[0].token);
+}
+
+TEST_CASE("rewind") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {});
+    inst.warmup();
+
+    auto prompt = model.vocab().tokenize("The capital of France is", true, true);
+    auto next = model.vocab().tokenize(" Paris. The capital of Germany is", false, false);
+    auto other = model.vocab().tokenize(" a city in Europe", false, false);
+
+    auto toTokens = [](const std::vector<bl::llama::TokenPrediction>& predictions) {
+        std::vector<bl::llama::Token> tokens;
+        for (auto& p : predictions) {
+            tokens.push_back(p.token);
+        }
+        return tokens;
+    };
+
+    std::vector<bl::llama::Token> reference;
+    {
+        auto& s = inst.startSession({.temperature = 0});
+        s.setInitialPrompt(prompt);
+        CHECK(std::ranges::equal(s.tokens(), prompt));
+        reference = toTokens(s.complete({.prompt = next, .maxTokens = 5}));
+        REQUIRE(reference.size() == 5);
+        inst.stopSession();
+    }
+
+    {
+        // go another way and come back
+        auto& s = inst.startSession({.temperature = 0});
+        s.setInitialPrompt(prompt);
+        s.complete({.prompt = other, .maxTokens = 5});
+        CHECK(s.tokens().size() > prompt.size() + other.size());
+
+        s.rewind(uint32_t(prompt.size()));
+        CHECK(std::ranges::equal(s.tokens(), prompt));
+
+        const auto error = "Can't rewind to 10000 tokens, the context has " + std::to_string(prompt.size());
+        CHECK_THROWS_WITH(s.rewind(10000), error.c_str());
+
+        CHECK(toTokens(s.complete({.prompt = next, .maxTokens = 5})) == reference);
+        inst.stopSession();
+    }
+
+    {
+        // a queued prompt is the same as a pushed one
+        auto& s = inst.startSession({.temperature = 0});
+        s.setInitialPrompt(prompt);
+        s.queuePrompt(next);
+        CHECK(s.hasPendingInput());
+        CHECK(toTokens(s.complete({.maxTokens = 5})) == reference);
+        inst.stopSession();
+    }
+}
+
+TEST_CASE("cancel") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {});
+    inst.warmup();
+
+    auto prompt = model.vocab().tokenize("The capital of France is", true, true);
+
+    auto& s = inst.startSession({.temperature = 0});
+    s.setInitialPrompt(prompt);
+
+    std::atomic_bool cancel = false;
+    auto gen = s.completeStream({.maxTokens = 10, .cancel = &cancel});
+    CHECK(gen.complete().token != bl::llama::Token_Invalid);
+    CHECK(gen.complete().token != bl::llama::Token_Invalid);
+
+    // the stream stops at the next token and the session can go on
+    cancel = true;
+    CHECK(gen.complete().token == bl::llama::Token_Invalid);
+    CHECK(gen.status() == bl::llama::Session::StreamGenerator::Status::Aborted);
+    CHECK(s.complete({.maxTokens = 3, .cancel = &cancel}).empty());
+
+    cancel = false;
+    CHECK(s.complete({.maxTokens = 3, .cancel = &cancel}).size() == 3);
+
+    // so can it after an explicit abort
+    auto gen2 = s.completeStream({.maxTokens = 10});
+    CHECK(gen2.complete().token != bl::llama::Token_Invalid);
+    gen2.abort();
+    CHECK(gen2.complete().token == bl::llama::Token_Invalid);
+    CHECK(s.complete({.maxTokens = 1}).size() == 1);
+
+    // a passed deadline stops the generation the same way
+    const auto past = std::chrono::steady_clock::now();
+    CHECK(s.complete({.maxTokens = 3, .deadline = past}).empty());
+    auto gen3 = s.completeStream({.maxTokens = 10, .deadline = past});
+    CHECK(gen3.complete().token == bl::llama::Token_Invalid);
+    CHECK(gen3.status() == bl::llama::Session::StreamGenerator::Status::TimedOut);
+    CHECK(s.complete({.maxTokens = 1}).size() == 1);
+}
+
+TEST_CASE("fork") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {
+        .maxSessions = 3
+    });
+
+    auto& s = inst.startSession({});
+    CHECK_THROWS_WITH(s.fork(), "Session hasn't started yet");
+
+    s.setInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+
+    auto& f = s.fork();
+    CHECK(f.seqId() != s.seqId());
+    CHECK(inst.numActiveSessions() == 2);
+
+    // same context and same sampler state, so the same completion
+    auto sp = s.complete({.maxTokens = 5});
+    auto fp = f.complete({.maxTokens = 5});
+    REQUIRE(sp.size() == fp.size());
+    REQUIRE(!sp.empty());
+    CHECK(model.vocab().tokenToString(sp[0].token) == " Bush");
+    for (size_t i = 0; i < sp.size(); ++i) {
+        CHECK(sp[i].token == fp[i].token);
+        REQUIRE(sp[i].logits.size() == fp[i].logits.size());
+        CHECK(sp[i].logits[0].token == fp[i].logits[0].token);
+        CHECK(sp[i].logits[0].logit == doctest::Approx(fp[i].logits[0].logit).epsilon(0.01));
+    }
+
+    // the sessions diverge with different prompts
+    auto& f2 = f.fork();
+    CHECK(inst.numActiveSessions() == 3);
+    CHECK_THROWS_WITH(s.fork(), "All 3 sessions are already started. Stop one to start a new one.");
+
+    auto fq = f.complete({.prompt = model.vocab().tokenize(" The capital of France is", false, false), .maxTokens = 3});
+    CHECK(fq.size() == 3);
+
+    // a fork of a fork is unaffected by its origin
+    auto f2p = f2.complete({.maxTokens = 1});
+    auto sp2 = s.complete({.maxTokens = 1});
+    REQUIRE(f2p.size() == 1);
+    REQUIRE(sp2.size() == 1);
+    CHECK(f2p[0].token == sp2[0].token);
+
+    const auto fSeqId = f.seqId();
+    inst.stopSession(f);
+    CHECK(inst.numActiveSessions() == 2);
+    auto& f3 = s.fork();
+    CHECK(f3.seqId() == fSeqId);
+}
+
+TEST_CASE("beam search") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {
+        .maxSessions = 4
+    });
+    auto prompt = model.vocab().tokenize("President George W.", true, true);
+
+    // width 1 is greedy
+    std::vector<bl::llama::TokenPrediction> greedy;
+    {
+        auto& s = inst.startSession({.temperature = 0});
+        s.setInitialPrompt(prompt);
+        greedy = s.complete({.maxTokens = 8});
+        inst.stopSession(s);
+    }
+
+    {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt);
+        auto p = s.completeBeam({.maxTokens = 8, .beamWidth = 1});
+        REQUIRE(p.size() == greedy.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            CHECK(p[i].token == greedy[i].token);
+            REQUIRE(p[i].logits.size() == greedy[i].logits.size());
+            CHECK(p[i].logits[0].token == greedy[i].logits[0].token);
+        }
+        inst.stopSession(s);
+    }
+
+    std::vector<bl::llama::TokenPrediction> beam;
+    {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt);
+        beam = s.completeBeam({.maxTokens = 8, .beamWidth = 4});
+        REQUIRE(!beam.empty());
+        CHECK(beam.size() <= 8);
+        CHECK(model.vocab().tokenToString(beam[0].token) == " Bush");
+        for (auto& p : beam) {
+            CHECK(p.logits.size() == 10);
+        }
+
+        // the sequences of the other beams are released
+        CHECK(inst.numActiveSessions() == 1);
+
+        // the session continues after the result
+        auto cont = s.complete({.maxTokens = 2});
+        CHECK(cont.size() <= 2);
+        inst.stopSession(s);
+    }
+
+    // deterministic
+    {
+        auto& s = inst.startSession({.seed = 42});
+        s.setInitialPrompt(prompt);
+        auto p = s.completeBeam({.maxTokens = 8, .beamWidth = 4});
+        REQUIRE(p.size() == beam.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            CHECK(p[i].token == beam[i].token);
+        }
+        inst.stopSession(s);
+    }
+
+    // not enough free sequences
+    {
+        auto& s1 = inst.startSession({});
+        auto& s2 = inst.startSession({});
+        s1.setInitialPrompt(prompt);
+        CHECK_THROWS_WITH(s1.completeBeam({.maxTokens = 8, .beamWidth = 4}), "Beam search with width 4 needs 3 free sessions in the instance");
+        CHECK_THROWS_WITH(s1.completeBeam({.maxTokens = 8, .beamWidth = 1, .topLogits = 101}), "Too many top logits: 101, max: 100");
+        inst.stopSession(s2);
+        inst.stopSession(s1);
+    }
+}
+
+TEST_CASE("speculative decoding") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    auto prompt = model.vocab().tokenize("The first law of robotics is", true, true);
+
+    bl::llama::Instance refInst(model, {});
+    auto& ref = refInst.startSession({});
+    ref.setInitialPrompt(prompt);
+    auto refp = ref.complete({.maxTokens = 20});
+    CHECK(ref.speculativeStats().steps == 0);
+
+    // the same model as a draft, so (nearly) every confident draft is accepted
+    auto drafter = std::make_shared<bl::llama::ModelDrafter>(model, bl::llama::ModelDrafter::Params{
+        .minProbability = 0
+    });
+
+    bl::llama::Instance inst(model, {});
+    auto& s = inst.startSession({.drafter = drafter, .maxDraftTokens = 4});
+
+    SUBCASE("complete") {
+        s.setInitialPrompt(prompt);
+        auto p = s.complete({.maxTokens = 20});
+        REQUIRE(p.size() == refp.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            CHECK(p[i].token == refp[i].token);
+            REQUIRE(p[i].logits.size() == refp[i].logits.size());
+            CHECK(p[i].logits[0].token == refp[i].logits[0].token);
+            CHECK(p[i].logits[0].logit == doctest::Approx(refp[i].logits[0].logit).epsilon(0.01));
+        }
+
+        auto& stats = s.speculativeStats();
+        CHECK(stats.steps > 0);
+        CHECK(stats.steps < p.size());
+        CHECK(stats.drafted > 0);
+        CHECK(stats.accepted > 0);
+        CHECK(stats.accepted <= stats.drafted);
+    }
+
+    SUBCASE("stream") {
+        s.setInitialPrompt(prompt);
+        auto gen = s.completeStream({.maxTokens = 20});
+        std::vector<bl::llama::TokenPrediction> p;
+        while (auto t = gen.complete()) {
+            p.push_back(t);
+        }
+        CHECK(gen.status() == bl::llama::Session::StreamGenerator::Status::Completed);
+        REQUIRE(p.size() == refp.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            CHECK(p[i].token == refp[i].token);
+        }
+
+        // the session continues after the verified tokens
+        auto next = s.complete({.maxTokens = 1});
+        auto refNext = ref.complete({.maxTokens = 1});
+        REQUIRE(next.size() == refNext.size());
+        if (!next.empty()) {
+            CHECK(next[0].token == refNext[0].token);
+        }
+    }
+
+    SUBCASE("abort") {
+        s.setInitialPrompt(prompt);
+        auto gen = s.completeStream({.maxTokens = 20});
+        std::vector<bl::llama::Token> delivered;
+        for (int i = 0; i < 2; ++i) {
+            auto t = gen.complete();
+            REQUIRE(t.token != bl::llama::Token_Invalid);
+            delivered.push_back(t.token);
+        }
+        // the second token was verified together with the ones after it, which are never delivered
+        REQUIRE(s.speculativeStats().accepted > 0);
+        gen.abort();
+
+        // the context has only the delivered tokens
+        auto newPrompt = model.vocab().tokenize(" The second law", false, false);
+        auto p = s.complete({.prompt = newPrompt, .maxTokens = 10});
+
+        bl::llama::Instance abortRefInst(model, {});
+        auto& abortRef = abortRefInst.startSession({});
+        abortRef.setInitialPrompt(prompt);
+        auto refDelivered = abortRef.complete({.maxTokens = 2});
+        REQUIRE(refDelivered.size() == 2);
+        CHECK(refDelivered[0].token == delivered[0]);
+        CHECK(refDelivered[1].token == delivered[1]);
+        auto refAfter = abortRef.complete({.prompt = newPrompt, .maxTokens = 10});
+
+        REQUIRE(p.size() == refAfter.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            CHECK(p[i].token == refAfter[i].token);
+        }
+    }
+}
+
+TEST_CASE("prompt lookup decoding") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    auto prompt = model.vocab().tokenize(
+        "The quick brown fox jumps over the lazy dog. "
+        "The quick brown fox jumps over the lazy dog. "
+        "The quick brown fox", true, true);
+
+    bl::llama::Instance refInst(model, {});
+    auto& ref = refInst.startSession({});
+    ref.setInitialPrompt(prompt);
+    auto refp = ref.complete({.maxTokens = 16});
+
+    bl::llama::Instance inst(model, {});
+    auto& s = inst.startSession({
+        .drafter = std::make_shared<bl::llama::NgramDrafter>(bl::llama::NgramDrafter::Params{}),
+    });
+    s.setInitialPrompt(prompt);
+    auto p = s.complete({.maxTokens = 16});
+
+    REQUIRE(p.size() == refp.size());
+    for (size_t i = 0; i < p.size(); ++i) {
+        CHECK(p[i].token == refp[i].token);
+        REQUIRE(p[i].logits.size() == refp[i].logits.size());
+        CHECK(p[i].logits[0].token == refp[i].logits[0].token);
+    }
+
+    auto& stats = s.speculativeStats();
+    CHECK(stats.drafted > 0);
+    CHECK(stats.accepted <= stats.drafted);
+}
+
+TEST_CASE("prefix cache") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {});
+    inst.warmup();
+
+    auto cache = std::make_shared<bl::llama::PrefixCache>(bl::llama::PrefixCache::Params{
+        .minTokens = 8
+    });
+    inst.setPrefixCache(cache);
+
+    const std::string system = "The following is a conversation between a curious user and a helpful assistant, "
+        "who answers questions about history and geography concisely and correctly.";
+    auto prompt1 = model.vocab().tokenize(system + " Q: Who was the 43rd president of the USA? A: President George W.", true, true);
+    auto prompt2 = model.vocab().tokenize(system + " Q: What is the capital of France? A: The capital of France is", true, true);
+
+    std::vector<bl::llama::TokenPrediction> ref;
+    {
+        bl::llama::Instance refInst(model, {});
+        auto& s = refInst.startSession({});
+        s.setInitialPrompt(prompt2);
+        ref = s.complete({.maxTokens = 1});
+        REQUIRE(ref.size() == 1);
+    }
+
+    {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt1);
+        auto p = s.complete({.maxTokens = 1});
+        CHECK(model.vocab().tokenToString(p[0].token) == " Bush");
+        inst.stopSession();
+    }
+
+    auto stats = cache->stats();
+    CHECK(stats.misses == 1);
+    CHECK(stats.hits == 0);
+    CHECK(stats.entries == 1);
+    CHECK(stats.bytes > 0);
+
+    {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt2);
+        auto p = s.complete({.maxTokens = 1});
+        REQUIRE(p.size() == 1);
+        CHECK(p[0].logits[0].token == ref[0].logits[0].token);
+        inst.stopSession();
+    }
+
+    stats = cache->stats();
+    CHECK(stats.hits == 1);
+    CHECK(stats.hitTokens >= 20);
+    CHECK(stats.entries == 2);
+
+    {
+        // exact hit, nothing new to cache
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt1);
+        auto p = s.complete({.maxTokens = 1});
+        CHECK(model.vocab().tokenToString(p[0].token) == " Bush");
+        inst.stopSession();
+    }
+
+    stats = cache->stats();
+    CHECK(stats.hits == 2);
+    CHECK(stats.entries == 2);
 }
 
 // commented out because it relies on specific calc
@@ -418,6 +1026,167 @@ TEST_CASE("states") {
             inst.stopSession();
         }
     }
+
+    // the state only has the sequence of its session
+    // it can be restored into a session with another sequence without affecting the other sessions
+    {
+        bl::llama::Instance inst2(model, {.maxSessions = 2});
+        auto& other = inst2.startSession({.temperature = 0});
+        other.setInitialPrompt(model.vocab().tokenize("President George W.", true, true));
+
+        auto& s = inst2.startSession({});
+        REQUIRE(s.seqId() != 0);
+        s.setState(initialState);
+
+        std::string restoredStr;
+        auto predict = s.complete({
+            .maxTokens = nPredict / 2
+        });
+        for (size_t i = 0; i < predict.size(); i++) {
+            restoredStr += model.vocab().tokenToString(predict[i].token);
+        }
+        CHECK(restoredStr == generatedStr);
+
+        auto p = other.complete({.maxTokens = 1});
+        REQUIRE(p.size() == 1);
+        CHECK(model.vocab().tokenToString(p[0].token) == " Bush");
+    }
+}
+
+TEST_CASE("snapshots") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {});
+
+    const int32_t nPredict = 15;
+    auto tokens = model.vocab().tokenize("France has a long history of", true, true);
+
+    auto toString = [&](const std::vector<bl::llama::TokenPrediction>& predictions) {
+        std::string str;
+        for (auto& p : predictions) {
+            str += model.vocab().tokenToString(p.token);
+        }
+        return str;
+    };
+
+    const auto path = (std::filesystem::temp_directory_path() / "bl-llama-test-snapshot.bin").string();
+
+    std::vector<uint8_t> snapshot;
+    std::string generatedStr;
+    {
+        auto& s = inst.startSession({.seed = 42});
+        s.setInitialPrompt(tokens);
+        s.complete({.maxTokens = nPredict});
+
+        snapshot.resize(s.snapshotSize());
+        CHECK(s.writeSnapshot(snapshot) == snapshot.size());
+        s.saveSnapshot(path);
+
+        // the sampler has advanced, but the snapshot has its state
+        generatedStr = toString(s.complete({.maxTokens = nPredict}));
+        inst.stopSession();
+    }
+
+    {
+        auto& s = inst.startSession({});
+        s.restoreSnapshot(snapshot);
+        CHECK(toString(s.complete({.maxTokens = nPredict})) == generatedStr);
+
+        // only sessions which haven't started can be restored
+        CHECK_THROWS_WITH(s.restoreSnapshot(snapshot), "Session already started");
+        inst.stopSession();
+    }
+
+    {
+        // the logits of the restored session come with a batch
+        auto& s = inst.startSession({});
+        s.restoreSnapshot(snapshot);
+        s.queueLastToken();
+        CHECK(s.hasPendingInput());
+        bl::llama::Session* batch[] = {&s};
+        CHECK(inst.decodeBatch(batch).promptTokens == 1);
+        CHECK_FALSE(s.hasPendingInput());
+        CHECK(toString(s.complete({.maxTokens = nPredict})) == generatedStr);
+        inst.stopSession();
+    }
+
+    {
+        auto& s = inst.startSession({});
+        s.loadSnapshot(path);
+        CHECK(toString(s.complete({.maxTokens = nPredict})) == generatedStr);
+        inst.stopSession();
+    }
+    std::filesystem::remove(path);
+
+    {
+        // snapshot in the middle of a stream, the restored session continues where the stream was
+        auto& s = inst.startSession({.seed = 42});
+        s.setInitialPrompt(tokens);
+        s.complete({.maxTokens = nPredict});
+
+        std::vector<bl::llama::TokenPrediction> predictions;
+        auto gen = s.completeStream({.maxTokens = 5});
+        for (int i = 0; i < 5; ++i) {
+            predictions.push_back(gen.complete());
+        }
+
+        std::vector<uint8_t> streamSnapshot(s.snapshotSize());
+        s.writeSnapshot(streamSnapshot);
+        inst.stopSession();
+
+        auto& r = inst.startSession({});
+        r.restoreSnapshot(streamSnapshot);
+        auto rest = r.complete({.maxTokens = nPredict - 5});
+        predictions.insert(predictions.end(), rest.begin(), rest.end());
+        CHECK(toString(predictions) == generatedStr);
+        inst.stopSession();
+    }
+
+    {
+        auto& s = inst.startSession({});
+
+        auto truncated = std::span(snapshot).first(snapshot.size() / 2);
+        CHECK_THROWS_WITH(s.restoreSnapshot(truncated), "Truncated snapshot");
+
+        auto corrupt = snapshot;
+        corrupt[0] ^= 0xff;
+        CHECK_THROWS_WITH(s.restoreSnapshot(corrupt), "Not a session snapshot");
+
+        // the failed attempts leave the session usable
+        s.setInitialPrompt(tokens);
+        CHECK(s.complete({.maxTokens = 1}).size() == 1);
+        inst.stopSession();
+    }
+
+    {
+        // the state of mirostat samplers can't be restored, so they are rejected before anything is written
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(tokens);
+        s.resetSampler({.mirostat = {.ver = 2}});
+        CHECK_THROWS_WITH(s.snapshotSize(), "Sessions with mirostat sampling can't be snapshotted");
+        CHECK_THROWS_WITH(s.writeSnapshot(snapshot), "Sessions with mirostat sampling can't be snapshotted");
+
+        // the session is still usable
+        CHECK(s.complete({.maxTokens = 1}).size() == 1);
+        inst.stopSession();
+    }
+
+    {
+        // and neither can the state of XTC samplers
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(tokens);
+        bl::llama::Sampler::Params params;
+        params.samplerSequence.push_back(bl::llama::Sampler::SamplingType::XTC);
+        params.xtc.probability = 0.5f;
+        s.resetSampler(params);
+        CHECK_THROWS_WITH(s.snapshotSize(), "Sessions with XTC sampling can't be snapshotted");
+        CHECK_THROWS_WITH(s.writeSnapshot(snapshot), "Sessions with XTC sampling can't be snapshotted");
+
+        // XTC in the sequence with a zero probability is disabled
+        params.xtc.probability = 0;
+        s.resetSampler(params);
+        CHECK(s.snapshotSize() > 0);
+        inst.stopSession();
+    }
 }
 
 // commented out because it relies on specific calc
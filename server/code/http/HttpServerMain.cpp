@@ -23,8 +23,10 @@
 
 #include <nlohmann/json.hpp>
 
+#include <atomic>
 #include <iostream>
 #include <concepts>
+#include <deque>
 
 #include "ac-test-data-llama-dir.h"
 
@@ -34,18 +36,23 @@ namespace beast = boost::beast;
 namespace http = beast::http;
 namespace fs = std::filesystem;
 
+nlohmann::json toJson(bl::llama::server::Server::TokenData& g) {
+    nlohmann::json jt;
+    jt["str"] = std::move(g.tokenStr);
+    jt["id"] = g.tokenId;
+    auto& jlg = jt["logits"] = nlohmann::json::array();
+    for (auto& l : g.logits) {
+        auto& jl = jlg.emplace_back();
+        jl["id"] = l.tokenId;
+        jl["logit"] = l.logit;
+    }
+    return jt;
+}
+
 nlohmann::json toJson(bl::llama::server::Server::CompleteReponse& gen) {
     auto jsonTokens = nlohmann::json::array();
     for (auto& g : gen) {
-        auto& jt = jsonTokens.emplace_back();
-        jt["str"] = std::move(g.tokenStr);
-        jt["id"] = g.tokenId;
-        auto& jlg = jt["logits"] = nlohmann::json::array();
-        for (auto& l : g.logits) {
-            auto& jl = jlg.emplace_back();
-            jl["id"] = l.tokenId;
-            jl["logit"] = l.logit;
-        }
+        jsonTokens.push_back(toJson(g));
     }
     return jsonTokens;
 }
@@ -90,6 +97,10 @@ bl::llama::server::Server::CompleteRequestParams toCompleteParams(nlohmann::json
     opt_get(json, "suffix", params.suffix);
     opt_get(json, "temp", params.temperature);
     opt_get(json, "top_p", params.topP);
+    opt_get(json, "top_logits", params.topLogits);
+    opt_get(json, "n", params.n);
+    opt_get(json, "timeout_ms", params.deadlineMs); // alias
+    opt_get(json, "deadline_ms", params.deadlineMs);
     return params;
 }
 
@@ -113,6 +124,11 @@ bl::llama::server::Server::ChatCompleteRequestParams toChatCompleteParams(nlohma
     opt_get(json, "seed", params.seed);
     opt_get(json, "temp", params.temperature);
     opt_get(json, "top_p", params.topP);
+    opt_get(json, "top_logits", params.topLogits);
+    opt_get(json, "n", params.n);
+    opt_get(json, "timeout_ms", params.deadlineMs); // alias
+    opt_get(json, "deadline_ms", params.deadlineMs);
+    opt_get(json, "conversation_id", params.conversationId);
     return params;
 }
 
@@ -127,8 +143,27 @@ bl::llama::server::Server::ChatCompleteRequestParams toChatCompleteParams(std::s
 }
 
 class Server {
+public:
+    struct ConnectionParams {
+        // close a persistent connection if no new request arrives within this time
+        std::chrono::seconds idleTimeout = std::chrono::seconds(30);
+
+        // close the connection if writing a response (or a chunk of a stream) takes longer than this,
+        // for example because the client stopped reading
+        std::chrono::seconds writeTimeout = std::chrono::seconds(30);
+
+        // close a persistent connection after serving this many requests (0 means no limit)
+        uint32_t maxRequests = 100;
+
+        // requests on connections beyond this many get a 503 response and the connection is closed (0 means no limit)
+        uint32_t maxConnections = 0;
+    };
+
+private:
     std::shared_ptr<bl::llama::Model> m_model;
     bl::llama::server::Server m_server;
+    ConnectionParams m_connectionParams;
+    std::atomic_uint32_t m_numConnections = 0; // connections being handled
 
     static bool modelLoadProgressCallback(float progress) {
         static bool initialized = false;
@@ -180,15 +215,15 @@ class Server {
         void operator()(Self& self) {
             auto takeParams = bstl::move(params);
             if constexpr (std::is_same_v<T, bl::llama::server::Server::CompleteRequestParams>) {
-                server.completeText(bstl::move(takeParams), [ex = bstl::move(ex), self = bstl::move(self)](bl::llama::server::Server::CompleteReponse gen) mutable {
-                    post(ex, [self = bstl::move(self), gen = bstl::move(gen)]() mutable {
-                        self.complete(bstl::move(gen));
+                server.completeTextChoices(bstl::move(takeParams), [ex = bstl::move(ex), self = bstl::move(self)](std::exception_ptr error, std::vector<bl::llama::server::Server::CompleteReponse> choices) mutable {
+                    post(ex, [self = bstl::move(self), error = bstl::move(error), choices = bstl::move(choices)]() mutable {
+                        self.complete(bstl::move(error), bstl::move(choices));
                     });
                 });
             } else if constexpr (std::is_same_v<T, bl::llama::server::Server::ChatCompleteRequestParams>) {
-                server.chatComplete(bstl::move(takeParams), [ex = bstl::move(ex), self = bstl::move(self)](bl::llama::server::Server::CompleteReponse gen) mutable {
-                    post(ex, [self = bstl::move(self), gen = bstl::move(gen)]() mutable {
-                        self.complete(bstl::move(gen));
+                server.chatCompleteChoices(bstl::move(takeParams), [ex = bstl::move(ex), self = bstl::move(self)](std::exception_ptr error, std::vector<bl::llama::server::Server::CompleteReponse> choices) mutable {
+                    post(ex, [self = bstl::move(self), error = bstl::move(error), choices = bstl::move(choices)]() mutable {
+                        self.complete(bstl::move(error), bstl::move(choices));
                     });
                 });
             } else {
@@ -198,13 +233,13 @@ class Server {
     };
 
     decltype(auto) asyncComplete(net::any_io_executor ex, bl::llama::server::Server::CompleteRequestParams params) {
-        return net::async_compose<const net::use_awaitable_t<>, void(bl::llama::server::Server::CompleteReponse)>(
+        return net::async_compose<const net::use_awaitable_t<>, void(std::exception_ptr, std::vector<bl::llama::server::Server::CompleteReponse>)>(
             AsyncCompleteOp<bl::llama::server::Server::CompleteRequestParams>{.ex = ex, .server = m_server, .params = std::move(params)}, net::use_awaitable, ex
         );
     }
 
     decltype(auto) asyncChatComplete(net::any_io_executor ex, bl::llama::server::Server::ChatCompleteRequestParams params) {
-        return net::async_compose<const net::use_awaitable_t<>, void(bl::llama::server::Server::CompleteReponse)>(
+        return net::async_compose<const net::use_awaitable_t<>, void(std::exception_ptr, std::vector<bl::llama::server::Server::CompleteReponse>)>(
             AsyncCompleteOp<bl::llama::server::Server::ChatCompleteRequestParams>{.ex = ex, .server = m_server, .params = std::move(params)}, net::use_awaitable, ex
         );
     }
@@ -222,15 +257,15 @@ class Server {
             auto takeResponse = bstl::move(response);
 
             if constexpr (std::is_same_v<T, bl::llama::server::Server::CompleteRequestParams>) {
-                server.verify(bstl::move(takeParams), bstl::move(takeResponse), [ex = bstl::move(ex), self = bstl::move(self)](float result) mutable {
-                    post(ex, [self = bstl::move(self), result]() mutable {
-                        self.complete(result);
+                server.verify(bstl::move(takeParams), bstl::move(takeResponse), [ex = bstl::move(ex), self = bstl::move(self)](std::exception_ptr error, float result) mutable {
+                    post(ex, [self = bstl::move(self), error = bstl::move(error), result]() mutable {
+                        self.complete(bstl::move(error), result);
                     });
                 });
             } else if constexpr (std::is_same_v<T, bl::llama::server::Server::ChatCompleteRequestParams>) {
-                server.chatVerify(bstl::move(takeParams), bstl::move(takeResponse), [ex = bstl::move(ex), self = bstl::move(self)](float result) mutable {
-                    post(ex, [self = bstl::move(self), result]() mutable {
-                        self.complete(result);
+                server.chatVerify(bstl::move(takeParams), bstl::move(takeResponse), [ex = bstl::move(ex), self = bstl::move(self)](std::exception_ptr error, float result) mutable {
+                    post(ex, [self = bstl::move(self), error = bstl::move(error), result]() mutable {
+                        self.complete(bstl::move(error), result);
                     });
                 });
             } else {
@@ -240,19 +275,187 @@ class Server {
     };
 
     decltype(auto) asyncVerify(net::any_io_executor ex, bl::llama::server::Server::CompleteRequestParams params, bl::llama::server::Server::CompleteReponse response) {
-        return net::async_compose<const net::use_awaitable_t<>, void(float)>(
+        return net::async_compose<const net::use_awaitable_t<>, void(std::exception_ptr, float)>(
             AsyncVerifyOp<bl::llama::server::Server::CompleteRequestParams>{.ex = ex, .server = m_server, .params = std::move(params), .response = std::move(response)}, net::use_awaitable, ex
         );
     }
 
     decltype(auto) asyncChatVerify(net::any_io_executor ex, bl::llama::server::Server::ChatCompleteRequestParams params, bl::llama::server::Server::CompleteReponse response) {
-        return net::async_compose<const net::use_awaitable_t<>, void(float)>(
+        return net::async_compose<const net::use_awaitable_t<>, void(std::exception_ptr, float)>(
             AsyncVerifyOp<bl::llama::server::Server::ChatCompleteRequestParams>{.ex = ex, .server = m_server, .params = std::move(params), .response = std::move(response)}, net::use_awaitable, ex
         );
     }
 
+    // a request which is being served, watched for its client closing the connection
+    struct ClientWatch {
+        bl::llama::server::Server::CancelFlag cancel = std::make_shared<std::atomic_bool>(false);
+        bool done = false; // the request is served (only accessed on the connection strand)
+    };
+
+    // cancel the request if the client closes the connection before it's served
+    // a client doesn't send anything else while it waits for the response (unless it pipelines requests),
+    // so the socket becoming readable with no data means it's gone
+    net::awaitable<void> watchClient(tcp::socket& socket, std::shared_ptr<ClientWatch> watch) {
+        boost::system::error_code ec;
+        co_await socket.async_wait(tcp::socket::wait_read, net::redirect_error(net::use_awaitable, ec));
+        if (watch->done || ec == net::error::operation_aborted) {
+            // the socket may be gone by now
+            co_return;
+        }
+
+        if (!ec) {
+            char c;
+            if (socket.receive(net::buffer(&c, 1), tcp::socket::message_peek, ec) > 0 && !ec) {
+                // a pipelined request, which will be read once this one is served
+                co_return;
+            }
+        }
+
+        m_server.cancel(watch->cancel);
+    }
+
+    // tokens produced by an inference thread and consumed by the request coroutine
+    // all access happens on the connection strand
+    struct TokenStream {
+        explicit TokenStream(net::any_io_executor ex)
+            : signal(ex, net::steady_timer::time_point::max())
+        {}
+
+        std::deque<bl::llama::server::Server::TokenData> tokens;
+        bool done = false;
+        bl::llama::server::Server::FinishReason finishReason = bl::llama::server::Server::FinishReason::Stop;
+        std::exception_ptr error; // if the request failed
+
+        // used as a condition variable: waits are woken up by cancel
+        net::steady_timer signal;
+    };
+
+    // stream tokens to the client as Server-Sent Events in a chunked response
+    // each token is a "data: {json}" event and the stream ends with a {"finish_reason": ...} event and "data: [DONE]"
+    // the response has started by the time the request fails, so its error is the event before "data: [DONE]" instead
     template <typename T>
-    decltype(auto) getCompleteResponse(T& gen, const http::request<http::string_body>& req) {
+    net::awaitable<void> streamComplete(beast::tcp_stream& stream, const http::request<http::string_body>& req, T params) {
+        auto ex = co_await net::this_coro::executor;
+        auto ts = std::make_shared<TokenStream>(ex);
+        auto cancel = params.cancel;
+
+        bl::llama::server::Server::StreamCallbacks cbs = {
+            .onToken = [ex, ts](bl::llama::server::Server::TokenData token) {
+                post(ex, [ts, token = std::move(token)]() mutable {
+                    ts->tokens.push_back(std::move(token));
+                    ts->signal.cancel();
+                });
+            },
+            .onDone = [ex, ts](std::exception_ptr error, bl::llama::server::Server::FinishReason reason) {
+                post(ex, [ts, error = std::move(error), reason] {
+                    ts->done = true;
+                    ts->finishReason = reason;
+                    ts->error = error;
+                    ts->signal.cancel();
+                });
+            }
+        };
+
+        if constexpr (std::is_same_v<T, bl::llama::server::Server::CompleteRequestParams>) {
+            m_server.completeTextStream(std::move(params), std::move(cbs));
+        } else if constexpr (std::is_same_v<T, bl::llama::server::Server::ChatCompleteRequestParams>) {
+            m_server.chatCompleteStream(std::move(params), std::move(cbs));
+        } else {
+            static_assert(false, "Unsupported parameter type for streamComplete");
+        }
+
+        http::response<http::empty_body> res(http::status::ok, req.version());
+        res.set(http::field::server, "Beast");
+        res.set(http::field::content_type, "text/event-stream");
+        res.set(http::field::cache_control, "no-cache");
+        res.set(http::field::access_control_allow_origin, "*");
+        res.keep_alive(req.keep_alive());
+        res.chunked(true);
+
+        try {
+            co_await writeStream(stream, res, *ts);
+        }
+        catch (...) {
+            // the client is gone, so stop generating for it
+            m_server.cancel(cancel);
+            throw;
+        }
+    }
+
+    // the tokens as Server-Sent Events until the stream is done
+    net::awaitable<void> writeStream(beast::tcp_stream& stream, http::response<http::empty_body>& res, TokenStream& ts) {
+        http::response_serializer<http::empty_body> sr(res);
+        stream.expires_after(m_connectionParams.writeTimeout);
+        co_await http::async_write_header(stream, sr, net::use_awaitable);
+
+        std::string events;
+        while (true) {
+            // the next token may take arbitrarily long
+            stream.expires_never();
+            while (ts.tokens.empty() && !ts.done) {
+                ts.signal.expires_at(net::steady_timer::time_point::max());
+                boost::system::error_code ec;
+                co_await ts.signal.async_wait(net::redirect_error(net::use_awaitable, ec));
+            }
+
+            // send everything which has accumulated in a single chunk
+            events.clear();
+            for (auto& token : ts.tokens) {
+                events += "data: ";
+                events += toJson(token).dump();
+                events += "\n\n";
+            }
+            ts.tokens.clear();
+
+            if (ts.done) {
+                events += "data: ";
+                events += ts.error
+                    ? nlohmann::json{{"error", errorMessage(ts.error)}}.dump()
+                    : nlohmann::json{{"finish_reason", toString(ts.finishReason)}}.dump();
+                events += "\n\n";
+                events += "data: [DONE]\n\n";
+            }
+
+            stream.expires_after(m_connectionParams.writeTimeout);
+            co_await net::async_write(stream, http::make_chunk(net::buffer(events)), net::use_awaitable);
+
+            if (ts.done) break;
+        }
+
+        stream.expires_after(m_connectionParams.writeTimeout);
+        co_await net::async_write(stream, http::make_chunk_last(), net::use_awaitable);
+    }
+
+    // the timeout is restarted for each response, as the time before it (waiting for inference) is not limited
+    template <typename Body>
+    net::awaitable<void> writeResponse(beast::tcp_stream& stream, http::response<Body>& res) {
+        stream.expires_after(m_connectionParams.writeTimeout);
+        co_await http::async_write(stream, res, net::use_awaitable);
+    }
+
+    static std::string errorMessage(const std::exception_ptr& error) {
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception& e) {
+            return e.what();
+        }
+        catch (...) {
+            return "Unknown error";
+        }
+    }
+
+    static const char* toString(bl::llama::server::Server::FinishReason reason) {
+        switch (reason) {
+        case bl::llama::server::Server::FinishReason::Stop: return "stop";
+        case bl::llama::server::Server::FinishReason::Length: return "length";
+        case bl::llama::server::Server::FinishReason::Timeout: return "timeout";
+        case bl::llama::server::Server::FinishReason::Cancelled: return "cancelled";
+        }
+        return "stop";
+    }
+
+    static nlohmann::json choiceToJson(bl::llama::server::Server::CompleteReponse& gen) {
         std::ostringstream ss;
         for (auto& g : gen) {
             ss << g.tokenStr;
@@ -261,6 +464,23 @@ class Server {
         nlohmann::json outJson;
         outJson["text"] = ss.str();
         outJson["tokenData"] = toJson(gen);
+        outJson["finish_reason"] = toString(gen.finishReason);
+        return outJson;
+    }
+
+    // a single choice is the response itself, multiple ones are in a "choices" array
+    template <typename T>
+    decltype(auto) getCompleteResponse(T& choices, const http::request<http::string_body>& req) {
+        nlohmann::json outJson;
+        if (choices.size() == 1) {
+            outJson = choiceToJson(choices.front());
+        }
+        else {
+            auto& jchoices = outJson["choices"] = nlohmann::json::array();
+            for (auto& gen : choices) {
+                jchoices.push_back(choiceToJson(gen));
+            }
+        }
 
         // Prepare the response
         http::response<http::string_body> res(http::status::ok, req.version());
@@ -287,74 +507,252 @@ class Server {
         return res;
     }
 
+    // load of the server, for example for a load balancer
+    decltype(auto) getStatsResponse(const http::request<http::string_body>& req) {
+        const auto stats = m_server.stats();
+        nlohmann::json outJson = {
+            {"instances", stats.numInstances},
+            {"idle_instances", stats.idleInstances},
+            {"free_sessions", stats.freeSessions},
+            {"queued", stats.queued},
+            {"queued_verifications", stats.queuedVerifications},
+            {"oldest_queued_us", stats.oldestQueuedUs},
+            {"running", stats.running},
+            {"completed", stats.completed},
+            {"rejected", stats.rejected},
+            {"rejected_verifications", stats.rejectedVerifications},
+            {"cancelled_queued", stats.cancelledQueued},
+            {"timed_out", stats.timedOut},
+            {"timed_out_queued", stats.timedOutQueued},
+            {"total_queue_wait_us", stats.totalQueueWaitUs},
+            {"max_queue_wait_us", stats.maxQueueWaitUs},
+            {"prefill_chunks", stats.prefillChunks},
+            {"prefill_tokens", stats.prefillTokens},
+            {"total_prefill_chunk_us", stats.totalPrefillChunkUs},
+            {"max_prefill_chunk_us", stats.maxPrefillChunkUs},
+            {"decode_steps", stats.decodeSteps},
+            {"total_decode_step_us", stats.totalDecodeStepUs},
+            {"max_decode_step_us", stats.maxDecodeStepUs},
+            {"preemptions", stats.preemptions},
+            {"swap_ins", stats.swapIns},
+            {"swapped_bytes", stats.swappedBytes},
+            {"total_swap_out_us", stats.totalSwapOutUs},
+            {"max_swap_out_us", stats.maxSwapOutUs},
+            {"total_swap_in_us", stats.totalSwapInUs},
+            {"max_swap_in_us", stats.maxSwapInUs},
+            {"prefix_cache", {
+                {"hits", stats.prefixCache.hits},
+                {"misses", stats.prefixCache.misses},
+                {"hit_tokens", stats.prefixCache.hitTokens},
+                {"evictions", stats.prefixCache.evictions},
+                {"entries", stats.prefixCache.entries},
+                {"bytes", stats.prefixCache.bytes},
+            }},
+            {"session_store", {
+                {"ram_hits", stats.sessionStore.ramHits},
+                {"disk_hits", stats.sessionStore.diskHits},
+                {"misses", stats.sessionStore.misses},
+                {"spills", stats.sessionStore.spills},
+                {"evictions", stats.sessionStore.evictions},
+                {"ram_entries", stats.sessionStore.ramEntries},
+                {"ram_bytes", stats.sessionStore.ramBytes},
+                {"disk_entries", stats.sessionStore.diskEntries},
+                {"disk_bytes", stats.sessionStore.diskBytes},
+            }},
+        };
+
+        http::response<http::string_body> res(http::status::ok, req.version());
+        res.set(http::field::server, "Beast");
+        res.set(http::field::content_type, "text/json");
+        res.set(http::field::access_control_allow_origin, "*");
+        res.keep_alive(req.keep_alive());
+        res.body() = outJson.dump();
+        res.prepare_payload();
+
+        return res;
+    }
 
 public:
 
-    Server(const std::string& modelGguf)
+    Server(const std::string& modelGguf, bl::llama::server::Server::Params params, ConnectionParams connectionParams)
         : m_model(std::make_shared<bl::llama::Model>(modelGguf, bl::llama::Model::Params{}, modelLoadProgressCallback))
-        , m_server(m_model)
+        , m_server(m_model, std::move(params))
+        , m_connectionParams(connectionParams)
     {}
 
-    net::awaitable<void> handleRequest(beast::tcp_stream stream) {
+    net::awaitable<void> handleConnection(beast::tcp_stream stream) {
+        // connections over the limit are closed after rejecting their first request
+        const auto numConnections = ++m_numConnections;
+        const bool tooManyConnections = m_connectionParams.maxConnections && numConnections > m_connectionParams.maxConnections;
+        struct ConnectionCount {
+            std::atomic_uint32_t& count;
+            ~ConnectionCount() { --count; }
+        } connectionCount{m_numConnections};
+
+        // the buffer outlives a single request, so that pipelined requests which were read
+        // together with the previous one are served in order
         beast::flat_buffer buffer;
-        http::request<http::string_body> req;
+        uint32_t numRequests = 0;
 
-        auto ex = co_await net::this_coro::executor;
+        while (true) {
+            http::request<http::string_body> req;
+
+            stream.expires_after(m_connectionParams.idleTimeout);
+            boost::system::error_code ec;
+            co_await http::async_read(stream, buffer, req, net::redirect_error(net::use_awaitable, ec));
+            if (ec) {
+                // end_of_stream (client closed), idle timeout, or a malformed request
+                break;
+            }
+
+            // inference may take arbitrarily long, so don't let the idle timer cut it off
+            // (the writes of the response are limited by the write timeout)
+            stream.expires_never();
+
+            ++numRequests;
+            const bool keepAlive = req.keep_alive() && !tooManyConnections
+                && (m_connectionParams.maxRequests == 0 || numRequests < m_connectionParams.maxRequests);
+            // the response builders propagate this to the response
+            req.keep_alive(keepAlive);
+
+            // invalid requests (malformed json, unsupported params, prompts which don't fit) get a bad request response
+            // rather than taking the server down, and so do failed ones with an internal server error
+            // when the server is saturated, requests are rejected right away, so that the client can go elsewhere
+            std::optional<std::string> error;
+            auto status = http::status::bad_request;
+            std::chrono::seconds retryAfter{};
+            if (tooManyConnections) {
+                error = "Server is busy, too many connections";
+                status = http::status::service_unavailable;
+                retryAfter = std::chrono::seconds(1);
+            }
+            else {
+                auto watch = std::make_shared<ClientWatch>();
+                net::co_spawn(co_await net::this_coro::executor, watchClient(stream.socket(), watch), net::detached);
+
+                try {
+                    co_await handleRequest(stream, req, watch->cancel);
+                }
+                catch (const bl::llama::server::Server::QueueFullError& e) {
+                    error = e.what();
+                    status = http::status::service_unavailable;
+                    retryAfter = e.retryAfter();
+                }
+                catch (const bl::llama::server::Server::InferenceError& e) {
+                    error = e.what();
+                    status = http::status::internal_server_error;
+                }
+                catch (const std::exception& e) {
+                    error = e.what();
+                }
+
+                watch->done = true;
+                boost::system::error_code ec;
+                stream.socket().cancel(ec);
+
+                if (*watch->cancel) {
+                    // the client is gone, there is no one to respond to
+                    break;
+                }
+            }
+            if (error) {
+                http::response<http::string_body> res(status, req.version());
+                res.set(http::field::access_control_allow_origin, "*");
+                res.set(http::field::content_type, "text/json");
+                if (retryAfter.count()) {
+                    res.set(http::field::retry_after, std::to_string(retryAfter.count()));
+                }
+                res.keep_alive(req.keep_alive());
+                res.body() = nlohmann::json({{"error", *error}}).dump();
+                res.prepare_payload();
+                co_await writeResponse(stream, res);
+            }
 
-        co_await http::async_read(stream, buffer, req, net::use_awaitable);
+            if (!keepAlive) {
+                break;
+            }
+        }
+
+        // Close the stream
+        boost::system::error_code ec;
+        stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+    // the requests to the server are made with cancel, so that they stop if the client goes away
+    net::awaitable<void> handleRequest(beast::tcp_stream& stream, http::request<http::string_body>& req, bl::llama::server::Server::CancelFlag cancel) {
+        auto ex = co_await net::this_coro::executor;
 
-        if (req.method() != http::verb::post) {
+        if (req.method() == http::verb::get && req.target() == "/stats") {
+            auto res = getStatsResponse(req);
+            co_await writeResponse(stream, res);
+        }
+        else if (req.method() != http::verb::post) {
             http::response<http::empty_body> res(http::status::bad_request, req.version());
             res.set(http::field::access_control_allow_origin, "*");
-            co_await http::async_write(stream, res, net::use_awaitable);
+            res.keep_alive(req.keep_alive());
+            co_await writeResponse(stream, res);
         }
         else if (req.target() == "/complete") {
-            auto params = toCompleteParams(req.body());
+            auto json = nlohmann::json::parse(req.body());
+            auto params = toCompleteParams(json);
+            params.cancel = cancel;
+
+            if (json.value("stream", false)) {
+                co_await streamComplete(stream, req, std::move(params));
+                co_return;
+            }
 
             auto gen = co_await asyncComplete(ex, std::move(params));
             auto res = getCompleteResponse(gen, req);
             // Write the response
-            co_await http::async_write(stream, res, net::use_awaitable);
+            co_await writeResponse(stream, res);
         }
         else if(req.target() == "/chat/completions") {
-            auto params = toChatCompleteParams(req.body());
+            auto json = nlohmann::json::parse(req.body());
+            auto params = toChatCompleteParams(json);
+            params.cancel = cancel;
+
+            if (json.value("stream", false)) {
+                co_await streamComplete(stream, req, std::move(params));
+                co_return;
+            }
 
             auto gen = co_await asyncChatComplete(ex, std::move(params));
             auto res = getCompleteResponse(gen, req);
 
             // Write the response
-            co_await http::async_write(stream, res, net::use_awaitable);
+            co_await writeResponse(stream, res);
         }
         else if (req.target() == "/verify_completion") {
             auto json = nlohmann::json::parse(req.body());
             auto rreq = toCompleteParams(json["request"]);
+            rreq.cancel = cancel;
             auto rrsp = toCompleteResponse(json["response"]);
 
             auto verifyResult = co_await asyncVerify(ex, std::move(rreq), std::move(rrsp));
             auto res = getVerifyResponse(verifyResult, req);
 
             // Write the response
-            co_await http::async_write(stream, res, net::use_awaitable);
+            co_await writeResponse(stream, res);
         }
         else if (req.target() == "/chat/verify_completion") {
             auto json = nlohmann::json::parse(req.body());
             auto rreq = toChatCompleteParams(json["request"]);
+            rreq.cancel = cancel;
             auto rrsp = toCompleteResponse(json["response"]);
 
             auto verifyResult = co_await asyncChatVerify(ex, std::move(rreq), std::move(rrsp));
             auto res = getVerifyResponse(verifyResult, req);
 
             // Write the response
-            co_await http::async_write(stream, res, net::use_awaitable);
+            co_await writeResponse(stream, res);
         }
         else {
             http::response<http::empty_body> res(http::status::not_found, req.version());
             res.set(http::field::access_control_allow_origin, "*");
-            co_await http::async_write(stream, res, net::use_awaitable);
+            res.keep_alive(req.keep_alive());
+            co_await writeResponse(stream, res);
         }
-
-        // Close the stream
-        stream.socket().shutdown(tcp::socket::shutdown_send);
     }
 
     net::awaitable<void> listen(const boost::asio::ip::address &addr, net::ip::port_type port) {
@@ -362,13 +760,35 @@ public:
         tcp::acceptor acc(ex, tcp::endpoint(addr, port));
 
         while (true) {
-            auto sock = co_await acc.async_accept(net::use_awaitable);
-            net::co_spawn(ex, handleRequest(beast::tcp_stream(bstl::move(sock))), net::detached);
+            // each connection runs on its own strand, so that inference callbacks can be posted to it safely
+            auto strand = net::make_strand(ex);
+            auto sock = co_await acc.async_accept(strand, net::use_awaitable);
+            net::co_spawn(strand, handleConnection(beast::tcp_stream(bstl::move(sock))), net::detached);
         }
     }
 
 };
 
+uint32_t getEnvUint(const char* name, uint32_t min, uint32_t max, uint32_t defaultValue) {
+    const char* env = std::getenv(name);
+    if (!env) {
+        return defaultValue;
+    }
+
+    size_t idx = 0;
+    unsigned long value = std::stoul(env, &idx, 10);
+
+    if (idx != std::strlen(env)) {
+        throw std::invalid_argument(std::string("Extra characters after ") + name + " number");
+    }
+
+    if (value < min || value > max) {
+        throw std::out_of_range(std::string(name) + " must be between " + std::to_string(min) + " and " + std::to_string(max));
+    }
+
+    return static_cast<uint32_t>(value);
+}
+
 int main(int argc, char* argv[]) {
     jalog::Instance jl;
     jl.setup().async().add<jalog::sinks::DefaultSink>();
@@ -434,10 +854,64 @@ int main(int argc, char* argv[]) {
         modelGguf = modelPathString;
     }
 
+    bl::llama::server::Server::Params serverParams;
+
+    serverParams.numInstances = getEnvUint("BLAMA_INSTANCES", 1, 256, serverParams.numInstances);
+    serverParams.instanceParams.maxSessions = getEnvUint("BLAMA_SESSIONS", 1, 256, serverParams.instanceParams.maxSessions);
+    serverParams.instanceParams.ctxSize = getEnvUint("BLAMA_CTX_SIZE", 0, 1 << 20, serverParams.instanceParams.ctxSize);
+    serverParams.prefillChunk = getEnvUint("BLAMA_PREFILL_CHUNK", 0, 1 << 20, serverParams.prefillChunk);
+    serverParams.preemption = getEnvUint("BLAMA_PREEMPTION", 0, 1, serverParams.preemption) != 0;
+    serverParams.queueLimits.maxQueued = getEnvUint("BLAMA_MAX_QUEUED", 0, 1000000, 0);
+    serverParams.queueLimits.maxQueuedCompletions = getEnvUint("BLAMA_MAX_QUEUED_COMPLETIONS", 0, 1000000, 0);
+    serverParams.queueLimits.maxQueuedVerifications = getEnvUint("BLAMA_MAX_QUEUED_VERIFICATIONS", 0, 1000000, 0);
+    if (const char* scheduling = std::getenv("BLAMA_SCHEDULING")) {
+        const std::string_view policy = scheduling;
+        if (policy == "fifo") {
+            serverParams.schedulingPolicy = std::make_shared<bl::llama::server::FifoPolicy>();
+        }
+        else if (policy == "classes") {
+            serverParams.schedulingPolicy = std::make_shared<bl::llama::server::ClassQueuesPolicy>(bl::llama::server::ClassQueuesPolicy::Params{});
+        }
+        else if (policy == "sjf") {
+            serverParams.schedulingPolicy = std::make_shared<bl::llama::server::ShortestJobFirstPolicy>(bl::llama::server::ShortestJobFirstPolicy::Params{});
+        }
+        else if (policy == "edf") {
+            serverParams.schedulingPolicy = std::make_shared<bl::llama::server::EarliestDeadlineFirstPolicy>(bl::llama::server::EarliestDeadlineFirstPolicy::Params{});
+        }
+        else {
+            throw std::invalid_argument("BLAMA_SCHEDULING must be one of fifo, classes, sjf, edf");
+        }
+        JALOG(Info, "Scheduling policy: ", policy);
+    }
+    serverParams.prefixCache.maxBytes = size_t(getEnvUint("BLAMA_PREFIX_CACHE_MB", 0, 1 << 20, 0)) << 20;
+    serverParams.sessionStore.maxRamBytes = size_t(getEnvUint("BLAMA_SESSION_STORE_MB", 0, 1 << 20, 0)) << 20;
+    serverParams.sessionStore.maxDiskBytes = size_t(getEnvUint("BLAMA_SESSION_STORE_DISK_MB", 0, 1 << 24, 0)) << 20;
+    if (serverParams.sessionStore.maxDiskBytes) {
+        const char* dir = std::getenv("BLAMA_SESSION_STORE_DIR");
+        serverParams.sessionStore.directory = dir ? dir : (fs::temp_directory_path() / "blama-sessions").string();
+    }
+
+    Server::ConnectionParams connectionParams;
+    connectionParams.idleTimeout = std::chrono::seconds(getEnvUint("BLAMA_KEEP_ALIVE_TIMEOUT", 1, 3600, uint32_t(connectionParams.idleTimeout.count())));
+    connectionParams.writeTimeout = std::chrono::seconds(getEnvUint("BLAMA_WRITE_TIMEOUT", 1, 3600, uint32_t(connectionParams.writeTimeout.count())));
+    connectionParams.maxRequests = getEnvUint("BLAMA_MAX_REQUESTS_PER_CONNECTION", 0, 1000000, connectionParams.maxRequests);
+    connectionParams.maxConnections = getEnvUint("BLAMA_MAX_CONNECTIONS", 0, 1000000, connectionParams.maxConnections);
+
     JALOG(Info, "Loading model ", modelGguf);
     JALOG(Info, "Listening on port ", port);
+    JALOG(Info, "Inference instances: ", serverParams.numInstances, ", sessions per instance: ", serverParams.instanceParams.maxSessions);
+    if (serverParams.preemption) {
+        JALOG(Info, "Verifications preempt generations");
+    }
+    if (serverParams.prefixCache.maxBytes) {
+        JALOG(Info, "Prefix cache: ", serverParams.prefixCache.maxBytes >> 20, " MB");
+    }
+    if (serverParams.sessionStore.maxRamBytes || serverParams.sessionStore.maxDiskBytes) {
+        JALOG(Info, "Session store: ", serverParams.sessionStore.maxRamBytes >> 20, " MB in memory, ",
+            serverParams.sessionStore.maxDiskBytes >> 20, " MB on disk");
+    }
 
-    Server server(modelGguf);
+    Server server(modelGguf, serverParams, connectionParams);
 
     net::io_context ioctx;
     auto guard = net::make_work_guard(ioctx);
@@ -0,0 +1,339 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "BatchScheduler.hpp"
+
+#include <llama/Instance.hpp>
+
+#include <bstl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <optional>
+
+namespace bl::llama::server {
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+uint64_t elapsedUs(clock::time_point start) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count());
+}
+} // namespace
+
+struct BatchScheduler::Active {
+    struct Choice {
+        Session* session; // null while swapped out
+        std::optional<Session::StreamGenerator> generator; // created once the prompt is decoded
+        bool started = false; // the prompt is decoded and the generation has started
+        uint32_t numGenerated = 0;
+        std::vector<TokenPrediction> predictions;
+        std::vector<uint8_t> swapped; // snapshot of the session while it's swapped out
+        bool done = false;
+    };
+
+    Request req;
+
+    // the first choice decodes the prompt and the others are forked from it afterwards
+    std::vector<Choice> choices;
+    bool done = false;
+    Outcome outcome = Outcome::Finished;
+    std::exception_ptr error; // if the request failed
+};
+
+BatchScheduler::BatchScheduler(Instance& instance, Params params)
+    : m_instance(instance)
+    , m_prefillChunk(params.prefillChunk ? params.prefillChunk : instance.ubatchSize())
+{}
+
+BatchScheduler::~BatchScheduler() = default;
+
+bool BatchScheduler::admit(Request req) {
+    Session* session = nullptr;
+    try {
+        if (req.n == 0) {
+            throw_ex{} << "A request needs at least one choice";
+        }
+        if (req.n > 1 && req.onToken) {
+            throw_ex{} << "Streaming is only supported with a single choice";
+        }
+
+        // swapped out choices will need their sessions back
+        if (req.n + m_numSwapped > numFree()) {
+            throw_ex{} << "Not enough free sessions for " << req.n << " choices";
+        }
+
+        session = &m_instance.startSession(req.sessionParams);
+        if (req.setup) {
+            req.setup(*session);
+        }
+        else {
+            session->queueInitialPrompt(req.prompt);
+        }
+    }
+    catch (...) {
+        if (session) {
+            m_instance.stopSession(*session);
+        }
+        req.cb(std::vector<std::vector<TokenPrediction>>(req.n), Outcome::Rejected, std::current_exception());
+        return false;
+    }
+
+    req.prompt = {}; // the session has its own copy
+
+    auto a = std::unique_ptr<Active>(new Active{std::move(req)});
+    a->choices.reserve(a->req.n);
+    a->choices.push_back({session});
+    m_numReserved += a->req.n - 1;
+    m_active.push_back(std::move(a));
+    return true;
+}
+
+uint32_t BatchScheduler::numFree() const noexcept {
+    // sessions reserved for forks are not free
+    return m_instance.maxSessions() - m_instance.numActiveSessions() - m_numReserved;
+}
+
+BatchScheduler::PreemptResult BatchScheduler::preempt(uint32_t numSessions) {
+    PreemptResult ret;
+
+    // the most recently admitted requests are preempted first
+    for (auto a = m_active.rbegin(); a != m_active.rend(); ++a) {
+        for (auto& c : (*a)->choices) {
+            if (numFree() >= numSessions) {
+                ret.freed = true;
+                return ret;
+            }
+
+            // only generating choices are swapped out, as the others would have to finish their prompts first
+            if (!c.session || !c.started || c.done) continue;
+
+            const auto start = clock::now();
+
+            // the generator is recreated when the session is swapped in
+            c.generator.reset();
+            c.swapped.resize(c.session->snapshotSize());
+            c.session->writeSnapshot(c.swapped);
+            m_instance.stopSession(*c.session);
+            c.session = nullptr;
+            ++m_numSwapped;
+
+            ++ret.swappedOut;
+            ret.swappedBytes += c.swapped.size();
+            ret.swapOutUs += elapsedUs(start);
+        }
+    }
+
+    ret.freed = numFree() >= numSessions;
+    return ret;
+}
+
+void BatchScheduler::swapIn(StepResult& ret) {
+    if (m_numSwapped == 0) return;
+
+    for (auto& a : m_active) {
+        if (a->done) continue; // stopped
+
+        for (auto& c : a->choices) {
+            if (c.session) continue;
+
+            if (numFree() == 0) return;
+
+            const auto start = clock::now();
+
+            // the snapshot has the params and sampler state of the choice
+            // its logits come from decoding the last token again, which is done with the batch of this step
+            auto& session = m_instance.startSession(a->req.sessionParams);
+            try {
+                session.restoreSnapshot(c.swapped);
+                session.queueLastToken();
+            }
+            catch (...) {
+                m_instance.stopSession(session);
+                stop(*a, Outcome::Failed, std::current_exception());
+                ++ret.finished;
+                break;
+            }
+            c.swapped = {};
+            c.session = &session;
+            --m_numSwapped;
+
+            ++ret.swappedIn;
+            ret.swapInUs += elapsedUs(start);
+        }
+    }
+}
+
+void BatchScheduler::stop(Active& a, Outcome outcome, std::exception_ptr error) {
+    for (auto& c : a.choices) {
+        c.generator.reset();
+        if (!c.session && !c.swapped.empty()) {
+            c.swapped = {};
+            --m_numSwapped;
+        }
+        c.done = true;
+    }
+    a.done = true;
+    a.outcome = outcome;
+    a.error = std::move(error);
+}
+
+void BatchScheduler::sample(Active& a) {
+    auto& req = a.req;
+    auto& first = a.choices.front();
+    if (!first.started && first.session->hasPendingInput()) {
+        // prompt didn't fit in this batch
+        return;
+    }
+
+    if (req.maxTokens != 0 && a.choices.size() < req.n) {
+        // the prompt is decoded, so the other choices can share it
+        // (the reservation of each is released as soon as it has a session, in case a fork fails)
+        for (uint32_t i = uint32_t(a.choices.size()); i < req.n; ++i) {
+            a.choices.push_back({&first.session->fork(req.sessionParams.seed + i)});
+            --m_numReserved;
+        }
+    }
+
+    a.done = true;
+    for (auto& c : a.choices) {
+        if (c.done) continue;
+
+        if (!c.session || c.session->hasPendingInput()) {
+            // swapped out or the last token didn't fit in this batch
+            a.done = false;
+            continue;
+        }
+
+        if (req.maxTokens == 0) {
+            c.done = true;
+            continue;
+        }
+
+        if (!c.generator) {
+            // a swapped in choice continues with a new generator
+            c.generator.emplace(c.session->completeStream({
+                .maxTokens = int32_t(req.maxTokens - c.numGenerated),
+                .topLogits = req.topLogits
+            }));
+            c.started = true;
+        }
+
+        auto p = c.generator->complete();
+        if (p) {
+            ++c.numGenerated;
+            if (req.onToken) {
+                req.onToken(std::move(p));
+            }
+            else {
+                c.predictions.push_back(std::move(p));
+            }
+        }
+        c.done = c.generator->status() != Session::StreamGenerator::Status::InProgress;
+        a.done = a.done && c.done;
+    }
+}
+
+BatchScheduler::StepResult BatchScheduler::step() {
+    const auto start = clock::now();
+    StepResult ret;
+
+    // cancelled and timed out requests finish before they take part in the batch (or are swapped in)
+    for (auto& a : m_active) {
+        if (a->req.cancel && a->req.cancel->load(std::memory_order_relaxed)) {
+            stop(*a, Outcome::Cancelled);
+            ++ret.finished;
+        }
+        else if (a->req.deadline && start >= *a->req.deadline) {
+            stop(*a, Outcome::TimedOut);
+            ++ret.finished;
+            ++ret.timedOut;
+        }
+    }
+
+    swapIn(ret);
+
+    m_batchSessions.clear();
+    for (auto& a : m_active) {
+        for (auto& c : a->choices) {
+            if (!c.done && c.session) {
+                m_batchSessions.push_back(c.session);
+            }
+        }
+    }
+
+    try {
+        const auto batchInfo = m_instance.decodeBatch(m_batchSessions, m_prefillChunk);
+        ret.promptTokens = batchInfo.promptTokens;
+        ret.generatedTokens = batchInfo.generatedTokens;
+    }
+    catch (...) {
+        // the sessions in the batch are in an unknown state
+        for (auto& a : m_active) {
+            if (a->done) continue;
+            if (std::any_of(a->choices.begin(), a->choices.end(), [](const Active::Choice& c) { return c.session && !c.done; })) {
+                stop(*a, Outcome::Failed, std::current_exception());
+                ++ret.finished;
+            }
+        }
+    }
+
+    for (auto& a : m_active) {
+        if (a->done) continue; // stopped
+
+        try {
+            sample(*a);
+        }
+        catch (...) {
+            stop(*a, Outcome::Failed, std::current_exception());
+        }
+
+        ret.finished += a->done;
+    }
+
+    // the callbacks of finished requests are not part of the step
+    ret.durationUs = elapsedUs(start);
+
+    if (ret.finished == 0) {
+        return ret;
+    }
+
+    // leave the batch
+    auto firstDone = std::stable_partition(m_active.begin(), m_active.end(), [](const std::unique_ptr<Active>& a) {
+        return !a->done;
+    });
+    std::vector<std::unique_ptr<Active>> finished(std::make_move_iterator(firstDone), std::make_move_iterator(m_active.end()));
+    m_active.erase(firstDone, m_active.end());
+
+    for (auto& a : finished) {
+        std::vector<std::vector<TokenPrediction>> predictions(a->req.n);
+        for (size_t i = 0; i < a->choices.size(); ++i) {
+            auto& c = a->choices[i];
+            c.generator.reset();
+            predictions[i] = std::move(c.predictions);
+            if (!c.session) {
+                // stopped while swapped out: the session it was waiting for is not needed anymore
+                ++ret.freedSessions;
+                continue;
+            }
+
+            if (i == 0 && a->req.onFinish && a->outcome != Outcome::Cancelled && a->outcome != Outcome::Failed) {
+                a->req.onFinish(*c.session);
+            }
+            m_instance.stopSession(*c.session);
+            ++ret.freedSessions;
+        }
+
+        // choices which were never forked release their reservation
+        const auto numUnforked = a->req.n - uint32_t(a->choices.size());
+        m_numReserved -= numUnforked;
+        ret.freedSessions += numUnforked;
+
+        a->req.cb(std::move(predictions), a->outcome, std::move(a->error));
+    }
+
+    return ret;
+}
+
+} // namespace bl::llama::server
@@ -0,0 +1,155 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include <llama/Token.hpp>
+#include <llama/Session.hpp>
+#include <itlib/ufunction.hpp>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace bl::llama {
+class Instance;
+}
+
+namespace bl::llama::server {
+
+// Continuous batching of generation requests on a single instance
+//
+// Every admitted request gets its own session (and thus its own KV cache sequence) in the instance.
+// Requests for multiple choices decode the prompt once and then fork the session for each additional choice,
+// so that the choices are generated in lockstep as parallel sequences.
+// Each step decodes the next token of every generating request together with prompt chunks of newly
+// admitted ones in a single batch, then samples each sequence.
+// The prompt tokens per step are limited (to a physical batch by default), so a long prompt is processed in
+// chunks over multiple steps and the other requests keep generating in the meantime.
+// Requests join and leave the batch between steps.
+// To make room for urgent work outside of the batch, generating choices can be preempted: their sessions are
+// snapshotted to memory and stopped, and they are swapped back in (and continue generating) on the first step
+// which finds free sessions.
+//
+// Not thread safe. All calls are expected to come from the thread (or strand) which owns the instance.
+class BL_LLAMA_SERVER_API BatchScheduler {
+public:
+    // how a request ended
+    enum class Outcome {
+        Finished, // all choices are done generating
+        TimedOut, // the deadline passed
+        Cancelled,
+        Rejected, // the request can't be served, for example its prompt doesn't fit in the context
+        Failed, // inference failed while serving the request
+    };
+
+    struct Request {
+        std::vector<Token> prompt;
+        Session::InitParams sessionParams;
+        uint32_t maxTokens = 0;
+        uint32_t topLogits = 10; // number of top logits in each prediction
+
+        // number of choices, each using a session
+        // choice i samples with sessionParams.seed + i
+        uint32_t n = 1;
+
+        // called once the request is finished with the predictions of each choice
+        // (partial ones if it timed out or was cancelled)
+        // error is the reason of a rejected or failed request and null otherwise
+        itlib::ufunction<void(std::vector<std::vector<TokenPrediction>>, Outcome, std::exception_ptr error)> cb;
+
+        // optional: called for each token as soon as it's sampled (only supported with a single choice)
+        // if set, the predictions are not accumulated and cb gets empty vectors
+        itlib::ufunction<void(TokenPrediction)> onToken;
+
+        // optional: prepares the new session instead of queueing the prompt as its initial one
+        // (for example restores a parked state and queues the rest with Session::queuePrompt)
+        itlib::ufunction<void(Session&)> setup;
+
+        // optional: called with the session of the first choice once the request is finished, before it's stopped
+        // (for example to park it)
+        // not called for cancelled requests
+        itlib::ufunction<void(Session&)> onFinish;
+
+        // optional: once set (from any thread), the request finishes on the next step with what it has generated
+        std::shared_ptr<const std::atomic_bool> cancel;
+
+        // optional: the request finishes on the first step after this time with what it has generated
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+    };
+
+    struct Params {
+        // max number of prompt tokens decoded in a step (0 = the instance's physical batch size)
+        // smaller chunks keep the time between the tokens of generating requests lower,
+        // but make prompt processing less efficient
+        uint32_t prefillChunk = 0;
+    };
+
+    BatchScheduler(Instance& instance, Params params);
+    ~BatchScheduler();
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // the request gets a session right away and joins the batch on the next step
+    // the sessions for the other choices are reserved until the prompt is decoded
+    // returns false if the request is rejected (for example if the instance doesn't have req.n free sessions, not
+    // counting the ones preempted choices are waiting for), in which case its callback has been called with the error
+    bool admit(Request req);
+
+    struct StepResult {
+        uint32_t finished = 0; // number of requests which finished in this step
+        uint32_t timedOut = 0; // the ones among them whose deadline passed
+        // number of sessions they released: the ones they used, the ones their swapped out choices were waiting for
+        // and the reservations of the choices which were never forked
+        uint32_t freedSessions = 0;
+
+        uint32_t promptTokens = 0; // number of prompt tokens decoded in this step
+        uint32_t generatedTokens = 0; // number of generated tokens decoded in this step
+        uint64_t durationUs = 0; // time of the step, including sampling (microseconds)
+
+        uint32_t swappedIn = 0; // number of preempted choices which were restored in this step
+        uint64_t swapInUs = 0; // time spent restoring them (included in durationUs)
+    };
+
+    // decode one batch and sample all active requests which are done with their prompts
+    // finished requests leave the batch and are completed via their callback
+    // errors don't escape: a request whose sampling (or swap in) fails finishes as failed, and so do all requests
+    // in the batch if it fails to decode
+    StepResult step();
+
+    struct PreemptResult {
+        bool freed = false; // whether the requested number of sessions is free
+        uint32_t swappedOut = 0; // number of choices which were swapped out
+        size_t swappedBytes = 0; // total size of their snapshots
+        uint64_t swapOutUs = 0; // time spent swapping them out (microseconds)
+    };
+
+    // swap out generating choices until numSessions sessions of the instance are free
+    // the most recently admitted requests are preempted first and choices which are still decoding their
+    // prompts are never preempted, so this may fail to free enough sessions
+    // the freed sessions are expected to be used (and stopped) before the next step, which swaps the choices back in
+    PreemptResult preempt(uint32_t numSessions);
+
+    uint32_t numActive() const noexcept { return uint32_t(m_active.size()); }
+    uint32_t numSwapped() const noexcept { return m_numSwapped; }
+
+private:
+    struct Active;
+
+    uint32_t numFree() const noexcept;
+    void stop(Active& a, Outcome outcome, std::exception_ptr error = {});
+    void swapIn(StepResult& ret);
+    void sample(Active& a); // after a decode
+
+    Instance& m_instance;
+    uint32_t m_prefillChunk;
+    std::vector<std::unique_ptr<Active>> m_active;
+    uint32_t m_numReserved = 0; // sessions for choices which are yet to be forked
+    uint32_t m_numSwapped = 0; // preempted choices which wait for a session
+    std::vector<Session*> m_batchSessions; // reused between steps
+};
+
+} // namespace bl::llama::server
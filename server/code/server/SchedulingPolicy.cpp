@@ -0,0 +1,89 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "SchedulingPolicy.hpp"
+
+#include <algorithm>
+
+namespace bl::llama::server {
+
+namespace {
+// index of the job for which key is the smallest, ties are broken by the order of arrival
+template <typename Key>
+size_t minBy(std::span<const SchedulingPolicy::Job* const> jobs, Key key) {
+    size_t best = 0;
+    auto bestKey = key(*jobs[0]);
+    for (size_t i = 1; i < jobs.size(); ++i) {
+        auto k = key(*jobs[i]);
+        if (k < bestKey || (k == bestKey && jobs[i]->id < jobs[best]->id)) {
+            best = i;
+            bestKey = k;
+        }
+    }
+    return best;
+}
+} // namespace
+
+SchedulingPolicy::~SchedulingPolicy() = default;
+
+void SchedulingPolicy::dispatched(const Job&) {}
+
+size_t FifoPolicy::next(std::span<const Job* const> jobs) {
+    return minBy(jobs, [](const Job& j) { return j.id; });
+}
+
+ClassQueuesPolicy::ClassQueuesPolicy(Params params)
+    : m_params(params)
+{}
+
+size_t ClassQueuesPolicy::next(std::span<const Job* const> jobs) {
+    std::optional<size_t> verify, complete;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        auto& front = jobs[i]->jobClass == JobClass::Verify ? verify : complete;
+        if (!front || jobs[i]->id < jobs[*front]->id) {
+            front = i;
+        }
+    }
+
+    if (!complete) {
+        m_verifyStreak = 0; // the streak only counts while generations are waiting
+        return *verify;
+    }
+    if (!verify || m_verifyStreak >= m_params.verifyWeight) {
+        return *complete;
+    }
+    return *verify;
+}
+
+void ClassQueuesPolicy::dispatched(const Job& job) {
+    if (job.jobClass == JobClass::Verify) {
+        ++m_verifyStreak;
+    }
+    else {
+        m_verifyStreak = 0;
+    }
+}
+
+ShortestJobFirstPolicy::ShortestJobFirstPolicy(Params params)
+    : m_params(params)
+{}
+
+size_t ShortestJobFirstPolicy::next(std::span<const Job* const> jobs) {
+    const auto now = clock::now();
+    return minBy(jobs, [&](const Job& j) {
+        const auto waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - j.enqueueTime).count();
+        return double(j.cost()) - double(m_params.agingTokensPerSec) * double(waitMs) / 1000;
+    });
+}
+
+EarliestDeadlineFirstPolicy::EarliestDeadlineFirstPolicy(Params params)
+    : m_params(params)
+{}
+
+size_t EarliestDeadlineFirstPolicy::next(std::span<const Job* const> jobs) {
+    return minBy(jobs, [&](const Job& j) {
+        return j.deadline.value_or(j.enqueueTime + m_params.defaultDeadline);
+    });
+}
+
+} // namespace bl::llama::server
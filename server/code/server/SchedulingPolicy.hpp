@@ -0,0 +1,111 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+namespace bl::llama::server {
+
+// decides which of the queued jobs of a server is dispatched next (see Server::Params::schedulingPolicy)
+// a dispatched job waits for free sessions on an instance and the jobs after it wait too,
+// so a policy decides the order of dispatch, but not whether jobs skip ahead of a large one which doesn't fit
+//
+// a policy is only called by the server it's given to, with the server's queue locked
+class BL_LLAMA_SERVER_API SchedulingPolicy {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class JobClass {
+        Complete, // generations: completions and chats, including streaming ones
+        Verify, // verifications of completions
+    };
+
+    struct Job {
+        uint64_t id = 0; // increasing in the order of arrival
+        JobClass jobClass = JobClass::Complete;
+        uint32_t numSessions = 1; // number of choices of a generation
+
+        // tokens to decode before generating (for verifications all of them, including the verified ones)
+        // it's an estimate, for example a turn of a conversation only decodes what's not in its parked session
+        uint32_t promptTokens = 0;
+        uint32_t maxTokens = 0; // tokens to generate for each choice (0 for verifications)
+
+        clock::time_point enqueueTime;
+        std::optional<clock::time_point> deadline; // when the client wants the job to be done
+
+        // number of tokens to decode for the job
+        uint64_t cost() const noexcept { return promptTokens + uint64_t(maxTokens) * numSessions; }
+    };
+
+    virtual ~SchedulingPolicy();
+
+    // index of the job to dispatch next
+    // jobs is never empty and is mostly in the order of arrival (jobs which fail to preempt go back to the front)
+    virtual size_t next(std::span<const Job* const> jobs) = 0;
+
+    // called for each job when it's dispatched (whether it was picked by next or it preempted another)
+    virtual void dispatched(const Job& job);
+};
+
+// strictly in the order of arrival
+class BL_LLAMA_SERVER_API FifoPolicy final : public SchedulingPolicy {
+public:
+    virtual size_t next(std::span<const Job* const> jobs) override;
+};
+
+// separate queues for verifications and generations, each in the order of arrival
+// while both have jobs, verifications get verifyWeight dispatches for each one of generations, so that short
+// verifications don't wait behind long generations, while generations still make progress
+class BL_LLAMA_SERVER_API ClassQueuesPolicy final : public SchedulingPolicy {
+public:
+    struct Params {
+        uint32_t verifyWeight = 4;
+    };
+
+    explicit ClassQueuesPolicy(Params params);
+
+    virtual size_t next(std::span<const Job* const> jobs) override;
+    virtual void dispatched(const Job& job) override;
+
+private:
+    Params m_params;
+    uint32_t m_verifyStreak = 0; // verifications dispatched since the last generation
+};
+
+// the job with the fewest tokens to decode (Job::cost) first
+// to avoid starving long jobs, the cost is reduced by agingTokensPerSec for every second spent in the queue
+class BL_LLAMA_SERVER_API ShortestJobFirstPolicy final : public SchedulingPolicy {
+public:
+    struct Params {
+        uint32_t agingTokensPerSec = 100; // 0 = no aging
+    };
+
+    explicit ShortestJobFirstPolicy(Params params);
+
+    virtual size_t next(std::span<const Job* const> jobs) override;
+
+private:
+    Params m_params;
+};
+
+// the job with the earliest deadline first
+// jobs without a deadline get one defaultDeadline after their arrival
+class BL_LLAMA_SERVER_API EarliestDeadlineFirstPolicy final : public SchedulingPolicy {
+public:
+    struct Params {
+        std::chrono::milliseconds defaultDeadline = std::chrono::seconds(60);
+    };
+
+    explicit EarliestDeadlineFirstPolicy(Params params);
+
+    virtual size_t next(std::span<const Job* const> jobs) override;
+
+private:
+    Params m_params;
+};
+
+} // namespace bl::llama::server
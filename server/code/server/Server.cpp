@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 //
 #include "Server.hpp"
+#include "BatchScheduler.hpp"
 
 #include <llama/Model.hpp>
 #include <llama/Instance.hpp>
@@ -11,225 +12,1042 @@
 
 #include <bstl/thread_runner.hpp>
 #include <bstl/move_capture.hpp>
+#include <bstl/throw_stdex.hpp>
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
 
 namespace asio = boost::asio;
 
 namespace bl::llama::server {
 
 struct Server::Impl {
+    using clock = std::chrono::steady_clock;
+
+    // a task occupies a session of an instance for its whole duration (as opposed to generations which are batched)
+    // it's called with null if it was cancelled (or its deadline passed) before it started,
+    // so that it can complete its callback
+    // errors are expected to be passed to the callback as well
+    using Task = itlib::ufunction<void(Instance*)>;
+
     std::shared_ptr<Model> m_model;
-    bl::llama::Instance m_instance;
 
     asio::io_context m_ioctx;
     asio::executor_work_guard<asio::io_context::executor_type> m_wg;
 
+    // an instance and the generations which are batched on it
+    // all work on the instance is serialized through the strand
+    struct Worker {
+        Worker(Model& model, const Params& params, asio::io_context& ctx)
+            : instance(model, params.instanceParams)
+            , scheduler(instance, {.prefillChunk = params.prefillChunk})
+            , strand(asio::make_strand(ctx))
+        {}
+
+        Instance instance;
+        BatchScheduler scheduler;
+        asio::strand<asio::io_context::executor_type> strand;
+
+        uint32_t freeSessions = 0; // guarded by Impl::m_mutex
+        uint32_t preempting = 0; // tasks posted to preempt a generation, guarded by Impl::m_mutex
+        bool stepping = false; // only accessed on the strand
+    };
+
+    // all instances share the model and are created upfront
+    // they are reused between requests and never rebuilt
+    std::vector<std::unique_ptr<Worker>> m_workers;
+
+    std::shared_ptr<PrefixCache> m_prefixCache; // null if disabled
+    std::unique_ptr<SessionStore> m_sessionStore; // null if conversations are disabled
+    bool m_preemption;
+
+    // what we know about the parked session of a conversation
+    struct Conversation {
+        std::vector<ChatMsg> messages; // including the generated replies
+        std::vector<Token> tokens; // tokens in the context of the session
+    };
+
+    struct QueuedJob {
+        // either a generation to join a batch or a task
+        std::optional<BatchScheduler::Request> generation;
+        Task task;
+
+        SchedulingPolicy::Job job; // what the scheduling policy knows about it
+        std::shared_ptr<const std::atomic_bool> cancel; // null if it can't be cancelled
+
+        bool noPreemption = false; // a task which failed to preempt waits for a free session
+
+        uint32_t numSessions() const noexcept { return job.numSessions; }
+    };
+
+    mutable std::mutex m_mutex; // guards the members below
+    std::deque<QueuedJob> m_queue; // jobs waiting for a free session
+    std::shared_ptr<SchedulingPolicy> m_policy; // picks the next job from the queue
+    std::vector<const SchedulingPolicy::Job*> m_queuedJobs; // for the policy, reused between dispatches
+    uint64_t m_nextJobId = 0;
+    Params::QueueLimits m_queueLimits;
+    uint64_t m_recentQueueWaitUs = 0; // moving average of the queue wait of dispatched jobs
+
+    // drops queued jobs whose deadline has passed, set to expire at the earliest deadline in the queue
+    asio::steady_timer m_deadlineTimer;
+    clock::time_point m_deadlineTimerExpiry = clock::time_point::max();
+    std::unordered_map<std::string, Conversation> m_conversations; // conversations with a parked session
+    Stats m_stats;
+
     bstl::thread_runner m_runner;
 
-    Impl(std::shared_ptr<Model> model)
+    Impl(std::shared_ptr<Model> model, const Params& params)
         : m_model(std::move(model))
-        , m_instance(*m_model, {})
         , m_wg(make_work_guard(m_ioctx))
-        , m_runner(m_ioctx, 1)
+        , m_preemption(params.preemption)
+        , m_policy(params.schedulingPolicy ? params.schedulingPolicy : std::make_shared<FifoPolicy>())
+        , m_queueLimits(params.queueLimits)
+        , m_deadlineTimer(m_ioctx)
     {
-        m_instance.warmup();
+        if (params.prefixCache.maxBytes) {
+            m_prefixCache = std::make_shared<PrefixCache>(params.prefixCache);
+        }
+        if (params.sessionStore.maxRamBytes || params.sessionStore.maxDiskBytes) {
+            m_sessionStore = std::make_unique<SessionStore>(params.sessionStore);
+        }
+
+        const auto numInstances = std::max(params.numInstances, 1u);
+        m_workers.reserve(numInstances);
+        for (uint32_t i = 0; i < numInstances; ++i) {
+            auto& worker = m_workers.emplace_back(std::make_unique<Worker>(*m_model, params, m_ioctx));
+            worker->instance.warmup();
+            worker->instance.setPrefixCache(m_prefixCache);
+            worker->freeSessions = worker->instance.maxSessions();
+        }
+        m_stats.numInstances = numInstances;
+
+        // one thread per instance: a busy instance never blocks another
+        m_runner.start(m_ioctx, numInstances);
     }
 
     ~Impl() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_deadlineTimer.cancel();
+        }
         m_wg.reset();
     }
 
-    void completeText(CompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb) {
-        post(m_ioctx, [this, movecap(params, cb)] {
-            auto& session = m_instance.startSession({
-                .seed = params.seed,
-                .temperature = params.temperature,
-                .topP = params.topP
-                });
-            session.setInitialPrompt(m_model->vocab().tokenize(params.prompt, true, true));
-            auto iRes = session.complete({
-                .prompt = std::vector<bl::llama::Token>(),
-                .maxTokens = (int32_t)params.maxTokens
-                });
-
-            CompleteReponse response;
-            response.reserve(iRes.size());
-            for (const auto& token : iRes) {
-                auto& tokenData = response.emplace_back();
-                tokenData.tokenStr = m_model->vocab().tokenToString(token.token);
-                tokenData.tokenId = token.token;
-                tokenData.logits.reserve(token.logits.size());
-                for (const auto& logit : token.logits) {
-                    TokenData::LogitData logitData;
-                    logitData.tokenId = logit.token;
-                    logitData.logit = logit.logit;
-                    tokenData.logits.push_back({ (uint32_t)logit.token, logit.logit });
+    // hand queued jobs to the instances with the most free sessions in the order chosen by the scheduling policy
+    // a generation with multiple choices needs a session for each on the same instance
+    // with preemption tasks don't wait for the jobs ahead of them, see dispatchTasks
+    // must be called with m_mutex locked
+    void dispatch() {
+        while (!m_queue.empty()) {
+            m_queuedJobs.clear();
+            for (auto& q : m_queue) {
+                m_queuedJobs.push_back(&q.job);
+            }
+            const auto next = m_queue.begin() + ptrdiff_t(m_policy->next(m_queuedJobs));
+            const auto numSessions = next->numSessions();
+
+            Worker* worker = nullptr;
+            for (auto& w : m_workers) {
+                if (w->freeSessions >= numSessions && (!worker || w->freeSessions > worker->freeSessions)) {
+                    worker = w.get();
+                }
+            }
+            if (!worker) break;
+
+            auto qjob = std::move(*next);
+            m_queue.erase(next);
+            start(*worker, std::move(qjob));
+        }
+
+        if (m_preemption) {
+            dispatchTasks();
+        }
+    }
+
+    // tasks take a free session of any instance or preempt a generation on the one with the fewest pending preemptions
+    // must be called with m_mutex locked
+    void dispatchTasks() {
+        for (auto it = m_queue.begin(); it != m_queue.end(); ) {
+            if (it->generation || it->noPreemption) {
+                ++it;
+                continue;
+            }
+
+            auto qjob = std::move(*it);
+            it = m_queue.erase(it);
+
+            auto free = std::find_if(m_workers.begin(), m_workers.end(), [](auto& w) { return w->freeSessions > 0; });
+            if (free != m_workers.end()) {
+                start(**free, std::move(qjob));
+                continue;
+            }
+
+            auto worker = std::min_element(m_workers.begin(), m_workers.end(), [](auto& a, auto& b) {
+                return a->preempting < b->preempting;
+            })->get();
+            ++worker->preempting;
+            // the policy is told once the task runs (see preemptFor), as it's queued again if nothing is preempted
+            post(worker->strand, [this, worker, qjob = std::move(qjob)]() mutable {
+                preemptFor(*worker, std::move(qjob));
+            });
+        }
+    }
+
+    static bool isCancelled(const std::shared_ptr<const std::atomic_bool>& cancel) {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    static bool isExpired(const std::optional<clock::time_point>& deadline) {
+        return deadline && clock::now() >= *deadline;
+    }
+
+    // must be called with m_mutex locked
+    void recordStart(const QueuedJob& qjob) {
+        const auto waitUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - qjob.job.enqueueTime).count());
+        m_stats.totalQueueWaitUs += waitUs;
+        m_stats.maxQueueWaitUs = std::max(m_stats.maxQueueWaitUs, waitUs);
+        m_recentQueueWaitUs = (m_recentQueueWaitUs * 7 + waitUs) / 8;
+        ++m_stats.running;
+    }
+
+    // must be called with m_mutex locked
+    void start(Worker& worker, QueuedJob qjob) {
+        m_policy->dispatched(qjob.job);
+        worker.freeSessions -= qjob.numSessions();
+        recordStart(qjob);
+
+        if (qjob.generation) {
+            post(worker.strand, [this, &worker, req = std::move(*qjob.generation)]() mutable {
+                const auto numSessions = req.n;
+                if (worker.scheduler.admit(std::move(req))) {
+                    startStepping(worker);
                 }
+                else {
+                    // rejected and completed with the error
+                    release(worker, numSessions, 1);
+                }
+            });
+        }
+        else {
+            post(worker.strand, [this, &worker, task = std::move(qjob.task), cancel = std::move(qjob.cancel), deadline = qjob.job.deadline]() mutable {
+                runTask(task, isCancelled(cancel) || isExpired(deadline) ? nullptr : &worker.instance);
+                release(worker, 1, 1);
+            });
+        }
+    }
+
+    // anything which escapes a task (instead of going to its callback) is dropped,
+    // so that it doesn't take the worker down and the session it occupies is released
+    static void runTask(Task& task, Instance* instance) noexcept {
+        try {
+            task(instance);
+        }
+        catch (...) {
+        }
+    }
+
+    // on the worker strand
+    // the task borrows a session of a swapped out generation, which is swapped back in on the next step
+    // (the task is done by then as it runs on the strand), so the free sessions of the worker are not affected
+    void preemptFor(Worker& worker, QueuedJob qjob) {
+        const auto res = worker.scheduler.preempt(1);
+        {
+            std::lock_guard lock(m_mutex);
+            --worker.preempting;
+            m_stats.preemptions += res.swappedOut;
+            m_stats.swappedBytes += res.swappedBytes;
+            m_stats.totalSwapOutUs += res.swapOutUs;
+            m_stats.maxSwapOutUs = std::max(m_stats.maxSwapOutUs, res.swapOutUs);
+
+            if (!res.freed) {
+                // nothing to preempt, so wait for a free session at the front of the queue
+                qjob.noPreemption = true;
+                m_queue.push_front(std::move(qjob));
+                dispatch();
+                return;
+            }
+
+            m_policy->dispatched(qjob.job);
+            recordStart(qjob);
+        }
+
+        runTask(qjob.task, isCancelled(qjob.cancel) || isExpired(qjob.job.deadline) ? nullptr : &worker.instance);
+        release(worker, 0, 1);
+    }
+
+    void release(Worker& worker, uint32_t numSessions, uint32_t numRequests) {
+        std::lock_guard lock(m_mutex);
+        worker.freeSessions += numSessions;
+        m_stats.running -= numRequests;
+        m_stats.completed += numRequests;
+        dispatch();
+    }
+
+    // on the worker strand
+    void startStepping(Worker& worker) {
+        if (worker.stepping) return;
+        worker.stepping = true;
+        post(worker.strand, [this, &worker] { step(worker); });
+    }
+
+    // on the worker strand
+    // steps are posted one by one so that newly admitted generations can join the batch between them
+    void step(Worker& worker) {
+        auto res = worker.scheduler.step();
+        recordStep(res);
+        if (res.finished) {
+            release(worker, res.freedSessions, res.finished);
+        }
+
+        if (worker.scheduler.numActive()) {
+            post(worker.strand, [this, &worker] { step(worker); });
+        }
+        else {
+            worker.stepping = false;
+        }
+    }
+
+    void recordStep(const BatchScheduler::StepResult& res) {
+        if (res.promptTokens == 0 && res.generatedTokens == 0 && res.swappedIn == 0 && res.timedOut == 0) return;
+
+        std::lock_guard lock(m_mutex);
+        m_stats.timedOut += res.timedOut;
+        if (res.promptTokens) {
+            ++m_stats.prefillChunks;
+            m_stats.prefillTokens += res.promptTokens;
+            m_stats.totalPrefillChunkUs += res.durationUs;
+            m_stats.maxPrefillChunkUs = std::max(m_stats.maxPrefillChunkUs, res.durationUs);
+        }
+        else if (res.generatedTokens) {
+            ++m_stats.decodeSteps;
+            m_stats.totalDecodeStepUs += res.durationUs;
+            m_stats.maxDecodeStepUs = std::max(m_stats.maxDecodeStepUs, res.durationUs);
+        }
+
+        if (res.swappedIn) {
+            m_stats.swapIns += res.swappedIn;
+            m_stats.totalSwapInUs += res.swapInUs;
+            m_stats.maxSwapInUs = std::max(m_stats.maxSwapInUs, res.swapInUs);
+        }
+    }
+
+    // must be called with m_mutex locked
+    bool queueFull(SchedulingPolicy::JobClass jobClass) const {
+        if (m_queueLimits.maxQueued && m_queue.size() >= m_queueLimits.maxQueued) {
+            return true;
+        }
+
+        const auto classLimit = jobClass == SchedulingPolicy::JobClass::Verify
+            ? m_queueLimits.maxQueuedVerifications
+            : m_queueLimits.maxQueuedCompletions;
+        if (!classLimit) {
+            return false;
+        }
+        const auto numQueued = std::count_if(m_queue.begin(), m_queue.end(), [&](const QueuedJob& q) {
+            return q.job.jobClass == jobClass;
+        });
+        return size_t(numQueued) >= classLimit;
+    }
+
+    // deadlineMs is relative to now (0 = no deadline)
+    void enqueue(QueuedJob qjob, uint32_t deadlineMs) {
+        std::lock_guard lock(m_mutex);
+
+        if (queueFull(qjob.job.jobClass)) {
+            ++m_stats.rejected;
+            m_stats.rejectedVerifications += qjob.job.jobClass == SchedulingPolicy::JobClass::Verify;
+
+            // come back after about as long as the recent requests have waited
+            const auto retryAfter = std::clamp<uint64_t>((m_recentQueueWaitUs + 999'999) / 1'000'000, 1, 60);
+            throw QueueFullError("Server is busy, the request queue is full", std::chrono::seconds(retryAfter));
+        }
+
+        qjob.job.id = m_nextJobId++;
+        qjob.job.enqueueTime = clock::now();
+        if (deadlineMs) {
+            const auto deadline = qjob.job.enqueueTime + std::chrono::milliseconds(deadlineMs);
+            qjob.job.deadline = deadline;
+            if (qjob.generation) {
+                // the generation is stopped by the batch scheduler once it's running
+                qjob.generation->deadline = deadline;
             }
+            armDeadlineTimer(deadline);
+        }
+        m_queue.push_back(std::move(qjob));
+        dispatch();
+    }
 
-            cb(std::move(response));
+    // must be called with m_mutex locked
+    void armDeadlineTimer(clock::time_point deadline) {
+        if (deadline >= m_deadlineTimerExpiry) return;
 
-            m_instance.stopSession();
+        m_deadlineTimerExpiry = deadline;
+        m_deadlineTimer.expires_at(deadline);
+        m_deadlineTimer.async_wait([this](boost::system::error_code ec) {
+            if (ec) return; // cancelled by a new expiry or on destruction
+            dropExpired();
         });
     }
 
-    void chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb) {
-        post(m_ioctx, [this, movecap(params, cb)] {
-            auto& session = m_instance.startSession({
+    void dropExpired() {
+        std::vector<QueuedJob> dropped;
+        {
+            std::lock_guard lock(m_mutex);
+            m_deadlineTimerExpiry = clock::time_point::max();
+
+            const auto now = clock::now();
+            std::optional<clock::time_point> next;
+            for (auto it = m_queue.begin(); it != m_queue.end(); ) {
+                if (it->job.deadline && *it->job.deadline <= now) {
+                    dropped.push_back(std::move(*it));
+                    it = m_queue.erase(it);
+                    continue;
+                }
+                if (it->job.deadline && (!next || *it->job.deadline < *next)) {
+                    next = it->job.deadline;
+                }
+                ++it;
+            }
+            m_stats.timedOutQueued += dropped.size();
+
+            if (next) {
+                armDeadlineTimer(*next);
+            }
+            dispatch();
+        }
+
+        for (auto& qjob : dropped) {
+            drop(qjob, BatchScheduler::Outcome::TimedOut);
+        }
+    }
+
+    // complete the callbacks of a job which was removed from the queue
+    // must be called without the lock, as the callbacks may make new requests
+    static void drop(QueuedJob& qjob, BatchScheduler::Outcome outcome) {
+        if (qjob.generation) {
+            qjob.generation->cb(std::vector<std::vector<TokenPrediction>>(qjob.generation->n), outcome, nullptr);
+        }
+        else {
+            qjob.task(nullptr);
+        }
+    }
+
+    void schedule(BatchScheduler::Request generation, uint32_t deadlineMs) {
+        const auto numPromptTokens = uint32_t(generation.prompt.size());
+        schedule(std::move(generation), numPromptTokens, deadlineMs);
+    }
+
+    // numPromptTokens: the number of prompt tokens the generation decodes
+    void schedule(BatchScheduler::Request generation, uint32_t numPromptTokens, uint32_t deadlineMs) {
+        // all instances have the same number of sessions
+        const auto maxSessions = m_workers.front()->instance.maxSessions();
+        if (generation.n == 0 || generation.n > maxSessions) {
+            throw_ex{} << "Number of choices must be between 1 and " << maxSessions << ", got " << generation.n;
+        }
+
+        SchedulingPolicy::Job job = {
+            .jobClass = SchedulingPolicy::JobClass::Complete,
+            .numSessions = generation.n,
+            .promptTokens = numPromptTokens,
+            .maxTokens = generation.maxTokens,
+        };
+        auto cancel = generation.cancel;
+        enqueue({.generation = std::move(generation), .job = job, .cancel = std::move(cancel)}, deadlineMs);
+    }
+
+    // numTokens: the number of tokens the task decodes
+    void schedule(Task task, uint32_t numTokens, uint32_t deadlineMs, CancelFlag cancel) {
+        SchedulingPolicy::Job job = {
+            .jobClass = SchedulingPolicy::JobClass::Verify,
+            .promptTokens = numTokens,
+        };
+        enqueue({.task = std::move(task), .job = job, .cancel = std::move(cancel)}, deadlineMs);
+    }
+
+    // queued jobs are dropped here, running ones stop on their own
+    void cancel(const CancelFlag& flag) {
+        if (!flag) return;
+        flag->store(true);
+
+        std::vector<QueuedJob> dropped;
+        {
+            std::lock_guard lock(m_mutex);
+            for (auto it = m_queue.begin(); it != m_queue.end(); ) {
+                if (it->cancel == flag) {
+                    dropped.push_back(std::move(*it));
+                    it = m_queue.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            m_stats.cancelledQueued += dropped.size();
+
+            // a dropped job may have been blocking the ones after it
+            dispatch();
+        }
+
+        for (auto& qjob : dropped) {
+            drop(qjob, BatchScheduler::Outcome::Cancelled);
+        }
+    }
+
+    Stats stats() const {
+        std::lock_guard lock(m_mutex);
+        Stats ret = m_stats;
+        ret.queued = uint32_t(m_queue.size());
+        const auto now = clock::now();
+        for (auto& q : m_queue) {
+            ret.queuedVerifications += q.job.jobClass == SchedulingPolicy::JobClass::Verify;
+            const auto waitUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now - q.job.enqueueTime).count());
+            ret.oldestQueuedUs = std::max(ret.oldestQueuedUs, waitUs);
+        }
+        for (auto& w : m_workers) {
+            ret.freeSessions += w->freeSessions;
+            ret.idleInstances += w->freeSessions == w->instance.maxSessions();
+        }
+        if (m_prefixCache) {
+            ret.prefixCache = m_prefixCache->stats();
+        }
+        if (m_sessionStore) {
+            ret.sessionStore = m_sessionStore->stats();
+        }
+        return ret;
+    }
+
+    llama::ChatFormat chatFormat() {
+        return llama::ChatFormat(llama::ChatFormat::getChatParams(*m_model));
+    }
+
+    static std::vector<ChatMsg> toChatMsgs(const std::vector<ChatCompleteRequestParams::Message>& messages) {
+        std::vector<ChatMsg> chatMsgs;
+        chatMsgs.reserve(messages.size());
+        for (const auto& message : messages) {
+            chatMsgs.push_back({
+                .role = message.role,
+                .text = message.content
+            });
+        }
+        return chatMsgs;
+    }
+
+    std::vector<Token> tokenizeChat(std::span<const ChatMsg> chatMsgs) {
+        auto fmt = chatFormat().formatChat(chatMsgs, true);
+        return m_model->vocab().tokenize(fmt, true, true);
+    }
+
+    std::vector<Token> tokenizeChat(const std::vector<ChatCompleteRequestParams::Message>& messages) {
+        return tokenizeChat(toChatMsgs(messages));
+    }
+
+    TokenData toTokenData(const TokenPrediction& token) {
+        TokenData tokenData;
+        tokenData.tokenStr = m_model->vocab().tokenToString(token.token);
+        tokenData.tokenId = token.token;
+        tokenData.logits.reserve(token.logits.size());
+        for (const auto& logit : token.logits) {
+            tokenData.logits.push_back({ (uint32_t)logit.token, logit.logit });
+        }
+        return tokenData;
+    }
+
+    static FinishReason toFinishReason(BatchScheduler::Outcome outcome, size_t numTokens, uint32_t maxTokens) {
+        switch (outcome) {
+        case BatchScheduler::Outcome::TimedOut: return FinishReason::Timeout;
+        case BatchScheduler::Outcome::Cancelled: return FinishReason::Cancelled;
+        default: return numTokens >= maxTokens ? FinishReason::Length : FinishReason::Stop;
+        }
+    }
+
+    // the errors of rejected generations are passed as they are and the ones of failed generations are inference errors
+    static std::exception_ptr toError(BatchScheduler::Outcome outcome, std::exception_ptr error) {
+        if (outcome != BatchScheduler::Outcome::Failed || !error) {
+            return error;
+        }
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception& e) {
+            return std::make_exception_ptr(InferenceError(e.what()));
+        }
+        catch (...) {
+            return std::make_exception_ptr(InferenceError("Inference failed"));
+        }
+    }
+
+    CompleteReponse toResponse(const std::vector<TokenPrediction>& predictions, BatchScheduler::Outcome outcome, uint32_t maxTokens) {
+        CompleteReponse response;
+        response.reserve(predictions.size());
+        for (const auto& token : predictions) {
+            response.push_back(toTokenData(token));
+        }
+        response.finishReason = toFinishReason(outcome, predictions.size(), maxTokens);
+        return response;
+    }
+
+    static std::vector<TokenPrediction> toPredictions(const CompleteReponse& resp) {
+        std::vector<TokenPrediction> predictions;
+        predictions.reserve(resp.size());
+        for (const auto& token : resp) {
+            auto& tokenPrediction = predictions.emplace_back();
+            tokenPrediction.token = token.tokenId;
+            tokenPrediction.logits.reserve(token.logits.size());
+            for (const auto& logit : token.logits) {
+                tokenPrediction.logits.push_back({ (int32_t)logit.tokenId, logit.logit });
+            }
+        }
+        return predictions;
+    }
+
+    // the fields common to complete and chat complete requests
+    template <typename Params>
+    static BatchScheduler::Request makeRequest(std::vector<Token> prompt, const Params& params) {
+        // checked here as well, so that the request is rejected before it's queued
+        if (params.topLogits > Session::MaxTopLogits) {
+            throw_ex{} << "Too many top logits: " << params.topLogits << ", max: " << Session::MaxTopLogits;
+        }
+        return {
+            .prompt = std::move(prompt),
+            .sessionParams = {
                 .seed = params.seed,
                 .temperature = params.temperature,
                 .topP = params.topP
-                });
+            },
+            .maxTokens = params.maxTokens,
+            .topLogits = params.topLogits,
+            .n = params.n,
+            .cancel = params.cancel,
+        };
+    }
+
+    static void checkSingleChoice(uint32_t n) {
+        if (n != 1) {
+            throw_ex{} << "Multiple choices (n = " << n << ") are not supported by this request";
+        }
+    }
+
+    // a turn of a conversation
+    // the conversation is updated once the reply is generated and the session is parked
+    struct ConversationTurn {
+        std::string id;
+        Conversation conversation;
+        std::optional<Conversation> prev; // the conversation the turn took, until the turn takes over its session
+        std::string reply;
+        bool parked = false;
+        uint32_t numPromptTokens = 0; // estimate of the prompt tokens the turn decodes (for the scheduling policy)
+    };
+
+    // number of tokens in the context which the chat can reuse: the ones up to the first different token
+    static size_t numReusable(std::span<const Token> tokens, std::span<const Token> full) {
+        auto common = size_t(std::mismatch(tokens.begin(), tokens.end(), full.begin(), full.end()).first - tokens.begin());
+        return std::min(common, full.size() - 1); // the last token is always fed, so that there is something to sample from
+    }
+
+    // continue a restored session with the tokens of the whole chat, reusing the context up to the first different token
+    static void continueChat(Session& session, std::span<const Token> full) {
+        const auto common = numReusable(session.tokens(), full);
+        session.rewind(uint32_t(common));
+        session.queuePrompt(std::span(full).subspan(common));
+    }
+
+    // the request for a chat
+    // with a conversation id, the session of the conversation is restored from the store and parked again afterwards
+    BatchScheduler::Request makeChatRequest(const ChatCompleteRequestParams& params, std::shared_ptr<ConversationTurn>& turn) {
+        if (params.conversationId.empty()) {
+            return makeRequest(tokenizeChat(params.messages), params);
+        }
 
-            auto modelChatParams = llama::ChatFormat::getChatParams(*m_model);
-            auto chatFormat = llama::ChatFormat(modelChatParams);
+        if (!m_sessionStore) {
+            throw_ex{} << "Conversations are disabled";
+        }
+        checkSingleChoice(params.n);
 
-            std::vector<ChatMsg> chatMsgs;
-            for (const auto& message : params.messages) {
-                chatMsgs.push_back({
-                    .role = message.role,
-                    .text = message.content
-                });
+        turn = std::make_shared<ConversationTurn>();
+        turn->id = params.conversationId;
+        turn->conversation.messages = toChatMsgs(params.messages);
+        auto& messages = turn->conversation.messages;
+
+        // concurrent turns of the same conversation don't find it and start over
+        // a turn which doesn't start gives it back (see returnConversation)
+        {
+            std::lock_guard lock(m_mutex);
+            if (auto it = m_conversations.find(turn->id); it != m_conversations.end()) {
+                turn->prev = std::move(it->second);
+                m_conversations.erase(it);
             }
-            auto fmt = chatFormat.formatChat(chatMsgs, true);
-            std::vector<Token> promptTokens = m_model->vocab().tokenize(fmt, true, true);
-            session.setInitialPrompt(promptTokens);
+        }
 
-            auto iRes = session.complete({
-                .prompt = {},
-                .maxTokens = (int32_t)params.maxTokens
-            });
+        auto onFinish = [this, turn](Session& session) {
+            try {
+                turn->parked = m_sessionStore->park(turn->id, session);
+            }
+            catch (const std::exception&) {
+                turn->parked = false; // the next turn starts over
+            }
+            if (turn->parked) {
+                auto tokens = session.tokens();
+                turn->conversation.tokens.assign(tokens.begin(), tokens.end());
+            }
+        };
 
-            CompleteReponse response;
-            response.reserve(iRes.size());
-            for (const auto& token : iRes) {
-                auto& tokenData = response.emplace_back();
-                tokenData.tokenStr = m_model->vocab().tokenToString(token.token);
-                tokenData.tokenId = token.token;
-                tokenData.logits.reserve(token.logits.size());
-                for (const auto& logit : token.logits) {
-                    TokenData::LogitData logitData;
-                    logitData.tokenId = logit.token;
-                    logitData.logit = logit.logit;
-                    tokenData.logits.push_back({ (uint32_t)logit.token, logit.logit });
-                }
+        auto full = tokenizeChat(messages);
+        if (!turn->prev) {
+            m_sessionStore->erase(turn->id);
+            turn->numPromptTokens = uint32_t(full.size());
+            auto req = makeRequest(std::move(full), params);
+            req.onFinish = std::move(onFinish);
+            return req;
+        }
+
+        // the parked session is expected to have the tokens it had when it was parked
+        turn->numPromptTokens = uint32_t(full.size() - numReusable(turn->prev->tokens, full));
+
+        // the usual case is that the client sent the previous messages (including our reply) again followed by new ones
+        // the whole chat is tokenized, as the template adds text after our reply (like the end of the turn) which
+        // isn't in the context, and the restored session only decodes what follows the tokens it has in common with it
+        auto req = makeRequest({}, params);
+        const Sampler::Params samplerParams = {
+            .rngSeed = req.sessionParams.seed,
+            .topP = req.sessionParams.topP,
+            .temp = req.sessionParams.temperature,
+        };
+        req.setup = [this, turn, full = std::move(full), samplerParams](Session& session) {
+            // from now on the conversation continues with this turn, even if it fails
+            turn->prev.reset();
+
+            bool restored = false;
+            try {
+                restored = m_sessionStore->restore(turn->id, session);
+            }
+            catch (const std::exception&) {
+                // a broken snapshot is as good as a missing one (failed restores leave the session untouched)
+            }
+
+            if (!restored) {
+                session.queueInitialPrompt(full);
+                return;
             }
 
-            cb(std::move(response));
+            // the snapshot has the sampler of the previous turn
+            session.resetSampler(samplerParams);
+            continueChat(session, full);
+        };
+        req.onFinish = std::move(onFinish);
+        return req;
+    }
 
-            m_instance.stopSession();
-        });
+    // conversation turns are scheduled by the number of tokens they are expected to decode, as their prompt is
+    // queued by the setup of the request
+    void scheduleChat(BatchScheduler::Request generation, const std::shared_ptr<ConversationTurn>& turn, uint32_t deadlineMs) {
+        const auto numPromptTokens = turn ? turn->numPromptTokens : uint32_t(generation.prompt.size());
+        try {
+            schedule(std::move(generation), numPromptTokens, deadlineMs);
+        }
+        catch (...) {
+            // for example the queue is full
+            if (turn) {
+                returnConversation(*turn);
+            }
+            throw;
+        }
+    }
+
+    // a turn which didn't start (it was rejected, or dropped from the queue) gives back the conversation it took,
+    // so that the next turn still continues its parked session
+    // unless a newer turn has finished in the meantime
+    void returnConversation(ConversationTurn& turn) {
+        if (!turn.prev) {
+            return;
+        }
+
+        std::lock_guard lock(m_mutex);
+        m_conversations.try_emplace(turn.id, std::move(*turn.prev));
+        turn.prev.reset();
+    }
+
+    // called when a turn is done, however it ended
+    void finishTurn(ConversationTurn& turn) {
+        returnConversation(turn);
+        if (!turn.parked) {
+            return;
+        }
+
+        turn.conversation.messages.push_back({.role = "assistant", .text = std::move(turn.reply)});
+
+        std::lock_guard lock(m_mutex);
+        m_conversations[turn.id] = std::move(turn.conversation);
+
+        // drop the conversations whose sessions were evicted from the store (every now and then)
+        const auto storeStats = m_sessionStore->stats();
+        if (m_conversations.size() > 2 * (storeStats.ramEntries + storeStats.diskEntries) + 16) {
+            std::erase_if(m_conversations, [this](const auto& c) {
+                return !m_sessionStore->contains(c.first);
+            });
+        }
     }
 
-    void verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb) {
-        post(m_ioctx, [this, movecap(req, resp, cb)] {
-            auto& session = m_instance.startSession({
-                .seed = req.seed,
-                .temperature = req.temperature,
-                .topP = req.topP
-                });
-
-            session.setInitialPrompt(m_model->vocab().tokenize(req.prompt, true, true));
-            std::vector<TokenPrediction> origPredictions;
-            origPredictions.reserve(resp.size());
-            for (const auto& token : resp) {
-                auto& tokenPrediction = origPredictions.emplace_back();
-                tokenPrediction.token = token.tokenId;
-                tokenPrediction.logits.reserve(token.logits.size());
-                for (const auto& logit : token.logits) {
-                    TokenData::LogitData logitData;
-                    logitData.tokenId = logit.tokenId;
-                    logitData.logit = logit.logit;
-                    tokenPrediction.logits.push_back({ (int32_t)logit.tokenId, logit.logit });
+    std::string toText(const std::vector<TokenPrediction>& predictions) {
+        std::string text;
+        for (auto& p : predictions) {
+            text += m_model->vocab().tokenToString(p.token);
+        }
+        return text;
+    }
+
+    void completeText(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb) {
+        checkSingleChoice(params.n);
+        auto req = makeRequest(m_model->vocab().tokenize(params.prompt, true, true), params);
+        req.cb = [this, maxTokens = params.maxTokens, movecap(cb)](std::vector<std::vector<TokenPrediction>> iRes, BatchScheduler::Outcome outcome, std::exception_ptr error) {
+            if (error) {
+                cb(toError(outcome, std::move(error)), {});
+                return;
+            }
+            cb(nullptr, toResponse(iRes.front(), outcome, maxTokens));
+        };
+        schedule(std::move(req), params.deadlineMs);
+    }
+
+    void chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb) {
+        checkSingleChoice(params.n);
+        std::shared_ptr<ConversationTurn> turn;
+        auto req = makeChatRequest(params, turn);
+        req.cb = [this, turn, maxTokens = params.maxTokens, movecap(cb)](std::vector<std::vector<TokenPrediction>> iRes, BatchScheduler::Outcome outcome, std::exception_ptr error) {
+            if (error) {
+                // the session of a failed turn is not parked, so the conversation starts over (if the turn started)
+                if (turn) {
+                    finishTurn(*turn);
                 }
+                cb(toError(outcome, std::move(error)), {});
+                return;
+            }
+            if (turn) {
+                turn->reply = toText(iRes.front());
+                finishTurn(*turn);
             }
-            auto verifierPredictions = session.fillCtx(origPredictions);
+            cb(nullptr, toResponse(iRes.front(), outcome, maxTokens));
+        };
+        scheduleChat(std::move(req), turn, params.deadlineMs);
+    }
 
-            bl::llama::MetricsAggregator metricsAgg;
-            float score = 0;
-            for (size_t i = 0; i < origPredictions.size(); i++) {
-                auto m = bl::llama::LogitComparer::compare(origPredictions[i].logits, verifierPredictions[i].logits);
-                score = metricsAgg.pushAndVerify({ &m, 1 });
+    using GenerationCb = itlib::ufunction<void(std::vector<std::vector<TokenPrediction>>, BatchScheduler::Outcome, std::exception_ptr)>;
+
+    GenerationCb makeChoicesCb(uint32_t maxTokens, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb) {
+        return [this, maxTokens, movecap(cb)](std::vector<std::vector<TokenPrediction>> iRes, BatchScheduler::Outcome outcome, std::exception_ptr error) {
+            if (error) {
+                cb(toError(outcome, std::move(error)), {});
+                return;
+            }
+            std::vector<CompleteReponse> choices;
+            choices.reserve(iRes.size());
+            for (auto& predictions : iRes) {
+                choices.push_back(toResponse(predictions, outcome, maxTokens));
             }
-            cb(score);
+            cb(nullptr, std::move(choices));
+        };
+    }
 
-            m_instance.stopSession();
-        });
+    void completeTextChoices(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb) {
+        auto req = makeRequest(m_model->vocab().tokenize(params.prompt, true, true), params);
+        req.cb = makeChoicesCb(params.maxTokens, std::move(cb));
+        schedule(std::move(req), params.deadlineMs);
     }
 
-    void chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb) {
-        post(m_ioctx, [this, movecap(req, resp, cb)] {
-            auto& session = m_instance.startSession({
-                .seed = req.seed,
-                .temperature = req.temperature,
-                .topP = req.topP
-                });
-
-            auto modelChatParams = llama::ChatFormat::getChatParams(*m_model);
-            auto chatFormat = llama::ChatFormat(modelChatParams);
-
-            std::vector<ChatMsg> chatMsgs;
-            for (const auto& message : req.messages) {
-                chatMsgs.push_back({
-                    .role = message.role,
-                    .text = message.content
-                });
-            }
-            auto fmt = chatFormat.formatChat(chatMsgs, true);
-            std::vector<Token> promptTokens = m_model->vocab().tokenize(fmt, true, true);
-            session.setInitialPrompt(promptTokens);
-
-            std::vector<TokenPrediction> origPredictions;
-            origPredictions.reserve(resp.size());
-            for (const auto& token : resp) {
-                auto& tokenPrediction = origPredictions.emplace_back();
-                tokenPrediction.token = token.tokenId;
-                tokenPrediction.logits.reserve(token.logits.size());
-                for (const auto& logit : token.logits) {
-                    TokenData::LogitData logitData;
-                    logitData.tokenId = logit.tokenId;
-                    logitData.logit = logit.logit;
-                    tokenPrediction.logits.push_back({ (int32_t)logit.tokenId, logit.logit });
+    void chatCompleteChoices(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb) {
+        std::shared_ptr<ConversationTurn> turn;
+        auto req = makeChatRequest(params, turn);
+        req.cb = [this, turn, choicesCb = makeChoicesCb(params.maxTokens, std::move(cb))](std::vector<std::vector<TokenPrediction>> iRes, BatchScheduler::Outcome outcome, std::exception_ptr error) mutable {
+            if (turn) {
+                if (!error) {
+                    turn->reply = toText(iRes.front());
                 }
+                finishTurn(*turn);
+            }
+            choicesCb(std::move(iRes), outcome, std::move(error));
+        };
+        scheduleChat(std::move(req), turn, params.deadlineMs);
+    }
+
+    void setStreamCallbacks(BatchScheduler::Request& req, StreamCallbacks cbs) {
+        // the tokens are not accumulated, so they are counted for the finish reason
+        auto numTokens = std::make_shared<size_t>(0);
+        req.cb = [numTokens, maxTokens = req.maxTokens, onDone = std::move(cbs.onDone)](std::vector<std::vector<TokenPrediction>>, BatchScheduler::Outcome outcome, std::exception_ptr error) {
+            onDone(toError(outcome, std::move(error)), toFinishReason(outcome, *numTokens, maxTokens));
+        };
+        req.onToken = [this, numTokens, onToken = std::move(cbs.onToken)](TokenPrediction p) {
+            ++*numTokens;
+            onToken(toTokenData(p));
+        };
+    }
+
+    void completeTextStream(CompleteRequestParams params, StreamCallbacks cbs) {
+        checkSingleChoice(params.n);
+        auto req = makeRequest(m_model->vocab().tokenize(params.prompt, true, true), params);
+        setStreamCallbacks(req, std::move(cbs));
+        schedule(std::move(req), params.deadlineMs);
+    }
+
+    void chatCompleteStream(ChatCompleteRequestParams params, StreamCallbacks cbs) {
+        checkSingleChoice(params.n);
+        std::shared_ptr<ConversationTurn> turn;
+        auto req = makeChatRequest(params, turn);
+        if (turn) {
+            // the reply is collected from the streamed tokens
+            cbs.onToken = [turn, onToken = std::move(cbs.onToken)](TokenData token) {
+                turn->reply += token.tokenStr;
+                onToken(std::move(token));
+            };
+            cbs.onDone = [this, turn, onDone = std::move(cbs.onDone)](std::exception_ptr error, FinishReason reason) {
+                finishTurn(*turn);
+                onDone(std::move(error), reason);
+            };
+        }
+        setStreamCallbacks(req, std::move(cbs));
+        scheduleChat(std::move(req), turn, params.deadlineMs);
+    }
+
+    float verifyPredictions(Session& session, const CompleteReponse& resp) {
+        auto origPredictions = toPredictions(resp);
+        auto verifierPredictions = session.fillCtx(origPredictions);
+
+        bl::llama::MetricsAggregator metricsAgg;
+        metricsAgg.push(bl::llama::LogitComparer::compare(origPredictions, verifierPredictions));
+        return metricsAgg.score();
+    }
+
+    // the errors of the prompt are passed as they are and the ones of filling the context with the response are
+    // inference errors
+    float runVerification(Instance& instance, const Session::InitParams& params, std::span<const Token> prompt, const CompleteReponse& resp) {
+        auto& session = instance.startSession(params);
+        float score;
+        try {
+            session.setInitialPrompt(prompt);
+            try {
+                score = verifyPredictions(session, resp);
             }
-            auto verifierPredictions = session.fillCtx(origPredictions);
+            catch (const std::exception& e) {
+                throw InferenceError(e.what());
+            }
+        }
+        catch (...) {
+            instance.stopSession(session);
+            throw;
+        }
+        instance.stopSession(session);
+        return score;
+    }
 
-            bl::llama::MetricsAggregator metricsAgg;
-            float score = 0;
-            for (size_t i = 0; i < origPredictions.size(); i++) {
-                auto m = bl::llama::LogitComparer::compare(origPredictions[i].logits, verifierPredictions[i].logits);
-                score = metricsAgg.pushAndVerify({ &m, 1 });
+    template <typename Params>
+    void scheduleVerification(Params req, std::vector<Token> tokens, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb) {
+        const auto numTokens = uint32_t(tokens.size() + resp.size());
+        const auto deadlineMs = req.deadlineMs;
+        auto cancel = req.cancel;
+        const Session::InitParams sessionParams = {
+            .seed = req.seed,
+            .temperature = req.temperature,
+            .topP = req.topP
+        };
+        schedule(Task([this, sessionParams, movecap(resp, cb, tokens)](Instance* instance) {
+            if (!instance) {
+                cb(nullptr, std::numeric_limits<float>::quiet_NaN());
+                return;
             }
-            cb(score);
 
-            m_instance.stopSession();
-        });
+            std::exception_ptr error;
+            float score = std::numeric_limits<float>::quiet_NaN();
+            try {
+                score = runVerification(*instance, sessionParams, tokens, resp);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            cb(std::move(error), score);
+        }), numTokens, deadlineMs, std::move(cancel));
+    }
+
+    void verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb) {
+        auto tokens = m_model->vocab().tokenize(req.prompt, true, true);
+        scheduleVerification(std::move(req), std::move(tokens), std::move(resp), std::move(cb));
+    }
+
+    void chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb) {
+        auto tokens = tokenizeChat(req.messages);
+        scheduleVerification(std::move(req), std::move(tokens), std::move(resp), std::move(cb));
     }
 };
 
+Server::QueueFullError::QueueFullError(const std::string& what, std::chrono::seconds retryAfter)
+    : std::runtime_error(what)
+    , m_retryAfter(retryAfter)
+{}
+
+Server::QueueFullError::~QueueFullError() = default;
+
+Server::InferenceError::InferenceError(const std::string& what)
+    : std::runtime_error(what)
+{}
+
+Server::InferenceError::~InferenceError() = default;
+
 Server::Server(std::shared_ptr<Model> model)
-    : m_impl(std::make_unique<Impl>(std::move(model)))
+    : Server(std::move(model), Params{})
+{}
+
+Server::Server(std::shared_ptr<Model> model, Params params)
+    : m_impl(std::make_unique<Impl>(std::move(model), params))
 {}
 
-void Server::completeText(CompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb) {
+void Server::completeText(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb) {
     m_impl->completeText(std::move(params), std::move(cb));
 }
 
-void Server::verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb) {
+void Server::completeTextChoices(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb) {
+    m_impl->completeTextChoices(std::move(params), std::move(cb));
+}
+
+void Server::chatCompleteChoices(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb) {
+    m_impl->chatCompleteChoices(std::move(params), std::move(cb));
+}
+
+void Server::verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb) {
     m_impl->verify(std::move(req), std::move(resp), std::move(cb));
 }
 
-void Server::chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb) {
+void Server::chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb) {
     m_impl->chatComplete(std::move(params), std::move(cb));
 }
 
-void Server::chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb) {
+void Server::completeTextStream(CompleteRequestParams params, StreamCallbacks cbs) {
+    m_impl->completeTextStream(std::move(params), std::move(cbs));
+}
+
+void Server::chatCompleteStream(ChatCompleteRequestParams params, StreamCallbacks cbs) {
+    m_impl->chatCompleteStream(std::move(params), std::move(cbs));
+}
+
+void Server::chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb) {
     m_impl->chatVerify(std::move(req), std::move(resp), std::move(cb));
 }
 
+void Server::cancel(const CancelFlag& flag) {
+    m_impl->cancel(flag);
+}
+
+Server::Stats Server::stats() const {
+    return m_impl->stats();
+}
+
 Server::~Server() = default;
 
 } // namespace bl::llama::server
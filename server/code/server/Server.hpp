@@ -3,7 +3,15 @@
 //
 #pragma once
 #include "api.h"
+#include "SessionStore.hpp"
+#include "SchedulingPolicy.hpp"
+#include <llama/Instance.hpp>
+#include <llama/PrefixCache.hpp>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <itlib/ufunction.hpp>
@@ -16,12 +24,80 @@ namespace server {
 
 class BL_LLAMA_SERVER_API Server {
 public:
-    Server(std::shared_ptr<Model> model);
+    struct Params {
+        // number of inference instances (llama contexts) sharing the model
+        // requests are dispatched to the instance with the most free sessions
+        uint32_t numInstances = 1;
+
+        // params for each instance in the pool
+        // instanceParams.maxSessions is the number of requests an instance serves in parallel
+        // generations on the same instance are decoded together with continuous batching
+        // note that sessions share the context, so ctxSize should be scaled accordingly
+        Instance::InitParams instanceParams = {};
+
+        // max number of prompt tokens decoded in a batch step (0 = instanceParams.ubatchSize)
+        // long prompts are processed in chunks of this size interleaved with the steps of generating requests,
+        // which bounds the time between their tokens
+        uint32_t prefillChunk = 0;
+
+        // verifications don't wait behind queued generations and, if no instance has a free session,
+        // preempt a generating request: its session is snapshotted to memory and restored once the verification is
+        // done, after which it continues with the same output it would have had otherwise
+        bool preemption = false;
+
+        // decides the order in which queued requests are dispatched to the instances (null = FifoPolicy)
+        std::shared_ptr<SchedulingPolicy> schedulingPolicy;
+
+        // requests which don't fit in the queue (of requests waiting for a session) are rejected with QueueFullError
+        // instead of waiting, so that a saturated server fails fast (0 = no limit)
+        struct QueueLimits {
+            uint32_t maxQueued = 0; // all requests
+            uint32_t maxQueuedCompletions = 0; // generations: completions and chats
+            uint32_t maxQueuedVerifications = 0;
+        };
+        QueueLimits queueLimits = {};
+
+        // KV states of prompt prefixes (like long system prompts) are cached and shared by all instances
+        // so that requests only decode their prompt after the first token which differs from a cached one
+        // the cache is disabled if prefixCache.maxBytes is 0
+        PrefixCache::Params prefixCache = {.maxBytes = 0};
+
+        // sessions of conversations (see ChatCompleteRequestParams::conversationId) are parked here between turns
+        // conversations are disabled if both maxRamBytes and maxDiskBytes are 0
+        SessionStore::Params sessionStore = {.maxRamBytes = 0};
+    };
+
+    explicit Server(std::shared_ptr<Model> model);
+    Server(std::shared_ptr<Model> model, Params params);
     ~Server();
 
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
+    // thrown by the request functions when the queue is full (see Params::queueLimits)
+    class BL_LLAMA_SERVER_API QueueFullError : public std::runtime_error {
+    public:
+        QueueFullError(const std::string& what, std::chrono::seconds retryAfter);
+        ~QueueFullError();
+
+        // estimate of when the queue will have room, based on the recent waits in it
+        std::chrono::seconds retryAfter() const noexcept { return m_retryAfter; }
+
+    private:
+        std::chrono::seconds m_retryAfter;
+    };
+
+    // passed to the callback of a request which failed because of inference (like a failed decode) rather than
+    // because of the request itself (like a prompt which doesn't fit in the context)
+    class BL_LLAMA_SERVER_API InferenceError : public std::runtime_error {
+    public:
+        explicit InferenceError(const std::string& what);
+        ~InferenceError();
+    };
+
+    // a request made with a flag can be cancelled with it (see cancel)
+    using CancelFlag = std::shared_ptr<std::atomic_bool>;
+
     struct CompleteRequestParams {
         std::string prompt;
         uint32_t maxTokens = 0;
@@ -29,6 +105,20 @@ public:
         std::string suffix;
         float temperature = 0.8f;
         float topP = 0.95f;
+        uint32_t topLogits = 10; // number of top logits returned with each token (up to Session::MaxTopLogits)
+
+        // number of completions of the prompt (see completeTextChoices)
+        // choice i is sampled with seed + i
+        uint32_t n = 1;
+
+        // optional: milliseconds from the call in which the request must be done (0 = none)
+        // a request which is still queued by then is dropped and a running one stops at the next token,
+        // either way it ends with FinishReason::Timeout and the tokens generated so far
+        // EarliestDeadlineFirstPolicy dispatches the requests in the order of their deadlines
+        uint32_t deadlineMs = 0;
+
+        // optional: flag for cancelling the request
+        CancelFlag cancel;
     };
 
     struct ChatCompleteRequestParams {
@@ -41,6 +131,27 @@ public:
         uint32_t seed = 0;
         float temperature = 0.8f;
         float topP = 0.95f;
+        uint32_t topLogits = 10; // number of top logits returned with each token (up to Session::MaxTopLogits)
+
+        // number of completions of the prompt (see completeTextChoices)
+        // choice i is sampled with seed + i
+        uint32_t n = 1;
+
+        // optional: milliseconds from the call in which the request must be done (0 = none)
+        // a request which is still queued by then is dropped and a running one stops at the next token,
+        // either way it ends with FinishReason::Timeout and the tokens generated so far
+        // EarliestDeadlineFirstPolicy dispatches the requests in the order of their deadlines
+        uint32_t deadlineMs = 0;
+
+        // optional: flag for cancelling the request
+        CancelFlag cancel;
+
+        // optional: id of a conversation (chosen by the client) which the messages continue
+        // the session of a conversation is parked in the session store after each turn, so the next turn only
+        // decodes the new messages instead of the whole chat
+        // if the messages differ from the previous turn, the context is reused up to the first different token
+        // only supported with a single choice
+        std::string conversationId;
     };
 
     struct TokenData {
@@ -53,15 +164,101 @@ public:
         std::vector<LogitData> logits;
     };
 
-    using CompleteReponse = std::vector<TokenData>;
+    enum class FinishReason {
+        Stop, // the model ended the generation
+        Length, // maxTokens were generated
+        Timeout, // the deadline passed (see CompleteRequestParams::deadlineMs)
+        Cancelled, // see cancel
+    };
+
+    // the generated tokens and why the generation ended
+    struct CompleteReponse : public std::vector<TokenData> {
+        FinishReason finishReason = FinishReason::Stop;
+    };
+
+    // invalid requests throw right away
+    // the callbacks get the error (and an empty result) of a request which fails while it's being served
+    // (InferenceError if it's not the fault of the request)
 
-    void completeText(CompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb);
+    // params.n must be 1
+    void completeText(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb);
+
+    void chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, CompleteReponse)> cb);
+
+    // params.n completions of the same prompt, one response per choice
+    // the prompt is decoded once and the choices are generated in parallel, each in a session of the same instance
+    // n can't be more than instanceParams.maxSessions
+    void completeTextChoices(CompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb);
+
+    void chatCompleteChoices(ChatCompleteRequestParams params, itlib::ufunction<void(std::exception_ptr, std::vector<CompleteReponse>)> cb);
+
+    // streaming variants of completeText and chatComplete (params.n must be 1)
+    // onToken is called for each token as soon as it's generated and onDone after the last one (or the error)
+    // both are called from an inference thread
+    struct StreamCallbacks {
+        itlib::ufunction<void(TokenData)> onToken;
+        itlib::ufunction<void(std::exception_ptr, FinishReason)> onDone;
+    };
 
-    void chatComplete(ChatCompleteRequestParams params, itlib::ufunction<void(CompleteReponse)> cb);
+    void completeTextStream(CompleteRequestParams params, StreamCallbacks cbs);
 
-    void verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb);
+    void chatCompleteStream(ChatCompleteRequestParams params, StreamCallbacks cbs);
+
+    void verify(CompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb);
+
+    void chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(std::exception_ptr, float)> cb);
+
+    // cancel the requests made with the flag (from any thread), typically because their client is gone
+    // queued requests are dropped and running ones stop at the next token
+    // either way they are completed with what they have generated so far (nothing if they were dropped)
+    // verifications which haven't started are completed with NaN
+    void cancel(const CancelFlag& flag);
+
+    struct Stats {
+        uint32_t numInstances = 0;
+        uint32_t idleInstances = 0; // instances with no active sessions
+        uint32_t freeSessions = 0; // sessions available in all instances
+
+        uint32_t queued = 0; // requests waiting for a free session
+        uint32_t queuedVerifications = 0; // the verifications among them
+        uint64_t oldestQueuedUs = 0; // time the oldest queued request has been waiting (microseconds)
+        uint64_t rejected = 0; // requests rejected because the queue was full
+        uint64_t rejectedVerifications = 0; // the verifications among them
+        uint64_t cancelledQueued = 0; // requests which were cancelled before they left the queue
+        uint64_t timedOut = 0; // generations which were stopped by their deadline
+        uint64_t timedOutQueued = 0; // requests whose deadline passed before they left the queue
+        uint32_t running = 0; // requests currently being served
+        uint64_t completed = 0; // total requests served
+
+        uint64_t totalQueueWaitUs = 0; // total time spent by completed requests in the queue (microseconds)
+        uint64_t maxQueueWaitUs = 0; // longest time a request has spent in the queue (microseconds)
+
+        // batch steps of generations
+        // steps with prompt tokens are prefill chunks (even if they have generated tokens too), the rest are decode steps
+        // the time of a step is the time between two tokens of the requests which are generating
+        uint64_t prefillChunks = 0;
+        uint64_t prefillTokens = 0; // prompt tokens decoded in the chunks
+        uint64_t totalPrefillChunkUs = 0;
+        uint64_t maxPrefillChunkUs = 0;
+        uint64_t decodeSteps = 0;
+        uint64_t totalDecodeStepUs = 0;
+        uint64_t maxDecodeStepUs = 0;
+
+        // preemption of generations by verifications (see Params::preemption)
+        uint64_t preemptions = 0; // number of swapped out sessions
+        uint64_t swapIns = 0; // number of swapped out sessions which were restored
+        uint64_t swappedBytes = 0; // total size of the snapshots of swapped out sessions
+        uint64_t totalSwapOutUs = 0;
+        uint64_t maxSwapOutUs = 0; // longest time to swap out the sessions for a verification (microseconds)
+        uint64_t totalSwapInUs = 0;
+        uint64_t maxSwapInUs = 0; // longest time to swap in the sessions in a step (microseconds)
+
+        PrefixCache::Stats prefixCache; // all zeroes if the cache is disabled
+        SessionStore::Stats sessionStore; // all zeroes if conversations are disabled
+    };
 
-    void chatVerify(ChatCompleteRequestParams req, CompleteReponse resp, itlib::ufunction<void(float)> cb);
+    // snapshot of the instance pool and request queue
+    Stats stats() const;
 
 private:
     struct Impl;
@@ -0,0 +1,240 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include "SessionStore.hpp"
+
+#include <llama/Session.hpp>
+
+#include <bstl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+namespace bl::llama::server {
+
+SessionStore::SessionStore(Params params)
+    : m_params(std::move(params))
+{
+    if (m_params.maxDiskBytes) {
+        if (m_params.directory.empty()) {
+            throw_ex{} << "Session store needs a directory for its disk tier";
+        }
+        std::filesystem::create_directories(m_params.directory);
+    }
+}
+
+SessionStore::~SessionStore() {
+    clear();
+}
+
+std::string SessionStore::newPath() {
+    // ids are arbitrary strings, so they are not used in file names
+    return (std::filesystem::path(m_params.directory) / ("session-" + std::to_string(m_fileCounter++) + ".blss")).string();
+}
+
+SessionStore::Entry SessionStore::takeEntry(EntryList::iterator it) {
+    m_index.erase(it->id);
+    auto entry = std::move(*it);
+    if (entry.path.empty()) {
+        m_stats.ramBytes -= entry.size;
+        if (entry.spilling) {
+            // the spill finds it gone and drops its file
+            m_spillingBytes -= entry.size;
+            entry.spilling = false;
+        }
+        m_ram.erase(it);
+    }
+    else {
+        m_stats.diskBytes -= entry.size;
+        m_disk.erase(it);
+    }
+    return entry;
+}
+
+void SessionStore::removeEntry(EntryList::iterator it) {
+    auto entry = takeEntry(it);
+    if (!entry.path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(entry.path, ec);
+    }
+}
+
+void SessionStore::evictDisk() {
+    while (m_stats.diskBytes > m_params.maxDiskBytes && !m_disk.empty()) {
+        removeEntry(std::prev(m_disk.end()));
+        ++m_stats.evictions;
+    }
+}
+
+void SessionStore::spill(std::unique_lock<std::mutex>& lock) {
+    // entries stay in host memory (where they can be restored, replaced or erased) while their files are written,
+    // so only the ones which aren't being spilled already count
+    while (m_stats.ramBytes - m_spillingBytes > m_params.maxRamBytes) {
+        auto it = std::find_if(m_ram.rbegin(), m_ram.rend(), [](const Entry& e) { return !e.spilling; }).base();
+        if (it == m_ram.begin()) break;
+        --it;
+
+        if (it->size > m_params.maxDiskBytes) {
+            removeEntry(it);
+            ++m_stats.evictions;
+            continue;
+        }
+
+        it->spilling = true;
+        m_spillingBytes += it->size;
+        const auto id = it->id;
+        const auto blob = it->blob;
+        auto path = newPath();
+
+        lock.unlock();
+        bool written = false;
+        {
+            std::ofstream f(path, std::ios::binary | std::ios::trunc);
+            f.write(reinterpret_cast<const char*>(blob->data()), std::streamsize(blob->size()));
+            written = !!f;
+        }
+        lock.lock();
+
+        auto found = m_index.find(id);
+        if (found == m_index.end() || found->second->blob != blob) {
+            // the entry was restored, replaced or erased in the meantime
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            continue;
+        }
+
+        it = found->second;
+        it->spilling = false;
+        m_spillingBytes -= it->size;
+
+        if (!written) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            removeEntry(it);
+            ++m_stats.evictions;
+            continue;
+        }
+
+        m_stats.ramBytes -= it->size;
+        m_stats.diskBytes += it->size;
+        it->blob = {};
+        it->path = std::move(path);
+        m_disk.splice(m_disk.begin(), m_ram, it); // iterators remain valid, so the index is still good
+        ++m_stats.spills;
+    }
+    evictDisk();
+}
+
+bool SessionStore::park(const std::string& id, Session& session) {
+    // the snapshot is taken without the lock, as the session belongs to the calling thread
+    const auto size = session.snapshotSize();
+
+    Entry entry{.id = id, .size = size};
+    if (size <= m_params.maxRamBytes) {
+        std::vector<uint8_t> blob(size);
+        session.writeSnapshot(blob);
+        entry.blob = std::make_shared<const std::vector<uint8_t>>(std::move(blob));
+    }
+    else if (size <= m_params.maxDiskBytes) {
+        // too big for host memory: write it straight to a file
+        {
+            std::lock_guard lock(m_mutex);
+            entry.path = newPath();
+        }
+        session.saveSnapshot(entry.path);
+    }
+
+    std::unique_lock lock(m_mutex);
+    if (auto it = m_index.find(id); it != m_index.end()) {
+        removeEntry(it->second);
+    }
+
+    if (!entry.blob && entry.path.empty()) {
+        ++m_stats.evictions;
+        return false;
+    }
+
+    if (entry.path.empty()) {
+        m_stats.ramBytes += size;
+        m_ram.push_front(std::move(entry));
+        m_index[id] = m_ram.begin();
+        spill(lock);
+    }
+    else {
+        m_stats.diskBytes += size;
+        m_disk.push_front(std::move(entry));
+        m_index[id] = m_disk.begin();
+        evictDisk();
+    }
+    return true;
+}
+
+bool SessionStore::restore(const std::string& id, Session& session) {
+    Entry entry;
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = m_index.find(id);
+        if (it == m_index.end()) {
+            ++m_stats.misses;
+            return false;
+        }
+
+        entry = takeEntry(it->second);
+        if (entry.path.empty()) {
+            ++m_stats.ramHits;
+        }
+        else {
+            ++m_stats.diskHits;
+        }
+    }
+
+    if (entry.path.empty()) {
+        session.restoreSnapshot(*entry.blob);
+        return true;
+    }
+
+    // the file is removed whether the restore succeeds or not
+    std::error_code ec;
+    try {
+        session.loadSnapshot(entry.path);
+    }
+    catch (...) {
+        std::filesystem::remove(entry.path, ec);
+        throw;
+    }
+    std::filesystem::remove(entry.path, ec);
+    return true;
+}
+
+bool SessionStore::contains(const std::string& id) const {
+    std::lock_guard lock(m_mutex);
+    return m_index.contains(id);
+}
+
+void SessionStore::erase(const std::string& id) {
+    std::lock_guard lock(m_mutex);
+    if (auto it = m_index.find(id); it != m_index.end()) {
+        removeEntry(it->second);
+    }
+}
+
+void SessionStore::clear() {
+    std::lock_guard lock(m_mutex);
+    while (!m_ram.empty()) {
+        removeEntry(m_ram.begin());
+    }
+    while (!m_disk.empty()) {
+        removeEntry(m_disk.begin());
+    }
+}
+
+SessionStore::Stats SessionStore::stats() const {
+    std::lock_guard lock(m_mutex);
+    auto ret = m_stats;
+    ret.ramEntries = m_ram.size();
+    ret.diskEntries = m_disk.size();
+    return ret;
+}
+
+} // namespace bl::llama::server
@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "api.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bl::llama {
+class Session;
+}
+
+namespace bl::llama::server {
+
+// parking lot for idle sessions, so that they don't occupy an instance while their client is away
+// and don't have to decode their whole context again when it comes back
+// sessions are parked as snapshots (see Session::writeSnapshot) keyed by an id (typically a conversation id)
+// and restored into a new session of any instance with the same model and context params
+//
+// there are two tiers, each with a size budget:
+// - host memory: snapshots are kept as blobs, the least recently used ones are moved to disk when it's full
+// - disk (optional): snapshot files in a directory, restored through a memory mapping of the file
+// the least recently used disk entries are dropped when the disk is full
+//
+// thread safe
+class BL_LLAMA_SERVER_API SessionStore {
+public:
+    struct Params {
+        size_t maxRamBytes = size_t(1) << 30; // max total size of the snapshots in host memory
+        size_t maxDiskBytes = 0; // max total size of the snapshot files (0 = no disk tier)
+
+        // the snapshot files are created here (and removed when they are restored or dropped)
+        // must be set if maxDiskBytes is not 0, it's created if it doesn't exist
+        std::string directory;
+    };
+
+    explicit SessionStore(Params params);
+    ~SessionStore();
+
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    // take a snapshot of the session and keep it under id, replacing any previous one
+    // the session is not stopped, it's up to the caller
+    // returns false if the snapshot is too big for both tiers
+    bool park(const std::string& id, Session& session);
+
+    // restore the snapshot with the given id in a session which hasn't started yet
+    // the snapshot is removed from the store, so the session is expected to be parked again when idle
+    // returns false if there is no such snapshot
+    bool restore(const std::string& id, Session& session);
+
+    bool contains(const std::string& id) const;
+
+    // drop the snapshot with the given id (if any)
+    void erase(const std::string& id);
+
+    void clear();
+
+    struct Stats {
+        uint64_t ramHits = 0; // restores from host memory
+        uint64_t diskHits = 0; // restores from disk
+        uint64_t misses = 0; // restores of ids which are not in the store
+        uint64_t spills = 0; // snapshots moved from host memory to disk
+        uint64_t evictions = 0; // snapshots dropped for lack of space
+
+        size_t ramEntries = 0;
+        size_t ramBytes = 0;
+        size_t diskEntries = 0;
+        size_t diskBytes = 0;
+
+        float hitRate() const noexcept {
+            const auto total = ramHits + diskHits + misses;
+            return total ? float(ramHits + diskHits) / float(total) : 0.f;
+        }
+    };
+    Stats stats() const;
+
+    const Params& params() const noexcept { return m_params; }
+
+private:
+    struct Entry {
+        std::string id;
+        size_t size = 0;
+        std::shared_ptr<const std::vector<uint8_t>> blob; // snapshot in host memory (shared with a spill writing it)
+        std::string path; // snapshot file (empty if in host memory)
+        bool spilling = false; // being written to disk
+    };
+    using EntryList = std::list<Entry>; // most recently used first
+
+    std::string newPath();
+    Entry takeEntry(EntryList::iterator it); // unlink an entry from its list and the index
+    void removeEntry(EntryList::iterator it);
+
+    // move entries to disk until host memory fits in its budget
+    // the files are written after releasing the lock, which is locked again when this returns
+    void spill(std::unique_lock<std::mutex>& lock);
+
+    void evictDisk(); // drop entries until disk fits in its budget
+
+    Params m_params;
+
+    mutable std::mutex m_mutex;
+    EntryList m_ram;
+    EntryList m_disk;
+    std::unordered_map<std::string, EntryList::iterator> m_index; // id -> entry in either list
+    uint64_t m_fileCounter = 0;
+    size_t m_spillingBytes = 0; // size of the entries in host memory which are being written to disk
+    Stats m_stats;
+};
+
+} // namespace bl::llama::server
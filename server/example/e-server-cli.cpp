@@ -47,13 +47,18 @@ int main() {
     };
 
     std::latch latch(1);
+    std::exception_ptr error;
     std::vector<bl::llama::server::Server::TokenData> generatedTokens;
-    srv.completeText(req, [&](std::vector<bl::llama::server::Server::TokenData> gen) {
+    srv.completeText(req, [&](std::exception_ptr e, std::vector<bl::llama::server::Server::TokenData> gen) {
+        error = std::move(e);
         generatedTokens = std::move(gen);
         latch.count_down();
     });
 
     latch.wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
     for (auto& g : generatedTokens) {
         std::cout << g.tokenStr;
     }
@@ -0,0 +1,241 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include <server/BatchScheduler.hpp>
+#include <llama/Init.hpp>
+#include <llama/Model.hpp>
+#include <llama/Instance.hpp>
+
+#include <doctest/doctest.h>
+
+#include "ac-test-data-llama-dir.h"
+
+using BatchScheduler = bl::llama::server::BatchScheduler;
+using Outcome = BatchScheduler::Outcome;
+using Predictions = std::vector<bl::llama::TokenPrediction>;
+
+struct GlobalFixture {
+    GlobalFixture() {
+        bl::llama::initLibrary();
+    }
+};
+
+GlobalFixture globalFixture;
+
+const char* Model_117m_q6_k = AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
+
+struct Result {
+    std::vector<Predictions> choices;
+    Outcome outcome = Outcome::Failed;
+    std::exception_ptr error;
+    bool done = false;
+};
+
+BatchScheduler::Request request(bl::llama::Model& model, std::string_view prompt, uint32_t maxTokens, Result& res) {
+    BatchScheduler::Request req;
+    req.prompt = model.vocab().tokenize(prompt, true, true);
+    req.sessionParams.seed = 42;
+    req.maxTokens = maxTokens;
+    req.cb = [&res](std::vector<Predictions> choices, Outcome outcome, std::exception_ptr error) {
+        res.choices = std::move(choices);
+        res.outcome = outcome;
+        res.error = error;
+        res.done = true;
+    };
+    return req;
+}
+
+// step until all requests are finished and return the number of sessions they freed
+uint32_t runAll(BatchScheduler& bs) {
+    uint32_t freed = 0;
+    while (bs.numActive()) {
+        freed += bs.step().freedSessions;
+    }
+    return freed;
+}
+
+std::vector<bl::llama::Token> tokens(const Predictions& predictions) {
+    std::vector<bl::llama::Token> ret;
+    for (auto& p : predictions) {
+        ret.push_back(p.token);
+    }
+    return ret;
+}
+
+TEST_CASE("batch scheduler") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {.maxSessions = 4});
+    BatchScheduler bs(inst, {});
+
+    const char* promptA = "President George W.";
+    const char* promptB = "The capital of France is";
+
+    // sequential runs of each request alone
+    Result seqA, seqB;
+    REQUIRE(bs.admit(request(model, promptA, 10, seqA)));
+    CHECK(runAll(bs) == 1);
+    REQUIRE(bs.admit(request(model, promptB, 10, seqB)));
+    CHECK(runAll(bs) == 1);
+    REQUIRE(seqA.choices.size() == 1);
+    CHECK(seqA.outcome == Outcome::Finished);
+    CHECK(seqA.choices[0].size() == 10);
+    CHECK(inst.numActiveSessions() == 0);
+
+    SUBCASE("concurrent") {
+        Result a, b;
+        REQUIRE(bs.admit(request(model, promptA, 10, a)));
+        bs.step();
+
+        // b joins while a is generating
+        REQUIRE(bs.admit(request(model, promptB, 10, b)));
+        CHECK(bs.numActive() == 2);
+        CHECK(runAll(bs) == 2);
+
+        CHECK(a.outcome == Outcome::Finished);
+        CHECK(b.outcome == Outcome::Finished);
+        CHECK(tokens(a.choices[0]) == tokens(seqA.choices[0]));
+        CHECK(tokens(b.choices[0]) == tokens(seqB.choices[0]));
+    }
+
+    SUBCASE("choices") {
+        Result multi;
+        auto req = request(model, promptA, 10, multi);
+        req.n = 3;
+        REQUIRE(bs.admit(std::move(req)));
+        CHECK(runAll(bs) == 3);
+        CHECK(multi.outcome == Outcome::Finished);
+        REQUIRE(multi.choices.size() == 3);
+
+        // choice i is the same as a single run with seed + i
+        for (uint32_t i = 0; i < 3; ++i) {
+            Result single;
+            auto sreq = request(model, promptA, 10, single);
+            sreq.sessionParams.seed += i;
+            REQUIRE(bs.admit(std::move(sreq)));
+            runAll(bs);
+            CHECK(tokens(multi.choices[i]) == tokens(single.choices[0]));
+        }
+
+        // the other choices are not forked from a request without generation
+        Result empty;
+        req = request(model, promptA, 0, empty);
+        req.n = 3;
+        REQUIRE(bs.admit(std::move(req)));
+        CHECK(runAll(bs) == 3);
+        CHECK(empty.outcome == Outcome::Finished);
+        CHECK(empty.choices.size() == 3);
+        CHECK(inst.numActiveSessions() == 0);
+    }
+
+    SUBCASE("too many choices") {
+        Result res;
+        auto req = request(model, promptA, 10, res);
+        req.n = 5;
+        CHECK_FALSE(bs.admit(std::move(req)));
+        CHECK(res.done);
+        CHECK(res.outcome == Outcome::Rejected);
+        CHECK(res.error);
+        CHECK(res.choices.size() == 5);
+        CHECK(bs.numActive() == 0);
+        CHECK(inst.numActiveSessions() == 0);
+    }
+
+    SUBCASE("preempt") {
+        Result a, b;
+        REQUIRE(bs.admit(request(model, promptA, 10, a)));
+        auto req = request(model, promptB, 10, b);
+        req.n = 3;
+        REQUIRE(bs.admit(std::move(req)));
+        bs.step();
+        bs.step();
+
+        // all sessions are taken
+        CHECK(inst.numActiveSessions() == 4);
+
+        // b is preempted first, as it was admitted last
+        auto pr = bs.preempt(1);
+        CHECK(pr.freed);
+        CHECK(pr.swappedOut == 1);
+        CHECK(pr.swappedBytes > 0);
+        CHECK(bs.numSwapped() == 1);
+        CHECK(inst.numActiveSessions() == 3);
+
+        // new requests can't take the session the swapped out choice is waiting for
+        Result c;
+        CHECK_FALSE(bs.admit(request(model, promptA, 10, c)));
+        CHECK(c.outcome == Outcome::Rejected);
+
+        // and it's swapped back in on the next step
+        auto sr = bs.step();
+        CHECK(sr.swappedIn == 1);
+        CHECK(bs.numSwapped() == 0);
+
+        CHECK(runAll(bs) == 4);
+        CHECK(a.outcome == Outcome::Finished);
+        CHECK(b.outcome == Outcome::Finished);
+        CHECK(tokens(a.choices[0]) == tokens(seqA.choices[0]));
+        CHECK(tokens(b.choices[0]) == tokens(seqB.choices[0]));
+        for (auto& choice : b.choices) {
+            CHECK(choice.size() == 10);
+        }
+    }
+
+    SUBCASE("cancel") {
+        Result a;
+        auto cancel = std::make_shared<std::atomic_bool>(false);
+        auto req = request(model, promptA, 10, a);
+        req.n = 2;
+        req.cancel = cancel;
+        REQUIRE(bs.admit(std::move(req)));
+        bs.step();
+        bs.step();
+        bs.step();
+
+        // a swapped out choice frees the session it's waiting for
+        CHECK(bs.preempt(3).swappedOut == 1);
+
+        cancel->store(true);
+        auto sr = bs.step();
+        CHECK(sr.finished == 1);
+        CHECK(sr.timedOut == 0);
+        CHECK(sr.freedSessions == 2);
+        CHECK(bs.numActive() == 0);
+        CHECK(bs.numSwapped() == 0);
+        CHECK(inst.numActiveSessions() == 0);
+
+        CHECK(a.outcome == Outcome::Cancelled);
+        CHECK_FALSE(a.error);
+        REQUIRE(a.choices.size() == 2);
+        REQUIRE(a.choices[0].size() == 3);
+
+        // the partial output is the beginning of the full one
+        auto full = tokens(seqA.choices[0]);
+        full.resize(3);
+        CHECK(tokens(a.choices[0]) == full);
+    }
+
+    SUBCASE("deadline") {
+        Result a, b;
+        auto req = request(model, promptA, 10, a);
+        req.deadline = std::chrono::steady_clock::now();
+        REQUIRE(bs.admit(std::move(req)));
+        REQUIRE(bs.admit(request(model, promptB, 10, b)));
+
+        auto sr = bs.step();
+        CHECK(sr.finished == 1);
+        CHECK(sr.timedOut == 1);
+        CHECK(sr.freedSessions == 1);
+        CHECK(a.outcome == Outcome::TimedOut);
+        REQUIRE(a.choices.size() == 1);
+        CHECK(a.choices[0].empty());
+
+        // the other request is not affected
+        CHECK(runAll(bs) == 1);
+        CHECK(b.outcome == Outcome::Finished);
+        CHECK(tokens(b.choices[0]) == tokens(seqB.choices[0]));
+    }
+
+    // all sessions were given back
+    runAll(bs);
+    CHECK(inst.numActiveSessions() == 0);
+}
@@ -0,0 +1,101 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include <server/SchedulingPolicy.hpp>
+
+#include <doctest/doctest.h>
+
+#include <vector>
+
+using namespace bl::llama::server;
+using Job = SchedulingPolicy::Job;
+using JobClass = SchedulingPolicy::JobClass;
+
+namespace {
+// dispatch all jobs with the policy and return their ids in the order of dispatch
+std::vector<uint64_t> dispatchAll(SchedulingPolicy& policy, std::vector<Job> jobs) {
+    std::vector<const Job*> queue;
+    for (auto& j : jobs) {
+        queue.push_back(&j);
+    }
+
+    std::vector<uint64_t> order;
+    while (!queue.empty()) {
+        const auto i = policy.next(queue);
+        REQUIRE(i < queue.size());
+        policy.dispatched(*queue[i]);
+        order.push_back(queue[i]->id);
+        queue.erase(queue.begin() + i);
+    }
+    return order;
+}
+} // namespace
+
+TEST_CASE("fifo") {
+    FifoPolicy policy;
+    // jobs which failed to preempt go back to the front of the queue, so the queue is not always in order
+    CHECK(dispatchAll(policy, {{.id = 2}, {.id = 0}, {.id = 1}}) == std::vector<uint64_t>{0, 1, 2});
+}
+
+TEST_CASE("class queues") {
+    ClassQueuesPolicy policy({.verifyWeight = 2});
+
+    const std::vector<Job> jobs = {
+        {.id = 0, .jobClass = JobClass::Complete},
+        {.id = 1, .jobClass = JobClass::Verify},
+        {.id = 2, .jobClass = JobClass::Verify},
+        {.id = 3, .jobClass = JobClass::Verify},
+        {.id = 4, .jobClass = JobClass::Complete},
+        {.id = 5, .jobClass = JobClass::Verify},
+    };
+
+    // two verifications for each generation while both wait
+    CHECK(dispatchAll(policy, jobs) == std::vector<uint64_t>{1, 2, 0, 3, 5, 4});
+
+    // a single class is in the order of arrival
+    ClassQueuesPolicy single({.verifyWeight = 1});
+    CHECK(dispatchAll(single, {{.id = 1, .jobClass = JobClass::Verify}, {.id = 0, .jobClass = JobClass::Verify}})
+        == std::vector<uint64_t>{0, 1});
+}
+
+TEST_CASE("shortest job first") {
+    const auto now = SchedulingPolicy::clock::now();
+
+    SUBCASE("cost") {
+        ShortestJobFirstPolicy policy({.agingTokensPerSec = 0});
+        const std::vector<Job> jobs = {
+            {.id = 0, .promptTokens = 100, .maxTokens = 10, .enqueueTime = now}, // 110
+            {.id = 1, .numSessions = 4, .promptTokens = 10, .maxTokens = 10, .enqueueTime = now}, // 50
+            {.id = 2, .promptTokens = 5, .maxTokens = 5, .enqueueTime = now}, // 10
+            {.id = 3, .promptTokens = 40, .maxTokens = 10, .enqueueTime = now}, // 50, after 1 on ties
+        };
+        CHECK(dispatchAll(policy, jobs) == std::vector<uint64_t>{2, 1, 3, 0});
+    }
+
+    SUBCASE("aging") {
+        // a long job which has waited 10s is cheaper than a short new one
+        ShortestJobFirstPolicy policy({.agingTokensPerSec = 100});
+        const std::vector<Job> jobs = {
+            {.id = 0, .promptTokens = 900, .maxTokens = 50, .enqueueTime = now - std::chrono::seconds(10)},
+            {.id = 1, .promptTokens = 10, .maxTokens = 10, .enqueueTime = now},
+        };
+        CHECK(dispatchAll(policy, jobs) == std::vector<uint64_t>{0, 1});
+
+        ShortestJobFirstPolicy noAging({.agingTokensPerSec = 0});
+        CHECK(dispatchAll(noAging, jobs) == std::vector<uint64_t>{1, 0});
+    }
+}
+
+TEST_CASE("earliest deadline first") {
+    const auto now = SchedulingPolicy::clock::now();
+    using namespace std::chrono_literals;
+
+    EarliestDeadlineFirstPolicy policy({.defaultDeadline = 5s});
+    const std::vector<Job> jobs = {
+        {.id = 0, .enqueueTime = now, .deadline = now + 10s},
+        {.id = 1, .enqueueTime = now}, // now + 5s
+        {.id = 2, .enqueueTime = now, .deadline = now + 1s},
+        {.id = 3, .enqueueTime = now - 3s}, // now + 2s
+    };
+    CHECK(dispatchAll(policy, jobs) == std::vector<uint64_t>{2, 3, 1, 0});
+}
@@ -0,0 +1,168 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include <server/Server.hpp>
+#include <llama/Init.hpp>
+#include <llama/Model.hpp>
+
+#include <doctest/doctest.h>
+
+#include <future>
+
+#include "ac-test-data-llama-dir.h"
+
+using Server = bl::llama::server::Server;
+
+struct GlobalFixture {
+    GlobalFixture() {
+        bl::llama::initLibrary();
+    }
+};
+
+GlobalFixture globalFixture;
+
+const char* Model_117m_q6_k = AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
+
+Server::CompleteReponse chat(Server& srv, Server::ChatCompleteRequestParams params) {
+    std::promise<Server::CompleteReponse> promise;
+    srv.chatComplete(std::move(params), [&](std::exception_ptr e, Server::CompleteReponse response) {
+        if (e) {
+            promise.set_exception(e);
+        }
+        else {
+            promise.set_value(std::move(response));
+        }
+    });
+    return promise.get_future().get();
+}
+
+Server::CompleteReponse complete(Server& srv, Server::CompleteRequestParams params) {
+    std::promise<Server::CompleteReponse> promise;
+    srv.completeText(std::move(params), [&](std::exception_ptr e, Server::CompleteReponse response) {
+        if (e) {
+            promise.set_exception(e);
+        }
+        else {
+            promise.set_value(std::move(response));
+        }
+    });
+    return promise.get_future().get();
+}
+
+std::vector<Server::CompleteReponse> completeChoices(Server& srv, Server::CompleteRequestParams params) {
+    std::promise<std::vector<Server::CompleteReponse>> promise;
+    srv.completeTextChoices(std::move(params), [&](std::exception_ptr e, std::vector<Server::CompleteReponse> choices) {
+        if (e) {
+            promise.set_exception(e);
+        }
+        else {
+            promise.set_value(std::move(choices));
+        }
+    });
+    return promise.get_future().get();
+}
+
+std::string toText(const Server::CompleteReponse& response) {
+    std::string text;
+    for (auto& t : response) {
+        text += t.tokenStr;
+    }
+    return text;
+}
+
+TEST_CASE("conversation") {
+    auto model = std::make_shared<bl::llama::Model>(Model_117m_q6_k, bl::llama::Model::Params{});
+    Server srv(model, {.sessionStore = {.maxRamBytes = 64 * 1024 * 1024}});
+
+    std::vector<Server::ChatCompleteRequestParams::Message> messages = {
+        {.role = "user", .content = "What is the capital of France?"},
+    };
+
+    auto first = chat(srv, {.messages = messages, .maxTokens = 10, .temperature = 0, .conversationId = "c"});
+    messages.push_back({.role = "assistant", .content = toText(first)});
+    messages.push_back({.role = "user", .content = "And the capital of Germany?"});
+
+    // the second turn continues the parked session of the first one
+    auto second = chat(srv, {.messages = messages, .maxTokens = 10, .temperature = 0, .conversationId = "c"});
+    CHECK(srv.stats().sessionStore.ramHits == 1);
+
+    // and is the same as a request for the whole chat
+    auto stateless = chat(srv, {.messages = messages, .maxTokens = 10, .temperature = 0});
+    REQUIRE(second.size() == stateless.size());
+    for (size_t i = 0; i < second.size(); ++i) {
+        CHECK(second[i].tokenId == stateless[i].tokenId);
+    }
+    CHECK(second.finishReason == stateless.finishReason);
+}
+
+TEST_CASE("choices") {
+    auto model = std::make_shared<bl::llama::Model>(Model_117m_q6_k, bl::llama::Model::Params{});
+    Server srv(model, {.instanceParams = {.maxSessions = 3}});
+
+    Server::CompleteRequestParams params = {.prompt = "The capital of France is", .maxTokens = 10, .seed = 42, .n = 3};
+    auto choices = completeChoices(srv, params);
+    REQUIRE(choices.size() == 3);
+
+    // choice i is the same as a single completion with seed + i
+    for (uint32_t i = 0; i < 3; ++i) {
+        auto single = complete(srv, {.prompt = params.prompt, .maxTokens = 10, .seed = 42 + i});
+        REQUIRE(choices[i].size() == single.size());
+        for (size_t t = 0; t < single.size(); ++t) {
+            CHECK(choices[i][t].tokenId == single[t].tokenId);
+        }
+        CHECK(choices[i].finishReason == single.finishReason);
+    }
+
+    auto noop = [](std::exception_ptr, std::vector<Server::CompleteReponse>) {};
+    params.n = 4;
+    CHECK_THROWS_WITH(srv.completeTextChoices(params, noop), "Number of choices must be between 1 and 3, got 4");
+    params.n = 0;
+    CHECK_THROWS_WITH(srv.completeTextChoices(params, noop), "Number of choices must be between 1 and 3, got 0");
+
+    // single choice requests
+    params.n = 2;
+    CHECK_THROWS_WITH(srv.completeText(params, [](std::exception_ptr, Server::CompleteReponse) {}),
+        "Multiple choices (n = 2) are not supported by this request");
+}
+
+TEST_CASE("queue limits") {
+    auto model = std::make_shared<bl::llama::Model>(Model_117m_q6_k, bl::llama::Model::Params{});
+    Server srv(model, {.queueLimits = {.maxQueued = 1}});
+
+    auto request = [&](Server::CancelFlag cancel, std::promise<Server::CompleteReponse>& promise) {
+        srv.completeText({.prompt = "The capital of France is", .maxTokens = 1000, .cancel = std::move(cancel)},
+            [&promise](std::exception_ptr e, Server::CompleteReponse response) {
+                if (e) {
+                    promise.set_exception(e);
+                }
+                else {
+                    promise.set_value(std::move(response));
+                }
+            });
+    };
+
+    // the first request takes the only session and the second one waits in the queue
+    auto cancel1 = std::make_shared<std::atomic_bool>(false);
+    auto cancel2 = std::make_shared<std::atomic_bool>(false);
+    std::promise<Server::CompleteReponse> p1, p2, p3;
+    request(cancel1, p1);
+    request(cancel2, p2);
+
+    // so the third one doesn't fit
+    bool rejected = false;
+    try {
+        request(nullptr, p3);
+    }
+    catch (const Server::QueueFullError& e) {
+        rejected = true;
+        CHECK(std::string(e.what()) == "Server is busy, the request queue is full");
+        CHECK(e.retryAfter() >= std::chrono::seconds(1));
+    }
+    CHECK(rejected);
+    CHECK(srv.stats().rejected == 1);
+
+    srv.cancel(cancel2);
+    CHECK(p2.get_future().get().finishReason == Server::FinishReason::Cancelled);
+    srv.cancel(cancel1);
+    p1.get_future().get();
+}
@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: Copyright (c) 2025 Schelling Point Ventures Inc.
+// SPDX-License-Identifier: MIT
+//
+#include <server/SessionStore.hpp>
+#include <llama/Init.hpp>
+#include <llama/Model.hpp>
+#include <llama/Instance.hpp>
+#include <llama/Session.hpp>
+
+#include <doctest/doctest.h>
+
+#include <filesystem>
+#include <optional>
+
+#include "ac-test-data-llama-dir.h"
+
+using SessionStore = bl::llama::server::SessionStore;
+
+struct GlobalFixture {
+    GlobalFixture() {
+        bl::llama::initLibrary();
+    }
+};
+
+GlobalFixture globalFixture;
+
+const char* Model_117m_q6_k = AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
+
+TEST_CASE("session store") {
+    bl::llama::Model model(Model_117m_q6_k, {});
+    bl::llama::Instance inst(model, {});
+
+    auto toString = [&](const std::vector<bl::llama::TokenPrediction>& predictions) {
+        std::string str;
+        for (auto& p : predictions) {
+            str += model.vocab().tokenToString(p.token);
+        }
+        return str;
+    };
+
+    // a session with the prompt, parked under id, and what it generates after that
+    auto parkNew = [&](SessionStore& store, const std::string& id, std::string_view prompt) {
+        auto& s = inst.startSession({.seed = 42});
+        s.setInitialPrompt(model.vocab().tokenize(prompt, true, true));
+        s.complete({.maxTokens = 5});
+        const bool parked = store.park(id, s);
+        auto str = toString(s.complete({.maxTokens = 10}));
+        inst.stopSession(s);
+        return std::make_pair(parked, str);
+    };
+
+    auto restore = [&](SessionStore& store, const std::string& id) -> std::optional<std::string> {
+        auto& s = inst.startSession({});
+        std::optional<std::string> str;
+        if (store.restore(id, s)) {
+            str = toString(s.complete({.maxTokens = 10}));
+        }
+        inst.stopSession(s);
+        return str;
+    };
+
+    // the snapshots of the prompts below have about the same size
+    size_t snapshotSize;
+    {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(model.vocab().tokenize("France has a long history of", true, true));
+        s.complete({.maxTokens = 5});
+        snapshotSize = s.snapshotSize();
+        inst.stopSession(s);
+    }
+
+    const auto dir = (std::filesystem::temp_directory_path() / "bl-llama-test-session-store").string();
+    std::filesystem::remove_all(dir);
+
+    SUBCASE("ram") {
+        SessionStore store({.maxRamBytes = 4 * snapshotSize});
+
+        auto [parked, generated] = parkNew(store, "a", "France has a long history of");
+        CHECK(parked);
+        CHECK(store.contains("a"));
+        CHECK(store.stats().ramEntries == 1);
+
+        CHECK(restore(store, "a") == generated);
+        CHECK_FALSE(store.contains("a"));
+
+        // restored snapshots are removed from the store
+        CHECK_FALSE(restore(store, "a").has_value());
+
+        auto stats = store.stats();
+        CHECK(stats.ramHits == 1);
+        CHECK(stats.misses == 1);
+        CHECK(stats.ramEntries == 0);
+        CHECK(stats.ramBytes == 0);
+    }
+
+    SUBCASE("ram eviction") {
+        // room for one snapshot and no disk
+        SessionStore store({.maxRamBytes = snapshotSize + snapshotSize / 2});
+
+        CHECK(parkNew(store, "a", "France has a long history of").first);
+        CHECK(parkNew(store, "b", "Germany has a long history of").first);
+
+        // the least recently used one is dropped
+        CHECK_FALSE(store.contains("a"));
+        CHECK(store.contains("b"));
+        CHECK(store.stats().evictions == 1);
+
+        // too big for any tier
+        SessionStore tiny({.maxRamBytes = snapshotSize / 2});
+        CHECK_FALSE(parkNew(tiny, "a", "France has a long history of").first);
+        CHECK_FALSE(tiny.contains("a"));
+    }
+
+    SUBCASE("disk") {
+        SessionStore store({
+            .maxRamBytes = snapshotSize + snapshotSize / 2,
+            .maxDiskBytes = snapshotSize + snapshotSize / 2,
+            .directory = dir,
+        });
+
+        auto a = parkNew(store, "a", "France has a long history of");
+        auto b = parkNew(store, "b", "Germany has a long history of");
+        CHECK(a.first);
+        CHECK(b.first);
+
+        // a is spilled to disk
+        auto stats = store.stats();
+        CHECK(stats.spills == 1);
+        CHECK(stats.ramEntries == 1);
+        CHECK(stats.diskEntries == 1);
+        CHECK(std::distance(std::filesystem::directory_iterator(dir), {}) == 1);
+
+        CHECK(restore(store, "a") == a.second);
+        CHECK(store.stats().diskHits == 1);
+        CHECK(std::filesystem::is_empty(dir));
+
+        CHECK(restore(store, "b") == b.second);
+        CHECK(store.stats().ramHits == 1);
+
+        // the disk tier drops its least recently used entries too
+        CHECK(parkNew(store, "a", "France has a long history of").first);
+        CHECK(parkNew(store, "b", "Germany has a long history of").first);
+        CHECK(parkNew(store, "c", "Britain has a long history of").first);
+        CHECK_FALSE(store.contains("a"));
+        CHECK(store.contains("b"));
+        CHECK(store.contains("c"));
+        CHECK(store.stats().evictions == 1);
+
+        store.clear();
+        CHECK(std::filesystem::is_empty(dir));
+    }
+
+    std::filesystem::remove_all(dir);
+}